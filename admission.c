@@ -0,0 +1,211 @@
+/*
+ * Copyright 2023 zhenwei pi
+ *
+ * Authors:
+ *   zhenwei pi <pizhenwei@bytedance.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "admission.h"
+
+#define ADMISSION_BUCKETS	4096
+#define ADMISSION_LOCKS		64
+
+struct admission_config admission_config = {
+	.rate = DEFAULT_RATE_LIMIT,
+};
+
+/*
+ * Decoding lanes leave a quarter of the burst to the cheap ones, so a client
+ * exporting samples still gets its dashboard served.
+ */
+struct admission_lane_def {
+	const char *name;
+	int cost;		/* tokens of a request */
+	int reserve;		/* keep burst/reserve tokens untouched, 0 takes them all */
+};
+
+static struct admission_lane_def admission_lanes[ADMISSION_LANE_MAX] = {
+	[ADMISSION_LANE_STATIC] = { "static", 1, 0 },
+	[ADMISSION_LANE_LATEST] = { "latest", 1, 0 },
+	[ADMISSION_LANE_HISTORY] = { "history", 4, 4 },
+	[ADMISSION_LANE_BULK] = { "bulk", 16, 4 },
+};
+
+/* updated by all the workers */
+struct admission_counter {
+	int inflight;
+	unsigned long admitted;
+	unsigned long limited;	/* 429 */
+	unsigned long rejected;	/* 503 */
+};
+
+static struct admission_counter admission_counters[ADMISSION_LANE_MAX];
+
+/*
+ * Token buckets indexed by the hash of client address. Clients of the same
+ * hash share a bucket, that's rare and only stricter, and memory is bounded
+ * whatever the number of clients is. Tokens are in 1/1000.
+ */
+struct admission_bucket {
+	long tokens;
+	long last_ms;
+};
+
+static struct admission_bucket admission_buckets[ADMISSION_BUCKETS];
+static pthread_mutex_t admission_locks[ADMISSION_LOCKS] = {
+	[0 ... ADMISSION_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+void admission_init(int workers)
+{
+	struct admission_config *config = &admission_config;
+
+	if (!config->burst)
+		config->burst = config->rate * 4;
+
+	/* keep some workers for dashboards, decoding is CPU bound */
+	if (!config->max_inflight[ADMISSION_LANE_HISTORY])
+		config->max_inflight[ADMISSION_LANE_HISTORY] = (workers + 1) / 2;
+
+	if (!config->max_inflight[ADMISSION_LANE_BULK])
+		config->max_inflight[ADMISSION_LANE_BULK] = workers > 4 ? workers / 4 : 1;
+}
+
+int admission_lane_by_name(const char *name)
+{
+	for (int lane = 0; lane < ADMISSION_LANE_MAX; lane++) {
+		if (!strcmp(admission_lanes[lane].name, name))
+			return lane;
+	}
+
+	return -1;
+}
+
+/* FNV-1a */
+static uint32_t admission_hash(const unsigned char *bytes, size_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+uint32_t admission_client_key(const struct sockaddr *addr, socklen_t addrlen)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+	const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)addr;
+
+	/* 0 is not rate limited, Ex, a local socket */
+	if ((addr->sa_family == AF_INET) && (addrlen >= sizeof(*sin)))
+		return admission_hash((const unsigned char *)&sin->sin_addr, 4) | 1;
+
+	if ((addr->sa_family == AF_INET6) && (addrlen >= sizeof(*sin6))) {
+		if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+			return admission_hash(sin6->sin6_addr.s6_addr + 12, 4) | 1;
+
+		return admission_hash(sin6->sin6_addr.s6_addr, 8) | 1;
+	}
+
+	return 0;
+}
+
+static long admission_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* take tokens of @lane from the bucket of @key, return 0 on success */
+static int admission_take(uint32_t key, int lane)
+{
+	struct admission_lane_def *def = &admission_lanes[lane];
+	struct admission_bucket *bucket = &admission_buckets[key % ADMISSION_BUCKETS];
+	pthread_mutex_t *lock = &admission_locks[key % ADMISSION_LOCKS];
+	long burst = admission_config.burst * 1000L;
+	long need = def->cost * 1000L;
+	long now = admission_now_ms();
+	int ret = 0;
+
+	pthread_mutex_lock(lock);
+	if (!bucket->last_ms) {
+		bucket->tokens = burst;
+	} else {
+		/* rate tokens per second is rate/1000 tokens per ms */
+		bucket->tokens += (now - bucket->last_ms) * admission_config.rate;
+		if (bucket->tokens > burst)
+			bucket->tokens = burst;
+	}
+	bucket->last_ms = now;
+
+	if (bucket->tokens >= need + (def->reserve ? burst / def->reserve : 0))
+		bucket->tokens -= need;
+	else
+		ret = -EAGAIN;
+	pthread_mutex_unlock(lock);
+
+	return ret;
+}
+
+int admission_enter(int lane, uint32_t key)
+{
+	struct admission_counter *counter = &admission_counters[lane];
+	int max_inflight = admission_config.max_inflight[lane];
+
+	if (__atomic_add_fetch(&counter->inflight, 1, __ATOMIC_RELAXED) > max_inflight && max_inflight) {
+		__atomic_sub_fetch(&counter->inflight, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&counter->rejected, 1, __ATOMIC_RELAXED);
+		return -EBUSY;
+	}
+
+	if (key && admission_config.rate && admission_take(key, lane)) {
+		__atomic_sub_fetch(&counter->inflight, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&counter->limited, 1, __ATOMIC_RELAXED);
+		return -EAGAIN;
+	}
+
+	__atomic_add_fetch(&counter->admitted, 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void admission_exit(int lane)
+{
+	__atomic_sub_fetch(&admission_counters[lane].inflight, 1, __ATOMIC_RELAXED);
+}
+
+int admission_stats(char *buf, size_t size)
+{
+	int len, ret;
+
+	len = snprintf(buf, size, "\"lanes\": [");
+	for (int lane = 0; lane < ADMISSION_LANE_MAX; lane++) {
+		struct admission_counter *counter = &admission_counters[lane];
+
+		ret = snprintf(buf + len, len < size ? size - len : 0,
+			       "%s{\"name\": \"%s\", \"max_inflight\": %d, \"inflight\": %d, \"admitted\": %lu, \"limited\": %lu, \"rejected\": %lu}",
+			       lane ? ", " : "", admission_lanes[lane].name, admission_config.max_inflight[lane],
+			       __atomic_load_n(&counter->inflight, __ATOMIC_RELAXED),
+			       __atomic_load_n(&counter->admitted, __ATOMIC_RELAXED),
+			       __atomic_load_n(&counter->limited, __ATOMIC_RELAXED),
+			       __atomic_load_n(&counter->rejected, __ATOMIC_RELAXED));
+		len += ret;
+	}
+	len += snprintf(buf + len, len < size ? size - len : 0, "]");
+
+	return len;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright 2023 zhenwei pi
+ *
+ * Authors:
+ *   zhenwei pi <pizhenwei@bytedance.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef _ADMISSION_H_
+#define _ADMISSION_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+/* requests are classified by cost, a lane of the cheaper ones goes first */
+enum admission_lane {
+	ADMISSION_LANE_STATIC,	/* assets, ping, stats */
+	ADMISSION_LANE_LATEST,	/* the latest sample, for dashboards */
+	ADMISSION_LANE_HISTORY,	/* decode a sample in the past */
+	ADMISSION_LANE_BULK,	/* decode all the labels, Ex, lables=ALL */
+	ADMISSION_LANE_MAX
+};
+
+struct admission_config {
+	int rate;		/* tokens per second of a client, 0 disables rate limit */
+	int burst;		/* tokens a client saves up */
+	int max_inflight[ADMISSION_LANE_MAX];	/* of all the workers, 0 is unlimited */
+};
+
+#define DEFAULT_RATE_LIMIT	0	/* off, clients behind a proxy share its address */
+
+extern struct admission_config admission_config;
+
+/* set the defaults which depend on the number of workers */
+void admission_init(int workers);
+
+/* the lane by name, or -1 */
+int admission_lane_by_name(const char *name);
+
+/* clients are rate limited by address, IPv6 ones by the /64 prefix */
+uint32_t admission_client_key(const struct sockaddr *addr, socklen_t addrlen);
+
+/*
+ * Admit a request of @lane from the client of @key. Return 0 and the caller
+ * calls admission_exit() once it's handled, -EAGAIN if the client runs out of
+ * tokens (429), or -EBUSY if the lane is full (503).
+ */
+int admission_enter(int lane, uint32_t key);
+void admission_exit(int lane);
+
+/* counters of the lanes in JSON, return the length */
+int admission_stats(char *buf, size_t size);
+
+#endif
@@ -1,5 +1,8 @@
 #!/usr/bin/python
+import argparse
 import requests
+import sys
+import threading
 import time
 
 url_status = {"favicon.ico": 200,\
@@ -14,21 +17,47 @@ url_status = {"favicon.ico": 200,\
               "showsamp?lables=ALL&timestamp=" + str(int(time.time())): 200,\
               "notexist": 404}
 
-def bench():
-    for num in range(0, 100):
+failed = []
+
+def bench(baseurl, rounds, keepalive):
+    # a session reuses the connection, plain requests.get() connects per request
+    getter = requests.Session().get if keepalive else requests.get
+    for num in range(0, rounds):
         for url, status in url_status.items():
-            request = 'http://127.0.0.1:2867/' + url
-            result = requests.get(request)
+            request = baseurl + url
+            result = getter(request)
             if result.status_code != status:
-                sys.exit(request + " failed!")
+                failed.append(request)
+                return
 
 def main():
-    pingurl = 'http://127.0.0.1:2867/ping'
+    parser = argparse.ArgumentParser(description="atophttpd benchmark")
+    parser.add_argument("-a", "--addr", default="127.0.0.1", help="server address, default 127.0.0.1")
+    parser.add_argument("-p", "--port", type=int, default=2867, help="server port, default 2867")
+    parser.add_argument("-n", "--rounds", type=int, default=100, help="rounds of all the URLs per client, default 100")
+    parser.add_argument("-c", "--clients", type=int, default=1, help="concurrent clients, default 1")
+    parser.add_argument("-k", "--keepalive", action="store_true", help="reuse connections")
+    args = parser.parse_args()
+
+    baseurl = "http://%s:%d/" % (args.addr, args.port)
+    pingurl = baseurl + 'ping'
     ping = requests.get(pingurl)
     if ping.status_code != 200:
         sys.exit(pingurl + " failed!")
 
-    bench()
+    clients = [threading.Thread(target=bench, args=(baseurl, args.rounds, args.keepalive)) for i in range(args.clients)]
+    start = time.time()
+    for client in clients:
+        client.start()
+    for client in clients:
+        client.join()
+    elapsed = time.time() - start
+
+    if failed:
+        sys.exit(failed[0] + " failed!")
+
+    total = args.clients * args.rounds * len(url_status)
+    print("%d requests by %d clients in %.2fs, %.0f requests/s" % (total, args.clients, elapsed, total / elapsed))
 
 if __name__ == "__main__":
     main()
@@ -8,17 +8,174 @@
  * See the COPYING file in the top-level directory.
  */
 
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "cache.h"
 
 #define RECORDS_TRUNK (60 * 60 / 10)
 
+/*
+ * The draft index, updated by the rescan thread only. Readers never see it,
+ * they get the snapshots published by cache_publish().
+ */
 static int nr_caches;
 static struct cache_t **caches;
+static int caches_dirty;
+
+/*
+ * The latest snapshot. A reader holds a reference to the one it used last in
+ * a thread local, and takes the latest one by the lock only if it's changed.
+ * An old snapshot is freed by the last reader moving on, no reader waits on
+ * a rescan.
+ */
+static struct cache_index *cache_index_latest;
+static pthread_mutex_t cache_index_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct cache_index *cache_index_local;
+
+static void cache_put(struct cache_t *cache)
+{
+	if (__atomic_sub_fetch(&cache->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	free(cache->blocks);
+	free(cache->elems);
+	free(cache->name);
+	free(cache);
+}
+
+static int cache_nr_blocks(int nr_elems)
+{
+	return (nr_elems + CACHE_BLOCK_ELEMS - 1) / CACHE_BLOCK_ELEMS;
+}
+
+static void cache_grow(struct cache_t *cache, int max_elems)
+{
+	cache->max_elems = max_elems;
+	cache->blocks = realloc(cache->blocks, sizeof(struct cache_block) * cache_nr_blocks(max_elems));
+	cache->elems = realloc(cache->elems, sizeof(struct cache_elem_t) * max_elems);
+	assert(cache->blocks && cache->elems);
+}
+
+static void cache_index_put(struct cache_index *index)
+{
+	if (!index || __atomic_sub_fetch(&index->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	for (int i = 0; i < index->nr_caches; i++)
+		cache_put(index->caches[i]);
+
+	free(index->ranges);
+	free(index->caches);
+	free(index);
+}
+
+struct cache_index *cache_index_get()
+{
+	struct cache_index *index = __atomic_load_n(&cache_index_latest, __ATOMIC_ACQUIRE);
+
+	/* the local one is referenced, it can't be freed and reused as the latest */
+	if (index == cache_index_local)
+		return index;
+
+	pthread_mutex_lock(&cache_index_lock);
+	index = cache_index_latest;
+	if (index)
+		__atomic_add_fetch(&index->refs, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&cache_index_lock);
+
+	cache_index_put(cache_index_local);
+	cache_index_local = index;
+
+	return index;
+}
+
+void cache_index_release()
+{
+	cache_index_put(cache_index_local);
+	cache_index_local = NULL;
+}
+
+static int cache_range_cmp(const void *p1, const void *p2)
+{
+	const struct cache_range *r1 = p1, *r2 = p2;
+
+	if (r1->first != r2->first)
+		return r1->first < r2->first ? -1 : 1;
+
+	return (r1->last > r2->last) - (r1->last < r2->last);
+}
+
+/* ranges of a rawlog may overlap the others, Ex, atop restarts */
+static void cache_index_build_ranges(struct cache_index *index)
+{
+	struct cache_range *range;
+
+	index->ranges = calloc(index->nr_caches ? index->nr_caches : 1, sizeof(struct cache_range));
+	assert(index->ranges);
+
+	for (int i = 0; i < index->nr_caches; i++) {
+		struct cache_t *cache = index->caches[i];
+
+		if (!cache->nr_elems)
+			continue;
+
+		range = &index->ranges[index->nr_ranges++];
+		range->first = cache_elem_time(cache, 0);
+		range->last = cache_elem_time(cache, cache->nr_elems - 1);
+		range->cache = cache;
+	}
+
+	qsort(index->ranges, index->nr_ranges, sizeof(struct cache_range), cache_range_cmp);
+
+	for (int i = 0; i < index->nr_ranges; i++) {
+		range = &index->ranges[i];
+		range->latest = i;
+		if (i && (index->ranges[range[-1].latest].last > range->last))
+			range->latest = range[-1].latest;
+	}
+}
+
+void cache_publish()
+{
+	struct cache_index *index, *old;
+
+	if (!caches_dirty)
+		return;
+
+	index = calloc(1, sizeof(*index));
+	assert(index);
+	index->caches = calloc(nr_caches ? nr_caches : 1, sizeof(struct cache_t *));
+	assert(index->caches);
+
+	/* the caches are shared with the draft, it modifies a copy of them later */
+	for (int i = 0; i < nr_caches; i++) {
+		__atomic_add_fetch(&caches[i]->refs, 1, __ATOMIC_RELAXED);
+		index->caches[i] = caches[i];
+	}
+	index->nr_caches = nr_caches;
+	index->refs = 1;
+	cache_index_build_ranges(index);
+
+	pthread_mutex_lock(&cache_index_lock);
+	old = cache_index_latest;
+	__atomic_store_n(&cache_index_latest, index, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&cache_index_lock);
+
+	cache_index_put(old);
+	caches_dirty = 0;
+}
 
 struct cache_t *cache_find(const char *name)
 {
@@ -43,11 +200,10 @@ struct cache_t *cache_alloc(const char *name)
 
 	cache->name = strdup(name);
 	assert(cache->name);
+	cache->refs = 1;
 
 	cache->nr_elems = 0;
-	cache->max_elems = RECORDS_TRUNK;
-	cache->elems = calloc(cache->max_elems, sizeof(struct cache_elem_t));
-	assert(cache->elems);
+	cache_grow(cache, RECORDS_TRUNK);
 
 	if (!caches)
 		caches = calloc(1, sizeof(struct cache_t *));
@@ -55,10 +211,42 @@ struct cache_t *cache_alloc(const char *name)
 		caches = realloc(caches, sizeof(struct cache_t *) * (nr_caches + 1));
 
 	caches[nr_caches++] = cache;
+	caches_dirty = 1;
 
 	return cache;
 }
 
+struct cache_t *cache_modify(struct cache_t *cache)
+{
+	struct cache_t *copy;
+
+	caches_dirty = 1;
+	if (__atomic_load_n(&cache->refs, __ATOMIC_ACQUIRE) == 1)
+		return cache;
+
+	copy = malloc(sizeof(*copy));
+	assert(copy);
+	*copy = *cache;
+	copy->refs = 1;
+	copy->name = strdup(cache->name);
+	copy->blocks = NULL;
+	copy->elems = NULL;
+	assert(copy->name);
+	cache_grow(copy, copy->max_elems);
+	memcpy(copy->blocks, cache->blocks, sizeof(struct cache_block) * cache_nr_blocks(cache->nr_elems));
+	memcpy(copy->elems, cache->elems, sizeof(struct cache_elem_t) * cache->nr_elems);
+
+	for (int i = 0; i < nr_caches; i++) {
+		if (caches[i] == cache) {
+			caches[i] = copy;
+			break;
+		}
+	}
+	cache_put(cache);
+
+	return copy;
+}
+
 void cache_free(const char *name)
 {
 	struct cache_t *cache = cache_find(name);
@@ -66,10 +254,6 @@ void cache_free(const char *name)
 	if (!cache)
 		return;
 
-	free(cache->elems);
-	free(cache->name);
-	free(cache);
-
 	for (int i = 0; i < nr_caches; i++) {
 		if (caches[i] == cache) {
 			memmove(&caches[i], &caches[i + 1], (nr_caches - i - 1) * sizeof(caches[0]));
@@ -79,130 +263,836 @@ void cache_free(const char *name)
 
 	nr_caches--;
 	caches = realloc(caches, sizeof(struct cache_t *) * (nr_caches));
+	caches_dirty = 1;
+	cache_put(cache);
 }
 
-static struct cache_t *__cache_get(time_t time)
+/* the last range starting at or before @time, or -1 */
+static int cache_range_find(struct cache_index *index, time_t time)
 {
-	for (int i = 0; i < nr_caches; i++) {
-		struct cache_t *cache = caches[i];
-		struct cache_elem_t *first_elem, *last_elem;
+	int left = 0, right = index->nr_ranges;
 
-		assert(cache->nr_elems);
-		first_elem = &cache->elems[0];
-		last_elem = &cache->elems[cache->nr_elems - 1];
-		if ((time >= first_elem->time) && (time <= last_elem->time))
-			return cache;
+	while (left < right) {
+		int mid = (left + right) >> 1;
+
+		if (index->ranges[mid].first <= time)
+			left = mid + 1;
+		else
+			right = mid;
 	}
 
-	return NULL;
+	return left - 1;
 }
 
-struct cache_t *cache_get(time_t time, off_t *off)
+/* the range containing @time, or -1 */
+static int cache_range_get(struct cache_index *index, time_t time)
 {
-	struct cache_t *cache = __cache_get(time);
+	int i = cache_range_find(index, time);
 
-	if (!cache)
-		return NULL;
+	if ((i < 0) || (index->ranges[i].last >= time))
+		return i;
 
-	if (cache->nr_elems <= 2) {
-		*off = cache->elems[0].off;
-		return cache;
-	}
+	/* an earlier one covers it if they overlap, it's rare */
+	i = index->ranges[i].latest;
+	return index->ranges[i].last >= time ? i : -1;
+}
 
-	int left = 0;
-	int right = cache->nr_elems;
+/*
+ * Interpolation search for the first key at or after @time. It bisects after
+ * a couple of bad guesses, so it takes O(log n) at most.
+ */
+static int cache_interpolate(int left, int right, time_t time, time_t lo, time_t hi, int probes)
+{
+	if (probes < 2)
+		return left + (double)(time - lo) * (right - 1 - left) / (hi - lo);
+
+	return (left + right) >> 1;
+}
+
+/* the last block starting at or before @time, or -1 */
+static int cache_block_find(struct cache_t *cache, time_t time)
+{
+	struct cache_block *blocks = cache->blocks;
+	int left = 0, right = cache_nr_blocks(cache->nr_elems), probes = 0;
 
 	while (left < right) {
-		int mid = (left + right) >> 1;
-		struct cache_elem_t *elem = &cache->elems[mid];
-		if (time == elem->time) {
-			*off = elem->off;
-			return cache;
+		int mid;
+
+		if (time < blocks[left].time)
+			break;
+		if (time >= blocks[right - 1].time) {
+			left = right;
+			break;
 		}
 
-		if (time < elem->time) {
-			right = mid;
-		} else {
+		mid = cache_interpolate(left, right, time, blocks[left].time, blocks[right - 1].time, probes++);
+		if (blocks[mid].time <= time)
 			left = mid + 1;
+		else
+			right = mid;
+	}
+
+	return left - 1;
+}
+
+/* the first elem at or after @time */
+static int cache_elem_find(struct cache_t *cache, time_t time)
+{
+	int block = cache_block_find(cache, time);
+	int left, right, probes = 0;
+	struct cache_elem_t *elems;
+	time_t delta;
+
+	if (block < 0)
+		return 0;
+
+	elems = cache->elems + block * CACHE_BLOCK_ELEMS;
+	delta = time - cache->blocks[block].time;
+	left = 0;
+	right = cache->nr_elems - block * CACHE_BLOCK_ELEMS;
+	if (right > CACHE_BLOCK_ELEMS)
+		right = CACHE_BLOCK_ELEMS;
+
+	while (left < right) {
+		int mid;
+
+		if (delta <= elems[left].time)
+			break;
+		if (delta > elems[right - 1].time) {
+			left = right;
+			break;
 		}
+
+		mid = cache_interpolate(left, right, delta, elems[left].time, elems[right - 1].time, probes++);
+		if (elems[mid].time < delta)
+			left = mid + 1;
+		else
+			right = mid;
 	}
 
-	struct cache_elem_t *elem = &cache->elems[left];
-	*off = elem->off;
-	return cache;
+	return block * CACHE_BLOCK_ELEMS + left;
 }
 
-static int cache_elems_cmp(const void *p1, const void *p2)
+struct cache_t *cache_get(struct cache_index *index, time_t time, off_t *off)
 {
-	struct cache_elem_t *e1 = (struct cache_elem_t *)p1;
-	struct cache_elem_t *e2 = (struct cache_elem_t *)p2;
+	struct cache_t *cache;
+	int i;
+
+	if (!index)
+		return NULL;
+
+	i = cache_range_get(index, time);
+	if (i < 0)
+		return NULL;
 
-	return e1->time > e2->time;
+	cache = index->ranges[i].cache;
+	*off = cache_elem_off(cache, cache_elem_find(cache, time));
+	return cache;
 }
 
-void cache_set(struct cache_t *cache, time_t time, off_t off)
+struct cache_t *cache_get_nearest(struct cache_index *index, time_t time, int dir, off_t *off)
 {
-	if (cache->nr_elems == cache->max_elems) {
-		cache->max_elems += RECORDS_TRUNK;
-		cache->elems = realloc(cache->elems, sizeof(struct cache_elem_t) * cache->max_elems);
+	struct cache_t *cache;
+	int i, elem;
+
+	if (!index || !index->nr_ranges)
+		return NULL;
+
+	i = cache_range_get(index, time);
+	if (i >= 0) {
+		cache = index->ranges[i].cache;
+		elem = cache_elem_find(cache, time);
+		if ((dir == CACHE_BEFORE) && (cache_elem_time(cache, elem) != time))
+			elem--;
+
+		*off = cache_elem_off(cache, elem);
+		return cache;
 	}
 
-	struct cache_elem_t *new_elem = &cache->elems[cache->nr_elems++];
-	new_elem->time = time;
-	new_elem->off = off;
+	/* in a gap, the latest one ending before, or the next one starting after */
+	i = cache_range_find(index, time);
+	if (dir == CACHE_BEFORE) {
+		if (i < 0)
+			return NULL;
 
-	if (cache->nr_elems == 1)
-		return;
+		cache = index->ranges[index->ranges[i].latest].cache;
+		*off = cache_elem_off(cache, cache->nr_elems - 1);
+	} else {
+		if (i + 1 == index->nr_ranges)
+			return NULL;
 
-	struct cache_elem_t *last_elem = &cache->elems[cache->nr_elems - 2];
-	if (last_elem->time > new_elem->time) {
-		qsort(cache->elems, cache->nr_elems, sizeof(struct cache_elem_t), cache_elems_cmp);
+		cache = index->ranges[i + 1].cache;
+		*off = cache_elem_off(cache, 0);
 	}
+
+	return cache;
 }
 
-static int cache_cmp(const void *p1, const void *p2)
+static int cache_append(struct cache_t *cache, time_t time, off_t off)
 {
-	struct cache_t **c1 = (struct cache_t **)p1;
-	struct cache_t **c2 = (struct cache_t **)p2;
+	struct cache_block *block;
+	struct cache_elem_t *elem;
+	int i = cache->nr_elems;
+
+	if (i == cache->max_elems)
+		cache_grow(cache, cache->max_elems + RECORDS_TRUNK);
+
+	block = &cache->blocks[i / CACHE_BLOCK_ELEMS];
+	if (!(i % CACHE_BLOCK_ELEMS)) {
+		block->time = time;
+		block->off = off;
+	} else if ((time - block->time > UINT32_MAX) || (off - block->off > INT32_MAX)
+		   || (off - block->off < INT32_MIN)) {
+		return -E2BIG;
+	}
+
+	elem = &cache->elems[i];
+	elem->time = time - block->time;
+	elem->off = off - block->off;
+	cache->nr_elems++;
 
-	return (*c1)->elems[0].time > (*c2)->elems[0].time;
+	return 0;
 }
 
-void cache_sort()
+int cache_set(struct cache_t *cache, time_t time, off_t off)
 {
-	qsort(caches, nr_caches, sizeof(struct cache_t *), cache_cmp);
+	struct cache_block *moved;
+	int i, nr, ret;
+
+	/* a published one is immutable, see cache_modify() */
+	assert(__atomic_load_n(&cache->refs, __ATOMIC_RELAXED) == 1);
+	caches_dirty = 1;
+
+	if (!cache->nr_elems || (time >= cache_elem_time(cache, cache->nr_elems - 1)))
+		return cache_append(cache, time, off);
+
+	/* back in time, insert it and append the following ones again, it's rare */
+	i = cache_elem_find(cache, time);
+	nr = cache->nr_elems - i;
+	moved = malloc(sizeof(*moved) * nr);
+	assert(moved);
+	for (int j = 0; j < nr; j++) {
+		moved[j].time = cache_elem_time(cache, i + j);
+		moved[j].off = cache_elem_off(cache, i + j);
+	}
+
+	cache->nr_elems = i;
+	ret = cache_append(cache, time, off);
+	for (int j = 0; !ret && (j < nr); j++)
+		ret = cache_append(cache, moved[j].time, moved[j].off);
+
+	/* it doesn't fit, put the following ones back, they fit where they were */
+	if (ret) {
+		cache->nr_elems = i;
+		for (int j = 0; j < nr; j++)
+			cache_append(cache, moved[j].time, moved[j].off);
+	}
+
+	free(moved);
+	return ret;
 }
 
-struct cache_t *cache_get_recent()
+struct cache_t *cache_get_recent(struct cache_index *index)
 {
-	if (!nr_caches)
+	if (!index || !index->nr_ranges)
 		return NULL;
 
-	return caches[nr_caches - 1];
+	return index->ranges[index->ranges[index->nr_ranges - 1].latest].cache;
+}
+
+/*
+ * The index is saved by a running process and loaded by the upgraded one, so
+ * it skips parsing the rawlogs again. The layout is native, a loader rejects
+ * an unknown magic and parses the rawlogs as usual.
+ */
+#define CACHE_SNAPSHOT_MAGIC	0x33435441	/* "ATC3" */
+
+struct cache_snapshot_header {
+	uint32_t magic;
+	uint32_t nr_caches;
+};
+
+struct cache_snapshot_entry {
+	uint32_t name_len;	/* including '\0', the name follows */
+	int flags;
+	int nr_elems;		/* blocks and elems follow the name */
+	off_t st_size;
+	struct timespec st_mtim;
+	off_t next_off;
+};
+
+static int cache_write(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+
+	while (len) {
+		ssize_t ret = write(fd, p, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		p += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/* the blocks, then the elems */
+static size_t cache_elems_len(int nr_elems)
+{
+	return sizeof(struct cache_block) * cache_nr_blocks(nr_elems) + sizeof(struct cache_elem_t) * nr_elems;
+}
+
+static int cache_write_elems(int fd, struct cache_t *cache)
+{
+	int ret = cache_write(fd, cache->blocks, sizeof(struct cache_block) * cache_nr_blocks(cache->nr_elems));
+
+	if (!ret)
+		ret = cache_write(fd, cache->elems, sizeof(struct cache_elem_t) * cache->nr_elems);
+
+	return ret;
+}
+
+static void cache_read_elems(struct cache_t *cache, const char *p, int nr_elems)
+{
+	size_t blocks_len = sizeof(struct cache_block) * cache_nr_blocks(nr_elems);
+
+	cache_grow(cache, nr_elems + RECORDS_TRUNK);
+	memcpy(cache->blocks, p, blocks_len);
+	memcpy(cache->elems, p + blocks_len, sizeof(struct cache_elem_t) * nr_elems);
+	cache->nr_elems = cache->saved_elems = nr_elems;
+}
+
+int cache_save(int fd)
+{
+	struct cache_snapshot_header header = {
+		.magic = CACHE_SNAPSHOT_MAGIC,
+	};
+	struct cache_index *index = cache_index_get();
+	int nr = index ? index->nr_caches : 0;
+	int ret;
+
+	header.nr_caches = nr;
+	ret = cache_write(fd, &header, sizeof(header));
+	for (int i = 0; !ret && (i < nr); i++) {
+		struct cache_t *cache = index->caches[i];
+		struct cache_snapshot_entry entry = {
+			.name_len = strlen(cache->name) + 1,
+			.flags = cache->flags,
+			.nr_elems = cache->nr_elems,
+			.st_size = cache->st_size,
+			.st_mtim = cache->st_mtim,
+			.next_off = cache->next_off,
+		};
+
+		ret = cache_write(fd, &entry, sizeof(entry));
+		if (!ret)
+			ret = cache_write(fd, cache->name, entry.name_len);
+		if (!ret)
+			ret = cache_write_elems(fd, cache);
+	}
+
+	return ret;
+}
+
+int cache_load(int fd)
+{
+	struct cache_snapshot_header *header;
+	struct stat statbuf;
+	char *buf, *p, *end;
+	int ret = -EINVAL;
+
+	if (fstat(fd, &statbuf) || (statbuf.st_size < sizeof(*header)))
+		return -EINVAL;
+
+	buf = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (buf == MAP_FAILED)
+		return -errno;
+
+	header = (struct cache_snapshot_header *)buf;
+	if (header->magic != CACHE_SNAPSHOT_MAGIC)
+		goto unmap;
+
+	p = buf + sizeof(*header);
+	end = buf + statbuf.st_size;
+
+	for (int i = 0; i < header->nr_caches; i++) {
+		struct cache_snapshot_entry entry;
+		struct cache_t *cache;
+		size_t elems_len;
+
+		if (end - p < sizeof(entry))
+			goto publish;
+
+		memcpy(&entry, p, sizeof(entry));
+		p += sizeof(entry);
+		if (entry.nr_elems <= 0)
+			goto publish;
+
+		elems_len = cache_elems_len(entry.nr_elems);
+		if (!entry.name_len || (end - p < entry.name_len + elems_len)
+		    || p[entry.name_len - 1] || cache_find(p))
+			goto publish;
+
+		cache = cache_alloc(p);
+		p += entry.name_len;
+
+		cache->flags = entry.flags;
+		cache->st_size = entry.st_size;
+		cache->st_mtim = entry.st_mtim;
+		cache->next_off = entry.next_off;
+		cache_read_elems(cache, p, entry.nr_elems);
+		p += elems_len;
+	}
+
+	ret = 0;
+
+publish:
+	/* a partial one is fine, rawlogs of the missing are parsed later */
+	cache_publish();
+
+unmap:
+	munmap(buf, statbuf.st_size);
+	return ret;
+}
+
+/*
+ * An index file of a rawlog, the blocks and elems follow the header. It's
+ * loaded only if it's of the same rawlog, Ex, not rotated by the same name.
+ */
+#define CACHE_FILE_MAGIC	0x58495441	/* "ATIX" */
+#define CACHE_FILE_VERSION	3
+
+struct cache_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t elem_size;
+	int flags;
+	int nr_elems;
+	uint64_t ino;
+	int64_t st_size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t next_off;
+};
+
+/* the renamed one survives a crash */
+static int cache_fsync_dir(const char *path)
+{
+	char dir[PATH_MAX];
+	char *slash;
+	int fd, ret = 0;
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	slash = strrchr(dir, '/');
+	if (!slash)
+		snprintf(dir, sizeof(dir), ".");
+	else if (slash == dir)
+		slash[1] = '\0';
+	else
+		*slash = '\0';
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fsync(fd))
+		ret = -errno;
+	close(fd);
+
+	return ret;
+}
+
+int cache_file_save(struct cache_t *cache, const char *path, ino_t ino)
+{
+	struct cache_file_header header = {
+		.magic = CACHE_FILE_MAGIC,
+		.version = CACHE_FILE_VERSION,
+		.elem_size = sizeof(struct cache_elem_t),
+		.flags = cache->flags,
+		.nr_elems = cache->nr_elems,
+		.ino = ino,
+		.st_size = cache->st_size,
+		.mtime_sec = cache->st_mtim.tv_sec,
+		.mtime_nsec = cache->st_mtim.tv_nsec,
+		.next_off = cache->next_off,
+	};
+	char tmp[PATH_MAX];
+	int fd, ret;
+
+	/* readers never see a partial one, the upgraded process saves its own */
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return -errno;
+
+	ret = cache_write(fd, &header, sizeof(header));
+	if (!ret)
+		ret = cache_write_elems(fd, cache);
+	if (!ret && fsync(fd))
+		ret = -errno;
+	close(fd);
+
+	if (!ret && rename(tmp, path))
+		ret = -errno;
+	if (!ret)
+		ret = cache_fsync_dir(path);
+
+	if (ret)
+		unlink(tmp);
+	else
+		cache->saved_elems = cache->nr_elems;
+
+	return ret;
+}
+
+int cache_file_load(struct cache_t *cache, const char *path, const struct stat *rawlog)
+{
+	struct cache_file_header header;
+	struct stat statbuf;
+	size_t blocks_len, elems_len;
+	int fd, ret = -EINVAL;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &statbuf) || (statbuf.st_size < sizeof(header))
+	    || (pread(fd, &header, sizeof(header), 0) != sizeof(header)))
+		goto close_fd;
+
+	elems_len = statbuf.st_size - sizeof(header);
+	if ((header.magic != CACHE_FILE_MAGIC) || (header.version != CACHE_FILE_VERSION)
+	    || (header.elem_size != sizeof(struct cache_elem_t)) || (header.flags != cache->flags)
+	    || (header.nr_elems <= 0) || (elems_len != cache_elems_len(header.nr_elems))
+	    || (header.ino != rawlog->st_ino) || (header.st_size > rawlog->st_size)
+	    || (header.next_off > header.st_size))
+		goto close_fd;
+
+	/* not appended since saved */
+	if ((header.st_size == rawlog->st_size) && ((header.mtime_sec != rawlog->st_mtim.tv_sec)
+	    || (header.mtime_nsec != rawlog->st_mtim.tv_nsec)))
+		goto close_fd;
+
+	/* read into the index directly, it's appended later */
+	cache_grow(cache, header.nr_elems + RECORDS_TRUNK);
+	blocks_len = sizeof(struct cache_block) * cache_nr_blocks(header.nr_elems);
+	elems_len -= blocks_len;
+	if ((pread(fd, cache->blocks, blocks_len, sizeof(header)) != blocks_len)
+	    || (pread(fd, cache->elems, elems_len, sizeof(header) + blocks_len) != elems_len))
+		goto close_fd;
+
+	cache->nr_elems = cache->saved_elems = header.nr_elems;
+	cache->next_off = header.next_off;
+	caches_dirty = 1;
+	ret = 0;
+
+close_fd:
+	close(fd);
+	return ret;
 }
 
 #ifdef CACHE_TEST
+/*
+ * gcc -O2 -DCACHE_TEST cache.c -o cache_test -pthread && ./cache_test
+ */
+#define CACHE_TEST_ROUNDS	10000
+
+/* a year of daily rawlogs, sampled every 10 seconds */
+#define CACHE_BENCH_DAYS	365
+#define CACHE_BENCH_SAMPLES	(24 * 60 * 60 / 10)
+#define CACHE_BENCH_LOOKUPS	(1024 * 1024)
+
+static long cache_test_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* the layout before blocks, time_t and off_t of each record */
+struct cache_bench_elem {
+	time_t time;
+	off_t off;
+};
+
+static off_t cache_bench_bsearch(struct cache_bench_elem *elems, int nr, time_t time)
+{
+	int left = 0, right = nr;
+
+	while (left < right) {
+		int mid = (left + right) >> 1;
+
+		if (elems[mid].time < time)
+			left = mid + 1;
+		else
+			right = mid;
+	}
+
+	return elems[left].off;
+}
+
+static void cache_bench(void)
+{
+	struct cache_bench_elem **flat = calloc(CACHE_BENCH_DAYS, sizeof(*flat));
+	time_t *times = malloc(sizeof(time_t) * CACHE_BENCH_LOOKUPS);
+	time_t start = 1672531200;
+	struct cache_index *index;
+	long begin, cache_ns, flat_ns;
+	off_t off, sum = 0, flat_sum = 0;
+	unsigned int seed = 1;
+	char name[32];
+
+	for (int day = 0; day < CACHE_BENCH_DAYS; day++) {
+		struct cache_t *cache;
+		time_t time;
+
+		snprintf(name, sizeof(name), "bench%d", day);
+		cache = cache_alloc(name);
+		flat[day] = malloc(sizeof(struct cache_bench_elem) * CACHE_BENCH_SAMPLES);
+		for (int i = 0; i < CACHE_BENCH_SAMPLES; i++) {
+			/* atop wakes up a little late sometimes */
+			time = start + day * 24 * 60 * 60 + i * 10 + !(rand_r(&seed) % 16);
+			flat[day][i].time = time;
+			flat[day][i].off = 4096 + i * 40000L;
+			assert(!cache_set(cache, time, flat[day][i].off));
+		}
+	}
+	cache_publish();
+	index = cache_index_get();
+	for (int i = 0; i < CACHE_BENCH_LOOKUPS; i++)
+		times[i] = start + rand_r(&seed) % (CACHE_BENCH_DAYS * 24 * 60 * 60);
+
+	begin = cache_test_now_ns();
+	for (int i = 0; i < CACHE_BENCH_LOOKUPS; i++) {
+		if (cache_get(index, times[i], &off))
+			sum += off;
+	}
+	cache_ns = cache_test_now_ns() - begin;
+
+	begin = cache_test_now_ns();
+	for (int i = 0; i < CACHE_BENCH_LOOKUPS; i++) {
+		time_t time = times[i];
+		int day = (time - start) / (24 * 60 * 60);
+
+		/* the best case of the linear scan over files, the day is known */
+		if ((time >= flat[day][0].time) && (time <= flat[day][CACHE_BENCH_SAMPLES - 1].time))
+			flat_sum += cache_bench_bsearch(flat[day], CACHE_BENCH_SAMPLES, time);
+	}
+	flat_ns = cache_test_now_ns() - begin;
+
+	printf("a year index: %.1f bytes/record, %.1f ns/lookup; flat: %zu bytes/record, %.1f ns/lookup\n",
+	       (double)(sizeof(struct cache_elem_t) * CACHE_BENCH_SAMPLES +
+			sizeof(struct cache_block) * cache_nr_blocks(CACHE_BENCH_SAMPLES)) / CACHE_BENCH_SAMPLES,
+	       (double)cache_ns / CACHE_BENCH_LOOKUPS, sizeof(struct cache_bench_elem),
+	       (double)flat_ns / CACHE_BENCH_LOOKUPS);
+	assert(sum == flat_sum);
+
+	for (int day = 0; day < CACHE_BENCH_DAYS; day++) {
+		snprintf(name, sizeof(name), "bench%d", day);
+		cache_free(name);
+		free(flat[day]);
+	}
+	free(flat);
+	free(times);
+}
+
+static int cache_test_stop;
+
+/* a snapshot never changes, whatever the rescan does meanwhile */
+static void *cache_test_reader(void *arg)
+{
+	unsigned long lookups = 0;
+
+	while (!__atomic_load_n(&cache_test_stop, __ATOMIC_RELAXED)) {
+		struct cache_index *index = cache_index_get();
+		struct cache_t *cache = cache_get_recent(index);
+		int nr_elems;
+		off_t off;
+
+		if (!cache)
+			continue;
+
+		nr_elems = cache->nr_elems;
+		for (int i = 0; i < nr_elems; i++) {
+			assert(cache_get(index, cache_elem_time(cache, i), &off) == cache);
+			assert((off >= cache_elem_off(cache, 0)) && (off <= cache_elem_off(cache, nr_elems - 1)));
+		}
+		assert(cache->nr_elems == nr_elems);
+		lookups += nr_elems;
+	}
+
+	printf("reader: %lu lookups\n", lookups);
+	cache_index_release();
+	return NULL;
+}
+
 int main()
 {
 	assert(!cache_find("test0"));
 
 	struct cache_t *cache0 = cache_alloc("test0");
 	cache_set(cache0, 100, 1000);
-	assert(cache0->elems[0].time == 100);
+	assert(cache_elem_time(cache0, 0) == 100);
 	cache_set(cache0, 102, 1002);
-	assert(cache0->elems[0].time == 100);
-	assert(cache0->elems[1].time == 102);
+	assert(cache_elem_time(cache0, 0) == 100);
+	assert(cache_elem_time(cache0, 1) == 102);
 	cache_set(cache0, 101, 1001);
 	assert(cache0->nr_elems == 3);
-	assert(cache0->elems[0].time < cache0->elems[1].time);
-	assert(cache0->elems[1].time < cache0->elems[2].time);
+	assert(cache_elem_time(cache0, 0) < cache_elem_time(cache0, 1));
+	assert(cache_elem_time(cache0, 1) < cache_elem_time(cache0, 2));
 
 	struct cache_t *cache1 = cache_alloc("test1");
 	cache_set(cache1, 200, 2000);
 	cache_free("test0");
 	assert(nr_caches == 1);
-	assert(caches[0]->elems[0].time == 200);
-	assert(caches[0]->elems[0].off == 2000);
+	assert(cache_elem_time(caches[0], 0) == 200);
+	assert(cache_elem_off(caches[0], 0) == 2000);
+
+	/* a published cache is copied on modification */
+	cache_publish();
+	struct cache_index *index = cache_index_get();
+	off_t off;
+	assert(cache_get(index, 200, &off) == cache1);
+	cache1 = cache_modify(cache1);
+	assert(cache1 != index->caches[0]);
+	cache_set(cache1, 201, 2010);
+	assert(index->caches[0]->nr_elems == 1);
+	cache_publish();
+	assert(cache_index_get()->caches[0]->nr_elems == 2);
+
+	int fd = memfd_create("cache_test", 0);
+	assert(fd >= 0);
+	cache_set(cache_alloc("test2"), 150, 1500);
+	cache_publish();
+	assert(!cache_save(fd));
+	cache_free("test1");
+	cache_free("test2");
+	assert(!cache_load(fd));
+	assert(nr_caches == 2);
+	assert(cache_elem_off(cache_find("test2"), 0) == 1500);
+	assert(cache_find("test1")->nr_elems == 2);
+	assert(cache_elem_time(cache_find("test1"), 0) == 200);
+	close(fd);
+
+	/* ranges of test2 [150] and test1 [200, 201], in any order of the draft */
+	index = cache_index_get();
+	assert(index->nr_ranges == 2);
+	assert(cache_get_recent(index) == cache_find("test1"));
+	assert((cache_get(index, 201, &off) == cache_find("test1")) && (off == 2010));
+	assert(!cache_get(index, 149, &off) && !cache_get(index, 175, &off) && !cache_get(index, 202, &off));
+	assert((cache_get_nearest(index, 175, CACHE_BEFORE, &off) == cache_find("test2")) && (off == 1500));
+	assert((cache_get_nearest(index, 175, CACHE_AFTER, &off) == cache_find("test1")) && (off == 2000));
+	assert((cache_get_nearest(index, 201, CACHE_BEFORE, &off) == cache_find("test1")) && (off == 2010));
+	assert((cache_get_nearest(index, 300, CACHE_BEFORE, &off) == cache_find("test1")) && (off == 2010));
+	assert(!cache_get_nearest(index, 300, CACHE_AFTER, &off));
+	assert(!cache_get_nearest(index, 100, CACHE_BEFORE, &off));
+
+	/* test3 [100, 500] overlaps both, a lookup in them finds any of them */
+	struct cache_t *cache3 = cache_alloc("test3");
+	cache_set(cache3, 100, 100);
+	cache_set(cache3, 500, 500);
+	cache_publish();
+	index = cache_index_get();
+	assert(cache_get_recent(index) == cache3);
+	assert((cache_get(index, 175, &off) == cache3) && (off == 500));
+	assert((cache_get(index, 400, &off) == cache3) && (off == 500));
+	assert(cache_get(index, 150, &off) && (cache_get(index, 150, &off) != cache3 || off == 500));
+	assert((cache_get_nearest(index, 499, CACHE_BEFORE, &off) == cache3) && (off == 100));
+	cache_free("test3");
+	cache_free("test1");
+	cache_free("test2");
+
+	/* the index file is loaded for the same rawlog only */
+	char path[] = "/tmp/cache_test.XXXXXX";
+	struct stat rawlog;
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	assert(!ftruncate(fd, 4096) && !fstat(fd, &rawlog));
+	cache0 = cache_alloc("test0");
+	cache_set(cache0, 300, 3000);
+	cache_set(cache0, 301, 3010);
+	cache_set(cache0, 299, 3020);
+	cache0->next_off = 3030;
+	cache0->st_size = rawlog.st_size;
+	cache0->st_mtim = rawlog.st_mtim;
+	assert(!cache_file_save(cache0, path, rawlog.st_ino));
+	assert(cache0->saved_elems == 3);
+	cache_free("test0");
+	cache0 = cache_alloc("test0");
+	assert(!cache_file_load(cache0, path, &rawlog));
+	assert((cache0->nr_elems == 3) && (cache_elem_off(cache0, 2) == 3010));
+	/* the last parsed record is back in time, parsing resumes after it */
+	assert(cache0->next_off == 3030);
+	cache_free("test0");
+	rawlog.st_ino++;
+	assert(cache_file_load(cache_alloc("test0"), path, &rawlog) == -EINVAL);
+	cache_free("test0");
+	close(fd);
+	unlink(path);
+
+	/* records over blocks, and a record back in time is inserted */
+	cache0 = cache_alloc("test0");
+	for (int i = 0; i < 200; i++)
+		assert(!cache_set(cache0, 1000 + i * 10 + !(i % 7) * 3, i * 100));
+	assert(!cache_set(cache0, 1005, 123456));
+	assert(cache0->nr_elems == 201);
+	for (int i = 1; i < cache0->nr_elems; i++)
+		assert(cache_elem_time(cache0, i - 1) < cache_elem_time(cache0, i));
+	cache_publish();
+	index = cache_index_get();
+	for (int i = 0; i < cache0->nr_elems; i++) {
+		assert((cache_get(index, cache_elem_time(cache0, i), &off) == cache0) && (off == cache_elem_off(cache0, i)));
+		if (i + 1 < cache0->nr_elems) {
+			assert(cache_get(index, cache_elem_time(cache0, i) + 1, &off) == cache0);
+			assert(off == cache_elem_off(cache0, i + 1));
+		}
+	}
+	assert((cache_get(index, 1005, &off) == cache0) && (off == 123456));
+	assert(cache_set(cache_modify(cache0), 5000, (off_t)INT32_MAX * 4) == -E2BIG);
+
+	/* a record back in time doesn't fit, the following ones are kept */
+	struct cache_block kept[201];
+	for (int i = 0; i < cache0->nr_elems; i++) {
+		kept[i].time = cache_elem_time(cache0, i);
+		kept[i].off = cache_elem_off(cache0, i);
+	}
+	assert(cache_set(cache0, 1006, (off_t)INT32_MAX * 4) == -E2BIG);
+	assert(cache0->nr_elems == 201);
+	for (int i = 0; i < cache0->nr_elems; i++)
+		assert((cache_elem_time(cache0, i) == kept[i].time) && (cache_elem_off(cache0, i) == kept[i].off));
+	cache_free("test0");
+
+	/* the rescan appends records and rotates files while readers look up */
+	pthread_t readers[4];
+	for (int i = 0; i < 4; i++)
+		pthread_create(&readers[i], NULL, cache_test_reader, NULL);
+
+	char name[32];
+	time_t now = 1000;
+	for (int round = 0; round < CACHE_TEST_ROUNDS; round++) {
+		if (!(round % 1000)) {
+			snprintf(name, sizeof(name), "test%d", round / 1000);
+			cache_alloc(name);
+		}
+
+		struct cache_t *cache = cache_modify(cache_find(name));
+		cache_set(cache, now, now * 10);
+		now++;
+		cache_publish();
+	}
+
+	__atomic_store_n(&cache_test_stop, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < 4; i++)
+		pthread_join(readers[i], NULL);
+
+	assert(cache_elem_time(cache_get_recent(cache_index_get()), 999) == now - 1);
+
+	cache_bench();
 
 	return 0;
 }
@@ -11,31 +11,117 @@
 #ifndef _CACHE_H_
 #define _CACHE_H_
 
+#include <stdint.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 
-struct cache_elem_t {
+/*
+ * Records are indexed by blocks of CACHE_BLOCK_ELEMS, an elem keeps 32 bits
+ * deltas to its block, it's half the size of time_t and off_t. A lookup
+ * interpolates the blocks then the elems of one block, atop samples in a
+ * fixed interval, the guess is right mostly.
+ */
+#define CACHE_BLOCK_ELEMS	64
+
+struct cache_block {
 	time_t time;
 	off_t off;
 };
 
+struct cache_elem_t {
+	uint32_t time;
+	int32_t off;		/* a record written back in time is before the block */
+};
+
 struct cache_t {
 	char *name;
 	int flags;
 	int max_elems;
 	int nr_elems;
+	struct cache_block *blocks;
 	struct cache_elem_t *elems;
 	off_t st_size;
 	struct timespec st_mtim;
+	off_t next_off;		/* following the last parsed record, not the latest one by time */
+	int refs;		/* the draft and the snapshots holding it */
+	int saved_elems;	/* elems in the index file */
 };
 
+/* time range of a rawlog */
+struct cache_range {
+	time_t first;
+	time_t last;
+	struct cache_t *cache;
+	int latest;		/* of ranges[0..this], the one with the max last */
+};
+
+static inline time_t cache_elem_time(struct cache_t *cache, int i)
+{
+	return cache->blocks[i / CACHE_BLOCK_ELEMS].time + cache->elems[i].time;
+}
+
+static inline off_t cache_elem_off(struct cache_t *cache, int i)
+{
+	return cache->blocks[i / CACHE_BLOCK_ELEMS].off + cache->elems[i].off;
+}
+
+/* a snapshot of the index, immutable once published */
+struct cache_index {
+	int refs;
+	int nr_caches;
+	struct cache_t **caches;
+	int nr_ranges;
+	struct cache_range *ranges;	/* of non-empty caches, sorted by first */
+};
+
+/* direction of cache_get_nearest() */
+#define CACHE_BEFORE	-1
+#define CACHE_AFTER	1
+
+/*
+ * Update the draft index, by the rescan thread only. Call cache_modify()
+ * before updating a cache, it returns a copy if the cache is published.
+ */
 struct cache_t *cache_alloc(const char *name);
 struct cache_t *cache_find(const char *name);
+struct cache_t *cache_modify(struct cache_t *cache);
 void cache_free(const char *name);
-void cache_set(struct cache_t *cache, time_t time, off_t off);
-struct cache_t *cache_get(time_t time, off_t *off);
+/* return -E2BIG if a block spans over 2GB of the rawlog */
+int cache_set(struct cache_t *cache, time_t time, off_t off);
 void cache_done(struct cache_t *cache);
-void cache_sort();
-struct cache_t *cache_get_recent();
+
+/* publish the draft as the latest snapshot if it's changed */
+void cache_publish();
+
+/*
+ * The latest snapshot for readers, valid until the next call by the same
+ * thread. It's never blocked by a rescan.
+ */
+struct cache_index *cache_index_get();
+/* drop the one held by this thread, before it exits */
+void cache_index_release();
+
+/*
+ * Lookups take O(log files + log records). cache_get() finds the record at
+ * @time or the next one of the same rawlog, NULL if @time is out of all the
+ * rawlogs. cache_get_nearest() finds the closest record at or before/after
+ * @time of any rawlog, across the gaps between them.
+ */
+struct cache_t *cache_get(struct cache_index *index, time_t time, off_t *off);
+struct cache_t *cache_get_nearest(struct cache_index *index, time_t time, int dir, off_t *off);
+struct cache_t *cache_get_recent(struct cache_index *index);
+
+/*
+ * Persist the index of a rawlog of inode @ino to the index file @path, or
+ * load the saved one to a new @cache if it's of the rawlog @rawlog. The
+ * caller verifies the tail of the loaded one. Return 0 or -errno.
+ */
+int cache_file_save(struct cache_t *cache, const char *path, ino_t ino);
+int cache_file_load(struct cache_t *cache, const char *path, const struct stat *rawlog);
+
+/* save the latest snapshot to @fd, or load the saved one, return 0 or -errno */
+int cache_save(int fd);
+int cache_load(int fd);
 
 #endif
@@ -13,6 +13,8 @@
 #include <errno.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -25,6 +27,8 @@ static connection_type* conn_types[CONN_TYPE_MAX];
 void conntype_initialize(void) {
 	register_conntype_socket();
 	register_conntype_tls();
+	register_conntype_uring();
+	register_conntype_unix();
 }
 
 int conntype_register(connection_type* ct) {
@@ -58,6 +62,53 @@ int conntype_register(connection_type* ct) {
 	return -errno;
 }
 
+/* submit the operations batched by each type, called by each worker before it sleeps */
+void conntype_flush(void) {
+	connection_type* ct;
+
+	for (int type = 0; type < CONN_TYPE_MAX; type++) {
+		ct = conn_types[type];
+		if (!ct)
+			break;
+
+		if (ct->flush)
+			ct->flush();
+	}
+}
+
+/* like connTypeHasPendingData() of redis, the event loop doesn't sleep then */
+int conntype_has_pending(void) {
+	connection_type* ct;
+
+	for (int type = 0; type < CONN_TYPE_MAX; type++) {
+		ct = conn_types[type];
+		if (!ct)
+			break;
+
+		if (ct->has_pending && ct->has_pending())
+			return 1;
+	}
+
+	return 0;
+}
+
+/* like connTypeProcessPendingData() of redis, pop a connection with events */
+connection* conntype_pending(int *events) {
+	connection_type* ct;
+	connection* conn;
+
+	for (int type = 0; type < CONN_TYPE_MAX; type++) {
+		ct = conn_types[type];
+		if (!ct)
+			break;
+
+		if (ct->pending && (conn = ct->pending(events)))
+			return conn;
+	}
+
+	return NULL;
+}
+
 connection_type* get_conntype_by_name(const char* typename) {
 	connection_type* ct;
 
@@ -91,6 +142,99 @@ int get_conntype_index_by_name(const char* typename) {
 	return -1;
 }
 
+struct listen_config listen_config = {
+	.backlog = DEFAULT_BACKLOG,
+};
+
+/*
+ * Listening sockets of this process are recorded to hand over on upgrade, and
+ * the ones handed over by the previous process are taken by address.
+ */
+#define MAX_LISTEN_FDS 512
+
+static pthread_mutex_t listen_fds_lock = PTHREAD_MUTEX_INITIALIZER;
+static int listen_fds[MAX_LISTEN_FDS];
+static int nr_listen_fds;
+static int inherited_fds[MAX_LISTEN_FDS];
+static int nr_inherited_fds;
+
+void listen_fd_register(int fd) {
+	pthread_mutex_lock(&listen_fds_lock);
+	if (nr_listen_fds < MAX_LISTEN_FDS)
+		listen_fds[nr_listen_fds++] = fd;
+	pthread_mutex_unlock(&listen_fds_lock);
+}
+
+int listen_fd_get_all(int *fds, int max) {
+	int nr;
+
+	pthread_mutex_lock(&listen_fds_lock);
+	nr = nr_listen_fds < max ? nr_listen_fds : max;
+	memcpy(fds, listen_fds, nr * sizeof(int));
+	pthread_mutex_unlock(&listen_fds_lock);
+
+	return nr;
+}
+
+void listen_fd_inherit(int fd) {
+	pthread_mutex_lock(&listen_fds_lock);
+	if (nr_inherited_fds < MAX_LISTEN_FDS)
+		inherited_fds[nr_inherited_fds++] = fd;
+	else
+		close(fd);
+	pthread_mutex_unlock(&listen_fds_lock);
+}
+
+int listen_fd_take(const struct sockaddr *addr, socklen_t addrlen) {
+	struct sockaddr_storage ss;
+	socklen_t sslen;
+	int fd = -1;
+
+	pthread_mutex_lock(&listen_fds_lock);
+	for (int i = 0; i < nr_inherited_fds; i++) {
+		sslen = sizeof(ss);
+		if (getsockname(inherited_fds[i], (struct sockaddr *)&ss, &sslen)
+		    || (sslen != addrlen) || memcmp(&ss, addr, addrlen))
+			continue;
+
+		fd = inherited_fds[i];
+		inherited_fds[i] = inherited_fds[--nr_inherited_fds];
+		break;
+	}
+	pthread_mutex_unlock(&listen_fds_lock);
+
+	if (fd == -1)
+		return -1;
+
+	/* the options of this process win */
+	listen(fd, listen_config.backlog);
+	listen_fd_register(fd);
+	return fd;
+}
+
+int listen_fd_close_inherited(void) {
+	int nr;
+
+	pthread_mutex_lock(&listen_fds_lock);
+	nr = nr_inherited_fds;
+	while (nr_inherited_fds)
+		close(inherited_fds[--nr_inherited_fds]);
+	pthread_mutex_unlock(&listen_fds_lock);
+
+	return nr;
+}
+
+/* optional, serve without them on failure */
+static void listen_set_tcp_options(int sockfd) {
+	if (listen_config.defer_accept && setsockopt(sockfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+						     &listen_config.defer_accept, sizeof(int)))
+		perror("socket set TCP_DEFER_ACCEPT failed: ");
+
+	if (listen_config.fastopen && setsockopt(sockfd, IPPROTO_TCP, TCP_FASTOPEN,
+						 &listen_config.fastopen, sizeof(int)))
+		perror("socket set TCP_FASTOPEN failed: ");
+}
+
 int listen_to_port(int port, char* bindaddr, int af) {
 	struct addrinfo hints;
 	struct addrinfo *res, *p;
@@ -116,7 +260,13 @@ int listen_to_port(int port, char* bindaddr, int af) {
 	}
 
 	for (p = res; p != NULL; p = p->ai_next) {
-		sockfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+		sockfd = listen_fd_take(p->ai_addr, p->ai_addrlen);
+		if (sockfd != -1) {
+			listen_set_tcp_options(sockfd);
+			goto end;
+		}
+
+		sockfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
 		if (sockfd == -1) {
 			perror("failed get socket fd: ");
 			continue;
@@ -141,7 +291,8 @@ int listen_to_port(int port, char* bindaddr, int af) {
 			continue;
 		}
 
-		ret = listen(sockfd, 128);
+		listen_set_tcp_options(sockfd);
+		ret = listen(sockfd, listen_config.backlog);
 		if (ret == -1) {
 			perror("socket listen failed: ");
 			close(sockfd);
@@ -149,6 +300,7 @@ int listen_to_port(int port, char* bindaddr, int af) {
 			continue;
 		}
 
+		listen_fd_register(sockfd);
 		goto end;
 	}
 
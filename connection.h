@@ -15,15 +15,23 @@
 
 #define CONN_TYPE_SOCKET "tcp"
 #define CONN_TYPE_TLS "tls"
+#define CONN_TYPE_URING "uring"
+#define CONN_TYPE_UNIX "unix"
 #define CONN_TYPE_MAX 8
 
 #include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
 #include <sys/uio.h>
 #include <poll.h>
 
 typedef struct connection connection;
 
+/* handshake in progress, wait for the fd to be readable/writable */
+#define CONN_HANDSHAKE_WANT_READ	1
+#define CONN_HANDSHAKE_WANT_WRITE	2
+
 typedef struct connection_type {
 	const char* (*get_type)(struct connection* conn);
 
@@ -32,15 +40,34 @@ typedef struct connection_type {
 	int (*configure)(void* priv, int reconfiguration);
 
 	connection* (*conn_create)(int port, char *addr);
+	void (*conn_free)(connection* conn);
 	int (*listen)(connection* listener);
 
+	/* a non-blocking fd of @conn, or -EAGAIN if no more connection */
 	int (*accept)(struct connection* listener, struct connection* conn);
+	int (*handshake)(struct connection* conn);
 	void (*close)(struct connection* conn);
 	void (*shutdown)(struct connection* conn);
 
 	int (*write)(struct connection* conn, const void* data, size_t data_len);
 	int (*writev)(struct connection* conn, const struct iovec* iov, int iovcnt);
+	int (*sendfile)(struct connection* conn, int fd, off_t offset, size_t len);
 	int (*read)(struct connection* conn, void* buf, size_t buf_len);
+
+	/* optional, the protocol negotiated by ALPN, NULL for HTTP/1.x */
+	const char* (*get_protocol)(struct connection* conn);
+	/* optional, sendfile() reads the file into user space, Ex, TLS without kTLS */
+	int (*sendfile_copies)(struct connection* conn);
+	/* optional, submit the operations batched by this thread before the event loop sleeps */
+	void (*flush)(void);
+	/*
+	 * optional, the connections are driven by completions rather than epoll.
+	 * Pop one with events (EPOLLIN/EPOLLOUT) of this thread, or NULL.
+	 */
+	int (*has_pending)(void);
+	connection* (*pending)(int *events);
+	/* optional, close @conn once all of @iov is written, Ex, linked to the write on a ring */
+	int (*writev_close)(struct connection* conn, const struct iovec* iov, int iovcnt);
 } connection_type;
 
 struct connection {
@@ -49,6 +76,7 @@ struct connection {
 	int port;
 	int is_local;
 	char *bindaddr;
+	void *private_data;
 };
 
 static inline int conn_configure(connection_type* ct, void* priv, int reconfigure) {
@@ -59,6 +87,11 @@ static inline connection* conn_create(connection_type* ct, int port, char *addr)
 	return ct->conn_create(port, addr);
 }
 
+/* free a closed connection, by the thread which created it */
+static inline void conn_free(connection* conn) {
+	conn->type->conn_free(conn);
+}
+
 static inline int conn_listen(connection* listener) {
 	return listener->type->listen(listener);
 }
@@ -67,6 +100,31 @@ static inline int conn_accept(connection* listener, connection* conn) {
 	return conn->type->accept(listener, conn);
 }
 
+/* optional, done by 0, CONN_HANDSHAKE_WANT_* to call again, or -errno */
+static inline int conn_handshake(connection* conn) {
+	if (!conn->type->handshake)
+		return 0;
+
+	return conn->type->handshake(conn);
+}
+
+static inline const char* conn_get_protocol(connection* conn) {
+	if (!conn->type->get_protocol)
+		return NULL;
+
+	return conn->type->get_protocol(conn);
+}
+
+/* the file is sent in kernel, send the mapping of it by writev otherwise */
+static inline int conn_sendfile_direct(connection* conn) {
+	return !conn->type->sendfile_copies || !conn->type->sendfile_copies(conn);
+}
+
+/* in the epoll set, or its events are popped by conntype_pending() */
+static inline int conn_polled(connection* conn) {
+	return !conn->type->pending;
+}
+
 static inline void conn_close(connection* conn) {
 	return conn->type->close(conn);
 }
@@ -83,17 +141,70 @@ static inline int conn_writev(connection* conn, const struct iovec* iovs, int io
 	return conn->type->writev(conn, iovs, iovcnt);
 }
 
+/* the last response, the connection gets closed once it's written in full */
+static inline int conn_writev_close(connection* conn, const struct iovec* iovs, int iovcnt) {
+	if (!conn->type->writev_close)
+		return conn->type->writev(conn, iovs, iovcnt);
+
+	return conn->type->writev_close(conn, iovs, iovcnt);
+}
+
+static inline int conn_sendfile(connection* conn, int fd, off_t offset, size_t len) {
+	return conn->type->sendfile(conn, fd, offset, len);
+}
+
 static inline int conn_read(connection* conn, void* buf, size_t buf_len) {
 	return conn->type->read(conn, buf, buf_len);
 }
 
 void conntype_initialize(void);
+void conntype_flush(void);
+int conntype_has_pending(void);
+connection* conntype_pending(int *events);
 int conntype_register(connection_type* ct);
 
 int register_conntype_socket();
 int register_conntype_tls();
+int register_conntype_uring();
+int register_conntype_unix();
+
+/* options of listening sockets, set them before listening */
+struct listen_config {
+	int backlog;
+	int defer_accept;	/* in seconds, 0 disables TCP_DEFER_ACCEPT */
+	int fastopen;		/* queue length, 0 disables TCP_FASTOPEN */
+};
+
+#define DEFAULT_BACKLOG 1024
+
+extern struct listen_config listen_config;
+
+#define MAX_UNIX_ALLOW_UIDS 16
 
+/* the unix socket listener */
+struct unix_config {
+	char *path;		/* a leading '@' for the abstract namespace */
+	int nr_allow_uids;	/* 0 allows any peer */
+	uid_t allow_uids[MAX_UNIX_ALLOW_UIDS];
+};
+
+extern struct unix_config unix_config;
+
+/* a non-blocking listening socket, accept it by accept4() */
 int listen_to_port(int port, char* bindaddr, int af);
+
+/* listening sockets of this process, handed over to the new one on upgrade */
+void listen_fd_register(int fd);
+int listen_fd_get_all(int *fds, int max);
+
+/*
+ * Sockets handed over by the previous process. A listener takes the one bound
+ * to the same address instead of binding a new one, and the ones left over
+ * are closed once all the workers are listening. Return the fd or -1.
+ */
+void listen_fd_inherit(int fd);
+int listen_fd_take(const struct sockaddr *addr, socklen_t addrlen);
+int listen_fd_close_inherited(void);
 connection_type* get_conntype_by_name(const char* typename);
 int get_conntype_index_by_name(const char* typename);
 
@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# Generate the web assets built into atophttpd: a copy of each asset, its
+# gzip variant and its ETag (leading 16 hex of sha1), listed in
+# OUTDIR/assets.h for httpd.c.
+# index.html refers to the other assets by "?v=ETAG", so browsers cache them
+# as immutable, and fetch them again once they change.
+#
+# Usage: gen-assets.sh OUTDIR ASSET...
+
+set -e
+
+OUTDIR=$1
+shift
+
+etag() {
+	sha1sum $1 | cut -c1-16
+}
+
+mkdir -p $OUTDIR
+HEADER=$OUTDIR/assets.h.tmp
+echo "/* generated by gen-assets.sh, do not edit */" > $HEADER
+
+VERSIONS=""
+for ASSET in "$@"; do
+	[ $ASSET = http/index.html ] && continue
+	NAME=${ASSET#http/}
+	VERSIONS="$VERSIONS -e s|\"/$NAME\"|\"/$NAME?v=$(etag $ASSET)\"|g"
+done
+
+for ASSET in "$@"; do
+	NAME=${ASSET#http/}
+	OUT=$OUTDIR/http/$NAME
+	mkdir -p $(dirname $OUT)
+
+	if [ $ASSET = http/index.html ]; then
+		sed $VERSIONS $ASSET > $OUT
+	else
+		cp $ASSET $OUT
+	fi
+
+	# -n: no name and timestamp, keep the build reproducible
+	gzip -9 -n -c $OUT > $OUT.gz
+
+	SYM=asset_$(echo $NAME | tr -c 'A-Za-z0-9\n' '_')
+	echo "ASSET(\"$NAME\", $SYM, \"$(etag $OUT)\")" >> $HEADER
+done
+
+mv $HEADER $OUTDIR/assets.h
@@ -77,6 +77,8 @@ var filter_str = ""
 var init = true
 
 var delta = 0
+// the closest sample in this direction if there is none at the requested time
+var direction = ""
 const queue = []
 let loading = false
 let p
@@ -99,6 +101,7 @@ window.onkeydown = function (event) {
                 tmp_timestamp = ParseDateToTimesample(chosed_date_str)
                 if (tmp_timestamp != 0) {
                     delta = tmp_timestamp - pre_timestamp
+                    direction = ""
                 } else {
                     alert("Wrong time!")
                 }
@@ -107,6 +110,7 @@ window.onkeydown = function (event) {
             break;
         case 'T':
             delta -= 10
+            direction = "before"
             if (loading) {
                 return
             }
@@ -114,6 +118,7 @@ window.onkeydown = function (event) {
             break;
         case 't':
             delta += 10
+            direction = "after"
             if (loading) {
                 return
             }
@@ -319,6 +324,9 @@ function getJsonRawDataFromServer(paras) {
         if (paras.req_change_data) {
             host = document.location.host;
             var url = "http://" + host + "/showsamp?timestamp=" + paras.req_timestamp + "&lables=ALL";
+            if (direction != "") {
+                url += "&direction=" + direction;
+            }
             var request = new XMLHttpRequest();
 
             request.open("GET", url, true);
@@ -0,0 +1,571 @@
+/*
+ * Copyright 2023 zhenwei pi
+ *
+ * Authors:
+ *   zhenwei pi <pizhenwei@bytedance.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "http2.h"
+#include "pool.h"
+
+#define HTTP2_PREFACE		"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LEN	(sizeof(HTTP2_PREFACE) - 1)
+
+int http2_preface_match(const char *buf, size_t len)
+{
+	if (len >= HTTP2_PREFACE_LEN)
+		return memcmp(buf, HTTP2_PREFACE, HTTP2_PREFACE_LEN) ? -1 : 1;
+
+	return memcmp(buf, HTTP2_PREFACE, len) ? -1 : 0;
+}
+
+#ifdef USE_HTTP2
+#include <nghttp2/nghttp2.h>
+
+#define HTTP2_MAX_STREAMS	100
+#define HTTP2_METHOD_MAX	16
+#define HTTP2_PATH_MAX		1024
+#define HTTP2_REQUEST_MAX	4096	/* the same as HTTP/1.x */
+#define HTTP2_MAX_FIELDS	32	/* of a response */
+
+/*
+ * A request is rebuilt in HTTP/1.1 text from the header fields, then it's
+ * parsed and routed the same as HTTP/1.x. Pseudo-header fields come first,
+ * the request line is written once a regular field or the end arrives.
+ */
+struct http2_stream {
+	int32_t id;
+	struct http2_stream *prev, *next;
+	char method[HTTP2_METHOD_MAX];
+	char path[HTTP2_PATH_MAX];
+	int has_line;		/* the request line is written */
+	int overflow;		/* the request doesn't fit in buf */
+	int done;		/* the request is handled, ignore trailers */
+	size_t len;
+	char buf[HTTP2_REQUEST_MAX + 1];
+	struct http_request req;
+
+	/* the response body */
+	const char *body;
+	size_t body_len;
+	size_t sent;
+	void *free_ptr;
+};
+
+struct http2_session {
+	nghttp2_session *session;
+	const struct http2_ops *ops;
+	void *ctx;
+	struct http2_stream *streams;
+	int destroying;
+	int upgrading;		/* 101 is sent, wait for the client preface */
+};
+
+static __thread struct pool http2_stream_pool = POOL_INITIALIZER("h2_stream", sizeof(struct http2_stream), 128);
+
+static nghttp2_session_callbacks *http2_callbacks;
+
+static int http2_stream_append(struct http2_stream *stream, const char *s, size_t len)
+{
+	if (stream->len + len > HTTP2_REQUEST_MAX) {
+		stream->overflow = 1;
+		return -1;
+	}
+
+	memcpy(stream->buf + stream->len, s, len);
+	stream->len += len;
+	return 0;
+}
+
+static void http2_stream_line(struct http2_stream *stream)
+{
+	if (stream->has_line)
+		return;
+
+	stream->has_line = 1;
+	http2_stream_append(stream, stream->method, strlen(stream->method));
+	http2_stream_append(stream, " ", 1);
+	http2_stream_append(stream, stream->path, strlen(stream->path));
+	http2_stream_append(stream, " HTTP/1.1\r\n", strlen(" HTTP/1.1\r\n"));
+}
+
+static void http2_stream_free(struct http2_session *h2, struct http2_stream *stream)
+{
+	if (stream->prev)
+		stream->prev->next = stream->next;
+	else
+		h2->streams = stream->next;
+	if (stream->next)
+		stream->next->prev = stream->prev;
+
+	pool_free(&http2_stream_pool, stream);
+}
+
+static ssize_t http2_send_cb(nghttp2_session *session, const uint8_t *data, size_t length, int flags, void *user_data)
+{
+	struct http2_session *h2 = user_data;
+	void *buf;
+
+	if (!h2->ops->writable(h2->ctx))
+		return NGHTTP2_ERR_WOULDBLOCK;
+
+	buf = malloc(length);
+	if (!buf)
+		return NGHTTP2_ERR_CALLBACK_FAILURE;
+
+	memcpy(buf, data, length);
+	if (h2->ops->send(h2->ctx, buf, length, buf))
+		return NGHTTP2_ERR_CALLBACK_FAILURE;
+
+	return length;
+}
+
+/* queue the frame header, the payload refers to the body */
+static int http2_send_data_cb(nghttp2_session *session, nghttp2_frame *frame, const uint8_t *framehd,
+			      size_t length, nghttp2_data_source *source, void *user_data)
+{
+	struct http2_session *h2 = user_data;
+	struct http2_stream *stream = source->ptr;
+	void *hd;
+
+	if (!h2->ops->writable(h2->ctx))
+		return NGHTTP2_ERR_WOULDBLOCK;
+
+	hd = malloc(9);
+	if (!hd)
+		return NGHTTP2_ERR_CALLBACK_FAILURE;
+
+	memcpy(hd, framehd, 9);
+	if (h2->ops->send(h2->ctx, hd, 9, hd))
+		return NGHTTP2_ERR_CALLBACK_FAILURE;
+
+	if (length && h2->ops->send(h2->ctx, (void *)(stream->body + stream->sent), length, NULL))
+		return NGHTTP2_ERR_CALLBACK_FAILURE;
+
+	stream->sent += length;
+	return 0;
+}
+
+static ssize_t http2_read_body_cb(nghttp2_session *session, int32_t stream_id, uint8_t *buf, size_t length,
+				  uint32_t *data_flags, nghttp2_data_source *source, void *user_data)
+{
+	struct http2_stream *stream = source->ptr;
+	size_t len = stream->body_len - stream->sent;
+
+	if (len > length)
+		len = length;
+	else
+		*data_flags |= NGHTTP2_DATA_FLAG_EOF;
+
+	*data_flags |= NGHTTP2_DATA_FLAG_NO_COPY;
+	return len;
+}
+
+static int http2_begin_headers_cb(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+{
+	struct http2_session *h2 = user_data;
+	struct http2_stream *stream;
+
+	if ((frame->hd.type != NGHTTP2_HEADERS) || (frame->headers.cat != NGHTTP2_HCAT_REQUEST))
+		return 0;
+
+	stream = pool_alloc(&http2_stream_pool);
+	if (!stream)
+		return NGHTTP2_ERR_TEMPORAL_CALLBACK_FAILURE;
+
+	stream->id = frame->hd.stream_id;
+	stream->next = h2->streams;
+	if (h2->streams)
+		h2->streams->prev = stream;
+	h2->streams = stream;
+	nghttp2_session_set_stream_user_data(session, stream->id, stream);
+
+	return 0;
+}
+
+static int http2_header_cb(nghttp2_session *session, const nghttp2_frame *frame, const uint8_t *_name,
+			   size_t namelen, const uint8_t *_value, size_t valuelen, uint8_t flags, void *user_data)
+{
+	struct http2_stream *stream = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+	const char *name = (const char *)_name, *value = (const char *)_value;
+
+	if (!stream || stream->overflow || stream->done || (frame->hd.type != NGHTTP2_HEADERS))
+		return 0;
+
+	if (name[0] == ':') {
+		if (!strcmp(name, ":method")) {
+			snprintf(stream->method, sizeof(stream->method), "%s", value);
+		} else if (!strcmp(name, ":path")) {
+			if (valuelen >= sizeof(stream->path))
+				stream->overflow = 1;
+			else
+				memcpy(stream->path, value, valuelen + 1);
+		} else if (!strcmp(name, ":authority")) {
+			http2_stream_line(stream);
+			http2_stream_append(stream, "Host: ", strlen("Host: "));
+			http2_stream_append(stream, value, valuelen);
+			http2_stream_append(stream, "\r\n", 2);
+		}
+
+		return 0;
+	}
+
+	/* nghttp2 rejects CR, LF and NUL in fields, they can't break the text */
+	http2_stream_line(stream);
+	http2_stream_append(stream, name, namelen);
+	http2_stream_append(stream, ": ", 2);
+	http2_stream_append(stream, value, valuelen);
+	http2_stream_append(stream, "\r\n", 2);
+
+	return 0;
+}
+
+static int http2_request(struct http2_session *h2, struct http2_stream *stream)
+{
+	stream->done = 1;
+	http2_stream_line(stream);
+	if (http2_stream_append(stream, "\r\n", 2) || stream->overflow)
+		return -1;
+
+	stream->buf[stream->len] = '\0';
+	if (http_parse_request(&stream->req, stream->buf, stream->len) <= 0)
+		return -1;
+
+	return h2->ops->request(h2->ctx, stream->id, &stream->req);
+}
+
+static int http2_frame_recv_cb(nghttp2_session *session, const nghttp2_frame *frame, void *user_data)
+{
+	struct http2_session *h2 = user_data;
+	struct http2_stream *stream;
+
+	/* a request body is not supported, ignore it */
+	if (((frame->hd.type != NGHTTP2_HEADERS) && (frame->hd.type != NGHTTP2_DATA)) ||
+	    !(frame->hd.flags & NGHTTP2_FLAG_END_STREAM))
+		return 0;
+
+	stream = nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+	if (!stream || stream->done)
+		return 0;
+
+	if (http2_request(h2, stream) < 0)
+		nghttp2_submit_rst_stream(session, NGHTTP2_FLAG_NONE, stream->id, NGHTTP2_PROTOCOL_ERROR);
+
+	return 0;
+}
+
+static int http2_stream_close_cb(nghttp2_session *session, int32_t stream_id, uint32_t error_code, void *user_data)
+{
+	struct http2_session *h2 = user_data;
+	struct http2_stream *stream = nghttp2_session_get_stream_user_data(session, stream_id);
+
+	if (!stream)
+		return 0;
+
+	/* the queued DATA frames refer to the body, free it after them */
+	if (h2->destroying)
+		free(stream->free_ptr);
+	else if (stream->free_ptr && h2->ops->send(h2->ctx, NULL, 0, stream->free_ptr))
+		return NGHTTP2_ERR_CALLBACK_FAILURE;
+
+	stream->free_ptr = NULL;
+	http2_stream_free(h2, stream);
+
+	return 0;
+}
+
+static int http2_callbacks_init(void)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	nghttp2_session_callbacks *callbacks;
+
+	pthread_mutex_lock(&lock);
+	if (http2_callbacks || nghttp2_session_callbacks_new(&callbacks))
+		goto unlock;
+
+	nghttp2_session_callbacks_set_send_callback(callbacks, http2_send_cb);
+	nghttp2_session_callbacks_set_send_data_callback(callbacks, http2_send_data_cb);
+	nghttp2_session_callbacks_set_on_begin_headers_callback(callbacks, http2_begin_headers_cb);
+	nghttp2_session_callbacks_set_on_header_callback(callbacks, http2_header_cb);
+	nghttp2_session_callbacks_set_on_frame_recv_callback(callbacks, http2_frame_recv_cb);
+	nghttp2_session_callbacks_set_on_stream_close_callback(callbacks, http2_stream_close_cb);
+	http2_callbacks = callbacks;
+
+unlock:
+	pthread_mutex_unlock(&lock);
+	return http2_callbacks ? 0 : -ENOMEM;
+}
+
+struct http2_session *http2_session_create(const struct http2_ops *ops, void *ctx)
+{
+	nghttp2_settings_entry settings[] = {
+		{ NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, HTTP2_MAX_STREAMS },
+	};
+	struct http2_session *h2;
+
+	if (http2_callbacks_init())
+		return NULL;
+
+	h2 = calloc(1, sizeof(struct http2_session));
+	if (!h2)
+		return NULL;
+
+	h2->ops = ops;
+	h2->ctx = ctx;
+	if (nghttp2_session_server_new(&h2->session, http2_callbacks, h2)) {
+		free(h2);
+		return NULL;
+	}
+
+	if (nghttp2_submit_settings(h2->session, NGHTTP2_FLAG_NONE, settings, sizeof(settings) / sizeof(settings[0]))) {
+		http2_session_destroy(h2);
+		return NULL;
+	}
+
+	return h2;
+}
+
+void http2_session_destroy(struct http2_session *h2)
+{
+	h2->destroying = 1;
+	nghttp2_session_del(h2->session);
+
+	/* the streams left, if deleting session doesn't close them */
+	while (h2->streams) {
+		free(h2->streams->free_ptr);
+		http2_stream_free(h2, h2->streams);
+	}
+
+	free(h2);
+}
+
+/* base64url without padding, return the length or -1 */
+static int http2_base64url_decode(const struct http_slice *in, unsigned char *out, size_t size)
+{
+	unsigned int bits = 0, nbits = 0;
+	size_t len = 0;
+
+	for (size_t i = 0; i < in->len; i++) {
+		char c = in->ptr[i];
+		int v;
+
+		if (c >= 'A' && c <= 'Z')
+			v = c - 'A';
+		else if (c >= 'a' && c <= 'z')
+			v = c - 'a' + 26;
+		else if (c >= '0' && c <= '9')
+			v = c - '0' + 52;
+		else if (c == '-' || c == '+')
+			v = 62;
+		else if (c == '_' || c == '/')
+			v = 63;
+		else if (c == '=')
+			break;
+		else
+			return -1;
+
+		bits = (bits << 6) | v;
+		nbits += 6;
+		if (nbits >= 8) {
+			nbits -= 8;
+			if (len == size)
+				return -1;
+			out[len++] = bits >> nbits;
+		}
+	}
+
+	return len;
+}
+
+int http2_session_upgrade(struct http2_session *h2, const struct http_slice *settings)
+{
+	unsigned char payload[256];
+	struct http2_stream *stream;
+	int len = http2_base64url_decode(settings, payload, sizeof(payload));
+
+	if (len < 0)
+		return -EINVAL;
+
+	stream = pool_alloc(&http2_stream_pool);
+	if (!stream)
+		return -ENOMEM;
+
+	stream->id = 1;
+	stream->done = 1;
+	stream->next = h2->streams;
+	if (h2->streams)
+		h2->streams->prev = stream;
+	h2->streams = stream;
+
+	/*
+	 * Don't send anything after 101 until the client switches, some clients
+	 * buffer the bytes following 101 in a small buffer.
+	 */
+	h2->upgrading = 1;
+
+	/* the stream user data of upgrade is for client only */
+	if (nghttp2_session_upgrade2(h2->session, payload, len, 0, NULL) ||
+	    nghttp2_session_set_stream_user_data(h2->session, 1, stream)) {
+		http2_stream_free(h2, stream);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int http2_session_recv(struct http2_session *h2, const char *buf, size_t len)
+{
+	ssize_t ret = nghttp2_session_mem_recv(h2->session, (const uint8_t *)buf, len);
+
+	h2->upgrading = 0;
+
+	if (ret < 0) {
+		printf("HTTP/2 recv failed: %s\n", nghttp2_strerror(ret));
+		return -EPROTO;
+	}
+
+	return 0;
+}
+
+int http2_session_send(struct http2_session *h2)
+{
+	int ret;
+
+	if (h2->upgrading)
+		return 0;
+
+	ret = nghttp2_session_send(h2->session);
+	if (ret) {
+		printf("HTTP/2 send failed: %s\n", nghttp2_strerror(ret));
+		return -EIO;
+	}
+
+	return 0;
+}
+
+int http2_session_alive(struct http2_session *h2)
+{
+	return nghttp2_session_want_read(h2->session) || nghttp2_session_want_write(h2->session);
+}
+
+/* connection specific fields are not allowed in HTTP/2 */
+static int http2_hop_by_hop(const char *name)
+{
+	return !strcmp(name, "connection") || !strcmp(name, "keep-alive") || !strcmp(name, "upgrade") ||
+	       !strcmp(name, "transfer-encoding") || !strcmp(name, "proxy-connection");
+}
+
+int http2_submit_response(struct http2_session *h2, int32_t stream_id, const char *head, size_t head_len,
+			  const char *body, size_t body_len, void *free_ptr)
+{
+	struct http2_stream *stream = nghttp2_session_get_stream_user_data(h2->session, stream_id);
+	nghttp2_data_provider provider = { .read_callback = http2_read_body_cb };
+	nghttp2_nv nva[HTTP2_MAX_FIELDS];
+	char fields[HTTP2_REQUEST_MAX];
+	const char *line = memchr(head, '\n', head_len), *end = head + head_len;
+	char *p = fields;
+	size_t nvlen = 0;
+
+	if (!stream || !line || (head_len < 12) || (head_len >= sizeof(fields)) || strncmp(head, "HTTP/1.", 7))
+		goto error;
+
+	/* status of "HTTP/1.1 200 OK" */
+	nva[nvlen++] = (nghttp2_nv) { (uint8_t *)":status", (uint8_t *)head + 9, 7, 3, NGHTTP2_NV_FLAG_NONE };
+
+	/* "name: value" lines, names are lowercase in HTTP/2 */
+	for (line++; line < end; ) {
+		const char *eol = memchr(line, '\n', end - line);
+		const char *colon = memchr(line, ':', eol ? eol - line : 0);
+		const char *value;
+		size_t namelen, valuelen;
+
+		if (!eol || (eol - line <= 1))
+			break;
+
+		if (!colon || (nvlen == HTTP2_MAX_FIELDS))
+			goto error;
+
+		namelen = colon - line;
+		for (size_t i = 0; i < namelen; i++)
+			p[i] = tolower(line[i]);
+		p[namelen] = '\0';
+
+		value = colon + 1;
+		while (*value == ' ')
+			value++;
+		valuelen = eol - value - (eol[-1] == '\r');
+
+		if (!http2_hop_by_hop(p))
+			nva[nvlen++] = (nghttp2_nv) { (uint8_t *)p, (uint8_t *)value, namelen, valuelen, NGHTTP2_NV_FLAG_NONE };
+
+		p += namelen + 1;
+		line = eol + 1;
+	}
+
+	stream->body = body;
+	stream->body_len = body_len;
+	stream->free_ptr = free_ptr;
+	provider.source.ptr = stream;
+	if (nghttp2_submit_response(h2->session, stream_id, nva, nvlen, body_len ? &provider : NULL)) {
+		stream->free_ptr = NULL;
+		goto error;
+	}
+
+	return 0;
+
+error:
+	free(free_ptr);
+	nghttp2_submit_rst_stream(h2->session, NGHTTP2_FLAG_NONE, stream_id, NGHTTP2_INTERNAL_ERROR);
+	return -EINVAL;
+}
+
+#else
+
+struct http2_session *http2_session_create(const struct http2_ops *ops, void *ctx)
+{
+	return NULL;
+}
+
+void http2_session_destroy(struct http2_session *session)
+{
+}
+
+int http2_session_upgrade(struct http2_session *session, const struct http_slice *settings)
+{
+	return -EOPNOTSUPP;
+}
+
+int http2_session_recv(struct http2_session *session, const char *buf, size_t len)
+{
+	return -EOPNOTSUPP;
+}
+
+int http2_session_send(struct http2_session *session)
+{
+	return -EOPNOTSUPP;
+}
+
+int http2_session_alive(struct http2_session *session)
+{
+	return 0;
+}
+
+int http2_submit_response(struct http2_session *session, int32_t stream_id, const char *head, size_t head_len,
+			  const char *body, size_t body_len, void *free_ptr)
+{
+	free(free_ptr);
+	return -EOPNOTSUPP;
+}
+
+#endif
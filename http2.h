@@ -0,0 +1,76 @@
+/*
+ * Copyright 2023 zhenwei pi
+ *
+ * Authors:
+ *   zhenwei pi <pizhenwei@bytedance.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef _HTTP2_H_
+#define _HTTP2_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http_parser.h"
+
+/* protocol ID of ALPN */
+#define HTTP2_ALPN	"h2"
+
+struct http2_session;
+
+/* called back by a session, @ctx is the argument of http2_session_create() */
+struct http2_ops {
+	/*
+	 * Queue @len bytes of @buf to the peer, @free_ptr is freed once they are
+	 * sent, or on failure. @len may be 0 to free @free_ptr after the queued
+	 * bytes. Return 0 or -errno.
+	 */
+	int (*send)(void *ctx, void *buf, size_t len, void *free_ptr);
+
+	/* 0 if too many bytes are queued, stop sending until it's flushed */
+	int (*writable)(void *ctx);
+
+	/*
+	 * A whole request of @stream_id, respond it by http2_submit_response().
+	 * Return -1 to reset the stream.
+	 */
+	int (*request)(void *ctx, int32_t stream_id, struct http_request *req);
+};
+
+/*
+ * 1 if @buf starts with the client connection preface, 0 if it's a part of the
+ * preface so more bytes are needed, or -1 if it's not HTTP/2.
+ */
+int http2_preface_match(const char *buf, size_t len);
+
+/* a server session, NULL on failure or if HTTP/2 is not builtin */
+struct http2_session *http2_session_create(const struct http2_ops *ops, void *ctx);
+void http2_session_destroy(struct http2_session *session);
+
+/*
+ * Upgrade from an HTTP/1.1 request with "Upgrade: h2c", by the value of
+ * "HTTP2-Settings". The request becomes the stream 1, respond it then.
+ */
+int http2_session_upgrade(struct http2_session *session, const struct http_slice *settings);
+
+/* feed the bytes from the peer, requests are called back, return 0 or -errno */
+int http2_session_recv(struct http2_session *session, const char *buf, size_t len);
+
+/* queue the pending frames by http2_ops::send, until it's not writable */
+int http2_session_send(struct http2_session *session);
+
+/* 0 if both of the sides are done, close the connection after flushing */
+int http2_session_alive(struct http2_session *session);
+
+/*
+ * Respond @stream_id by an HTTP/1.1 response header @head, it's translated to
+ * HTTP/2 header fields. @body is sent without copy, and freed by @free_ptr if
+ * it's not NULL.
+ */
+int http2_submit_response(struct http2_session *session, int32_t stream_id, const char *head, size_t head_len,
+			  const char *body, size_t body_len, void *free_ptr);
+
+#endif
@@ -0,0 +1,80 @@
+/*
+ * Copyright 2023 zhenwei pi
+ *
+ * Authors:
+ *   zhenwei pi <pizhenwei@bytedance.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef _HTTP_PARSER_H_
+#define _HTTP_PARSER_H_
+
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+
+#define HTTP_MAX_HEADERS	32
+#define HTTP_MAX_ARGS		16
+
+/* a piece of the request buffer, not null terminated */
+struct http_slice {
+	const char *ptr;
+	size_t len;
+};
+
+struct http_field {
+	struct http_slice name;
+	struct http_slice value;
+};
+
+/*
+ * A parsed request refers to the buffer, nothing is copied. Keep the buffer
+ * unchanged until the request is handled, appending to it is fine.
+ */
+struct http_request {
+	size_t scanned;		/* bytes searched for the end of headers */
+	size_t len;		/* the whole request, 0 if it's incomplete */
+	struct http_slice method;
+	struct http_slice path;	/* without leading '/' and query */
+	struct http_slice query;	/* without '?' */
+	int minor;		/* HTTP/1.minor */
+	int nr_args;
+	struct http_field args[HTTP_MAX_ARGS];
+	int nr_headers;
+	struct http_field headers[HTTP_MAX_HEADERS];
+};
+
+static inline void http_request_reset(struct http_request *req)
+{
+	req->scanned = 0;
+	req->len = 0;
+}
+
+static inline int http_slice_equal(const struct http_slice *slice, const char *s)
+{
+	return (strlen(s) == slice->len) && !memcmp(slice->ptr, s, slice->len);
+}
+
+static inline int http_slice_caseequal(const struct http_slice *slice, const char *s)
+{
+	return (strlen(s) == slice->len) && !strncasecmp(slice->ptr, s, slice->len);
+}
+
+/*
+ * Parse the request at the head of @buf of @len bytes, resume from the last
+ * call until http_request_reset(). Return the length of the request if it's
+ * complete, 0 if more bytes are needed, or -1 if it's malformed.
+ */
+int http_parse_request(struct http_request *req, const char *buf, size_t len);
+
+/* case insensitive, NULL if missing */
+const struct http_slice *http_request_header(const struct http_request *req, const char *name);
+const struct http_slice *http_request_arg(const struct http_request *req, const char *name);
+
+/* copy percent-decoded value into @buf, return -1 if missing or too long */
+int http_request_arg_str(const struct http_request *req, const char *name, char *buf, size_t size);
+int http_request_arg_long(const struct http_request *req, const char *name, long *l);
+
+#endif
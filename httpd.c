@@ -8,19 +8,24 @@
  * See the COPYING file in the top-level directory.
  */
 
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <linux/tcp.h>
 #include <linux/types.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <pwd.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/utsname.h>
@@ -29,8 +34,18 @@
 #include <unistd.h>
 #include <zlib.h>
 
+#include "admission.h"
+#include "cache.h"
+#include "http2.h"
+#include "http_parser.h"
 #include "httpd.h"
+#include "json.h"
 #include "output.h"
+#include "pool.h"
+#include "response.h"
+#include "route.h"
+#include "sample.h"
+#include "upgrade.h"
 
 #include "version.h"
 
@@ -42,18 +57,126 @@
 #define DEFAULT_KEY_FILE	"/etc/pki/atophttpd/server.key"
 #define DEFAULT_CA_FILE		"/etc/pki/CA/ca.crt"
 
+#define MAX_WORKERS		256
+
+#define DEFAULT_KEEPALIVE_TIMEOUT	15	/* in seconds */
+#define DEFAULT_KEEPALIVE_REQUESTS	100
+#define REQUEST_TIMEOUT			5	/* in seconds, to receive a whole request */
+#define HANDSHAKE_TIMEOUT		5	/* in seconds, to complete TLS handshake */
+#define RESCAN_INTERVAL			3	/* in seconds, to index rawlogs without inotify */
+#define DRAIN_TIMEOUT			30	/* in seconds, to serve accepted connections on upgrade */
+#define MAX_EVENTS			64
+#define MAX_ACCEPTS			256	/* per wakeup, the rest at the next one */
+#define OUTQ_HIGH_WATER			(4 * 1024 * 1024)	/* stop serving pipelined requests */
+#define OUTQ_MAX_IOVS			64	/* iovs of one writev */
+
 static void http_show_samp_done(struct output *op, connection *conn);
 
-struct output defop = {
-	.output_type = OUTPUT_BUF,
-	.done = http_show_samp_done
+/*
+ * Each worker owns its listeners (bound to the same port by SO_REUSEPORT),
+ * its epoll instance and its output context. The rawlog index is shared.
+ */
+struct httpd_worker {
+	int id;
+	pthread_t thread;
+	int epollfd;
+	connection *listeners[CONN_TYPE_MAX];
+	struct output op;
+	struct httpd_client *clients;	/* accepted connections, for timeout */
+	struct httpd_client *ready;	/* connections with pipelined requests */
+	struct httpd_client *ready_tail;
+	time_t drain_expire;		/* in ms, set once it stops accepting */
+};
+
+/* the new process is serving, see upgrade.h */
+static int httpd_draining;
+static char **httpd_argv;
+
+/* workers are listening, the previous process stops accepting then */
+static pthread_barrier_t httpd_listening;
+
+#define INBUF_SIZE	4096
+#define URL_LEN		1024
+
+/*
+ * A piece of response, free_ptr is freed once it's sent. A cached body is sent
+ * from resp, it's put once it's sent. A file chunk sends iov.iov_len bytes of
+ * the memfd of resp from off by sendfile.
+ */
+struct httpd_chunk {
+	struct iovec iov;
+	void *free_ptr;
+	struct response *resp;
+	int fd;
+	off_t off;
+};
+
+/* response chunks waiting for sending, resume on EPOLLOUT */
+struct httpd_outq {
+	struct httpd_chunk *chunks;
+	int head;		/* the first unsent chunk */
+	int nr_chunks;
+	int max_chunks;
+	size_t bytes;		/* unsent bytes */
+};
+
+/*
+ * Accepted connection state:
+ * HANDSHAKE -> IDLE: TLS handshake is done, by the event loop.
+ * IDLE -> READING: part of a request arrived, wait for the rest of it.
+ * READING -> PROCESSING: a whole request arrived, handle it.
+ * PROCESSING -> WRITING: send the response.
+ * WRITING -> IDLE/READING/PROCESSING: depends on the pipelined bytes.
+ * IDLE/READING/PROCESSING -> HTTP2: by the preface, ALPN or h2c upgrade.
+ * Pipelined requests are served while the previous responses are still
+ * queued, until the queue reaches OUTQ_HIGH_WATER.
+ */
+enum httpd_client_state {
+	CLIENT_STATE_HANDSHAKE,
+	CLIENT_STATE_IDLE,
+	CLIENT_STATE_READING,
+	CLIENT_STATE_PROCESSING,
+	CLIENT_STATE_WRITING,
+	CLIENT_STATE_HTTP2,
+	CLIENT_STATE_CLOSED
 };
 
+/*
+ * An accepted connection, linked to connection::private_data. Unhandled
+ * bytes (pipelined requests) stay in inbuf across requests.
+ */
+struct httpd_client {
+	connection *conn;
+	struct httpd_worker *worker;
+	struct httpd_client *prev, *next;
+	struct httpd_client *ready_next;
+	int is_ready;		/* linked in worker's ready list */
+	enum httpd_client_state state;
+	char inbuf[INBUF_SIZE + 1];
+	int inbytes;
+	int nr_requests;
+	int keepalive;		/* keep connection open after this response */
+	uint32_t client_key;	/* for rate limit, by the peer address */
+	struct http_request request;	/* the request at the head of inbuf */
+	int pollout;		/* EPOLLOUT is armed */
+	time_t expire;		/* in ms, close it if no progress until then */
+	struct httpd_outq outq;
+	struct http2_session *h2;	/* in CLIENT_STATE_HTTP2 */
+	struct httpd_outq *stream;	/* the response of an HTTP/2 stream in handling */
+};
+
+/* clients and their input buffers are reused by each worker */
+static __thread struct pool httpd_client_pool = POOL_INITIALIZER("client", sizeof(struct httpd_client), 256);
+
 static struct atophttd_context config = {
 	.port = DEFAULT_PORT,
         .daemonmode = 0,
+	.workers = 1,
+	.keepalive_timeout = DEFAULT_KEEPALIVE_TIMEOUT,
+	.keepalive_requests = DEFAULT_KEEPALIVE_REQUESTS,
 	.log_path = DEFAULT_LOG_PATH,
 	.addr = "127.0.0.1",
+	.conn_type = CONN_TYPE_SOCKET,
 
 	.tls_ctx_config.tls_port = -1,
 	.tls_ctx_config.tls_addr = "::*",
@@ -68,466 +191,1487 @@ unsigned short hertz;
 struct utsname utsname;
 int hidecmdline = 0;
 
-#define INBUF_SIZE	4096
-#define URL_LEN		1024
 /* HTTP codes */
+static char *http_101 = "HTTP/1.1 101 Switching Protocols\r\n"
+"Connection: Upgrade\r\n"
+"Upgrade: h2c\r\n\r\n";
 static char *http_200 = "HTTP/1.1 200 OK\r\n";
+static char *http_304 = "HTTP/1.1 304 Not Modified\r\n";
 static char *http_404 = "HTTP/1.1 404 Not Found\r\n";
+static char *http_429 = "HTTP/1.1 429 Too Many Requests\r\n";
+static char *http_503 = "HTTP/1.1 503 Service Unavailable\r\n";
+
+static char *http_server = "Server: atop\r\n";
+
+/* HTTP connection */
+static char *http_connection_keepalive = "Connection: keep-alive\r\n";
+static char *http_connection_close = "Connection: close\r\n";
 
 /* HTTP content types */
 static char *http_content_type_none = "";
 static char *http_content_type_deflate = "Content-Encoding: deflate\r\n";
+static char *http_content_encoding_gzip = "Content-Encoding: gzip\r\n";
+
+/* HTTP cache control, assets are immutable only if they are versioned */
+static char *http_cache_revalidate = "no-cache";
+static char *http_cache_immutable = "public, max-age=31536000, immutable";
 
 /* HTTP generic header */
 static char *http_generic = "Server: atop\r\n"
+"%s"	/* for http_connection_XXX */
 "%s"	/* for http_content_type_XXX */
 "Content-Type: %s; charset=utf-8\r\n"
-"Content-Length: %d\r\n\r\n";
+"Content-Length: %zu\r\n\r\n";
+
+/* HTTP empty body header */
+static char *http_empty = "Server: atop\r\n"
+"%s"	/* for http_connection_XXX */
+"Content-Length: 0\r\n\r\n";
+
+/* HTTP rejected request header, it's cheap to retry later */
+static char *http_retry = "Server: atop\r\n"
+"%s"	/* for http_connection_XXX */
+"Retry-After: 1\r\n"
+"Content-Length: 0\r\n\r\n";
+
+/* HTTP asset header, follows http_server and http_connection_XXX */
+static char *http_asset_header = "%s"	/* for http_content_encoding_gzip */
+"Content-Type: %s\r\n"
+"Content-Length: %zu\r\n"
+"ETag: \"%s\"\r\n"
+"Cache-Control: %s\r\n"
+"Vary: Accept-Encoding\r\n\r\n";
+
+static char *http_asset_header_304 = "ETag: \"%s\"\r\n"
+"Cache-Control: %s\r\n"
+"Vary: Accept-Encoding\r\n\r\n";
 
 /* HTTP content types */
 static char *http_content_type_html = "text/html";
-static char *http_content_type_css = "text/css";
-static char *http_content_type_javascript = "application/javascript";
 
-static int http_prepare_response(connection *conn)
+static char *http_connection(connection *conn)
 {
-	/* try to send response data in a timeout */
-	int onoff = 1;
+	struct httpd_client *client = conn->private_data;
+
+	return client->keepalive ? http_connection_keepalive : http_connection_close;
+}
+
+static int httpd_outq_push(struct httpd_outq *outq, void *buf, size_t len, void *free_ptr)
+{
+	struct httpd_chunk *chunk;
+
+	if (outq->nr_chunks == outq->max_chunks) {
+		if (outq->head) {
+			/* reuse the slots of sent chunks */
+			outq->nr_chunks -= outq->head;
+			memmove(outq->chunks, outq->chunks + outq->head, outq->nr_chunks * sizeof(*chunk));
+			outq->head = 0;
+		} else {
+			int max_chunks = outq->max_chunks ? outq->max_chunks * 2 : 8;
+			chunk = realloc(outq->chunks, max_chunks * sizeof(*chunk));
+			if (!chunk)
+				return -ENOMEM;
+
+			outq->chunks = chunk;
+			outq->max_chunks = max_chunks;
+		}
+	}
+
+	chunk = &outq->chunks[outq->nr_chunks++];
+	chunk->iov.iov_base = buf;
+	chunk->iov.iov_len = len;
+	chunk->free_ptr = free_ptr;
+	chunk->resp = NULL;
+	chunk->fd = -1;
+	chunk->off = 0;
+	outq->bytes += len;
+
+	return 0;
+}
+
+/* it takes the reference of @resp on success, send its memfd if @sendfile */
+static int httpd_outq_push_response(struct httpd_outq *outq, struct response *resp, int sendfile)
+{
+	int file = sendfile && (resp->fd >= 0);
+	int ret = httpd_outq_push(outq, file ? NULL : resp->body, resp->len, NULL);
+
+	if (!ret) {
+		outq->chunks[outq->nr_chunks - 1].resp = resp;
+		outq->chunks[outq->nr_chunks - 1].fd = file ? resp->fd : -1;
+	}
+
+	return ret;
+}
+
+static void httpd_chunk_release(struct httpd_chunk *chunk)
+{
+	free(chunk->free_ptr);
+	if (chunk->resp)
+		response_put(chunk->resp);
+}
+
+/* drop the first @bytes bytes of queue */
+static void httpd_outq_pop(struct httpd_outq *outq, size_t bytes)
+{
+	outq->bytes -= bytes;
+	while (bytes) {
+		struct httpd_chunk *chunk = &outq->chunks[outq->head];
+
+		if (bytes < chunk->iov.iov_len) {
+			if (chunk->fd >= 0)
+				chunk->off += bytes;
+			else
+				chunk->iov.iov_base += bytes;
+			chunk->iov.iov_len -= bytes;
+			return;
+		}
+
+		bytes -= chunk->iov.iov_len;
+		httpd_chunk_release(chunk);
+		outq->head++;
+	}
+
+	/* skip empty chunks, then reset the queue if everything is sent */
+	while ((outq->head < outq->nr_chunks) && !outq->chunks[outq->head].iov.iov_len)
+		httpd_chunk_release(&outq->chunks[outq->head++]);
+
+	if (outq->head == outq->nr_chunks)
+		outq->head = outq->nr_chunks = 0;
+}
+
+static void httpd_outq_free(struct httpd_outq *outq)
+{
+	for (int i = outq->head; i < outq->nr_chunks; i++)
+		httpd_chunk_release(&outq->chunks[i]);
+
+	free(outq->chunks);
+	memset(outq, 0x00, sizeof(*outq));
+}
+
+/* queue a piece of response, it takes @free_ptr even on failure */
+static void http_response_queue(connection *conn, void *buf, size_t len, void *free_ptr)
+{
+	struct httpd_client *client = conn->private_data;
+	struct httpd_outq *outq = client->stream ? client->stream : &client->outq;
+
+	if (httpd_outq_push(outq, buf, len, free_ptr)) {
+		free(free_ptr);
+		/* the response is broken, the peer can't find the next one */
+		client->keepalive = 0;
+	}
+}
+
+static void http_response_200_header(connection *conn, size_t len, char *encoding, char* content_type)
+{
+	char *content;
+	int content_length;
+
+	/* 1, http code */
+	http_response_queue(conn, http_200, strlen(http_200), NULL);
+
+	/* 2, http generic content */
+	content_length = asprintf(&content, http_generic, http_connection(conn), encoding, content_type, len);
+	if (content_length < 0) {
+		content = NULL;
+		content_length = 0;
+	}
+	http_response_queue(conn, content, content_length, content);
+}
+
+/* queue a response, the body is owned by @free_ptr if it's not NULL */
+static void __http_response_200(connection *conn, char *buf, size_t len, char *encoding, char* content_type, void *free_ptr)
+{
+	http_response_200_header(conn, len, encoding, content_type);
+
+	/* 3, sample data record */
+	http_response_queue(conn, buf, len, free_ptr);
+}
+
+static void http_response_200(connection *conn, char *buf, size_t len, char *encoding, char* content_type)
+{
+	__http_response_200(conn, buf, len, encoding, content_type, NULL);
+}
+
+static void http_response_404(connection *conn)
+{
+	char *content;
+	int content_length;
+
+	http_response_queue(conn, http_404, strlen(http_404), NULL);
+
+	content_length = asprintf(&content, http_empty, http_connection(conn));
+	if (content_length < 0) {
+		content = NULL;
+		content_length = 0;
+	}
+	http_response_queue(conn, content, content_length, content);
+}
+
+/* @code is http_429 or http_503 */
+static void http_response_retry(connection *conn, char *code)
+{
+	char *content;
+	int content_length;
+
+	http_response_queue(conn, code, strlen(code), NULL);
+
+	content_length = asprintf(&content, http_retry, http_connection(conn));
+	if (content_length < 0) {
+		content = NULL;
+		content_length = 0;
+	}
+	http_response_queue(conn, content, content_length, content);
+}
+
+/* the sample in rendering is cacheable, set by http_showsamp_record() */
+static __thread struct response_key *http_samp_key;
+
+/* queue a cached body, it takes the reference of @resp */
+static void http_response_200_cached(connection *conn, struct response *resp)
+{
+	struct httpd_client *client = conn->private_data;
+	char *body;
+
+	/* http2.c frees the body of a stream once it's sent, copy it */
+	if (client->stream) {
+		body = malloc(resp->len);
+		if (body) {
+			memcpy(body, resp->body, resp->len);
+			__http_response_200(conn, body, resp->len, resp->key.encoding, http_content_type_html, body);
+		} else {
+			http_response_404(conn);
+		}
+		response_put(resp);
+		return;
+	}
+
+	/* the connections send the same body, by sendfile if it's in memfd */
+	http_response_200_header(conn, resp->len, resp->key.encoding, http_content_type_html);
+	if (httpd_outq_push_response(&client->outq, resp, conn_sendfile_direct(conn))) {
+		response_put(resp);
+		client->keepalive = 0;
+	}
+}
+
+/* queue a sample body allocated by malloc, cache it for the next requests */
+static void http_response_200_samp(connection *conn, char *body, size_t len, char *encoding)
+{
+	struct response *resp = NULL;
+
+	if (http_samp_key)
+		resp = response_add(http_samp_key, body, len);
+
+	if (resp)
+		http_response_200_cached(conn, resp);
+	else
+		__http_response_200(conn, body, len, encoding, http_content_type_html, body);
+}
+
+static void http_show_samp_done(struct output *op, connection *conn)
+{
+	if (op->encoding == http_content_type_none) {
+		/* keep the output buffer for the next request, the response owns a copy */
+		char *buf = malloc(op->ob.offset);
+		if (!buf) {
+			http_response_404(conn);
+			return;
+		}
+
+		memcpy(buf, op->ob.buf, op->ob.offset);
+		http_response_200_samp(conn, buf, op->ob.offset, op->encoding);
+		return;
+	}
+
+	/*
+	 * compress data for encoding deflate. The bound of compression is as large
+	 * as the input, keep the buffer for the next request and copy the output.
+	 */
+	static __thread char *compbuf;
+	static __thread unsigned long compbuf_size;
+	unsigned long complen = compressBound(op->ob.offset);
+	char *body;
+
+	if (complen > compbuf_size) {
+		free(compbuf);
+		compbuf = malloc(complen);
+		compbuf_size = compbuf ? complen : 0;
+	}
+
+	if (!compbuf || compress((Bytef *)compbuf, &complen, (Bytef *)op->ob.buf, op->ob.offset) != Z_OK) {
+		http_response_404(conn);
+		return;
+	}
+
+	body = malloc(complen);
+	if (!body) {
+		http_response_404(conn);
+		return;
+	}
+
+	memcpy(body, compbuf, complen);
+	http_response_200_samp(conn, body, complen, http_content_type_deflate);
+}
+
+/* render the sample of @timestamp, or the nearest one by @dir, or send the cached body of it */
+static int http_showsamp_record(struct output *op, long timestamp, int dir, char *lables, connection *conn)
+{
+	struct response_key key = { .encoding = op->encoding, .hidecmdline = hidecmdline };
+	struct response *resp;
+	struct cache_t *cache;
+	int ret;
+
+	cache = rawlog_find_record(timestamp, dir, &key.off);
+	if (!cache)
+		return -EIO;
+
+	/* the same record, labels and encoding render the same body */
+	if (response_config.max_size && !jsonlabels(lables, &key.labels)) {
+		key.name = cache->name;
+		resp = response_get(&key);
+		if (resp) {
+			http_response_200_cached(conn, resp);
+			return 0;
+		}
+
+		http_samp_key = &key;
+	}
+
+	ret = rawlog_output_record(cache, key.off, lables, op, conn);
+	http_samp_key = NULL;
+
+	return ret;
+}
+
+static void http_showsamp(struct output *op, struct http_request *req, connection *conn)
+{
+	long timestamp = 0;
+	char lables[1024];
+	char encoding[16];
+	char direction[16];
+	int dir = 0;
+
+	if (http_request_arg_long(req, "timestamp", &timestamp) < 0) {
+		char *err = "missing timestamp\r\n";
+		http_response_200(conn, err, strlen(err), http_content_type_none, http_content_type_html);
+		return;
+	}
+
+	if (http_request_arg_str(req, "lables", lables, sizeof(lables)) < 0) {
+		char *err = "missing lables\r\n";
+		http_response_200(conn, err, strlen(err), http_content_type_none, http_content_type_html);
+		return;
+	}
+
+	op->encoding = http_content_type_deflate;
+	if (http_request_arg_str(req, "encoding", encoding, sizeof(encoding)) == 0) {
+		if (!strcmp(encoding, "none")) {
+			op->encoding = http_content_type_none;
+		} else if (!strcmp(encoding, "deflate")) {
+			op->encoding = http_content_type_deflate;
+		} else {
+			char *err = "encoding supports none/deflate only\r\n";
+			http_response_200(conn, err, strlen(err), http_content_type_none, http_content_type_html);
+			return;
+		}
+	}
+
+	if (http_request_arg_str(req, "direction", direction, sizeof(direction)) == 0) {
+		if (!strcmp(direction, "before")) {
+			dir = CACHE_BEFORE;
+		} else if (!strcmp(direction, "after")) {
+			dir = CACHE_AFTER;
+		} else {
+			char *err = "direction supports before/after only\r\n";
+			http_response_200(conn, err, strlen(err), http_content_type_none, http_content_type_html);
+			return;
+		}
+	}
+
+	if (http_showsamp_record(op, timestamp, dir, lables, conn) < 0) {
+		char *err = "missing sample\r\n";
+		http_response_200(conn, err, strlen(err), http_content_type_none, http_content_type_html);
+		return;
+	}
+}
+
+/* Import a binary file */
+#define IMPORT_BIN(sect, file, sym) asm (	\
+	".section " #sect "\n"			\
+	".global " #sym "\n"			\
+	".global " #sym "_end\n"		\
+	#sym ":\n"				\
+	".incbin \"" file "\"\n"		\
+	#sym "_end:\n"				\
+	".section \".text\"\n")
+
+/*
+ * Web assets are listed by gen/assets.h, which is generated by gen-assets.sh.
+ * Each asset is built in with its gzip variant and ETag, and served with
+ * headers built once by http_assets_init().
+ */
+struct http_asset {
+	char *name;
+	char *data, *data_end;
+	char *gzip, *gzip_end;
+	char *etag;		/* hex only, quoted in headers */
+	char *headers[2][2];	/* 200 headers, index by [gzip][immutable] */
+	char *headers_304[2];	/* 304 headers, index by [immutable] */
+	struct route route;	/* served by its name */
+};
+
+#define ASSET(name, sym, etag)						\
+	IMPORT_BIN(".rodata", "gen/http/" name, sym);			\
+	IMPORT_BIN(".rodata", "gen/http/" name ".gz", sym##_gz);	\
+	extern char sym[], sym##_end[], sym##_gz[], sym##_gz_end[];
+#include "gen/assets.h"
+#undef ASSET
+
+#define ASSET(name, sym, etag) { name, sym, sym##_end, sym##_gz, sym##_gz_end, etag },
+static struct http_asset http_assets[] = {
+#include "gen/assets.h"
+};
+#undef ASSET
+
+#define NR_HTTP_ASSETS (sizeof(http_assets) / sizeof(http_assets[0]))
+
+static char *http_asset_content_type(char *name)
+{
+	char *ext = strrchr(name, '.');
+
+	if (!strcmp(ext, ".js"))
+		return "application/javascript; charset=utf-8";
+	else if (!strcmp(ext, ".css"))
+		return "text/css; charset=utf-8";
+	else if (!strcmp(ext, ".ico"))
+		return "image/x-icon";
+
+	return "text/html; charset=utf-8";
+}
+
+static void http_assets_init(void)
+{
+	for (int i = 0; i < NR_HTTP_ASSETS; i++) {
+		struct http_asset *asset = &http_assets[i];
+		char *content_type = http_asset_content_type(asset->name);
+
+		/* gzip doesn't help tiny assets, never offer it then */
+		if (asset->gzip_end - asset->gzip >= asset->data_end - asset->data)
+			asset->gzip = asset->gzip_end = NULL;
+
+		for (int immutable = 0; immutable < 2; immutable++) {
+			char *cache = immutable ? http_cache_immutable : http_cache_revalidate;
+
+			for (int gzip = 0; gzip < 2; gzip++) {
+				size_t len = gzip ? asset->gzip_end - asset->gzip : asset->data_end - asset->data;
+
+				if (asprintf(&asset->headers[gzip][immutable], http_asset_header,
+					     gzip ? http_content_encoding_gzip : "", content_type,
+					     len, asset->etag, cache) < 0)
+					goto error;
+			}
+
+			if (asprintf(&asset->headers_304[immutable], http_asset_header_304,
+				     asset->etag, cache) < 0)
+				goto error;
+		}
+	}
+
+	return;
+
+error:
+	printf("Failed to build headers of assets\n");
+	exit(1);
+}
+
+/* If-None-Match: "xxx", W/"yyy" or * */
+static int http_etag_match(const struct http_slice *value, char *etag)
+{
+	size_t len = strlen(etag);
+	const char *s = value->ptr, *end = value->ptr + value->len;
+
+	if ((value->len == 1) && (*s == '*'))
+		return 1;
+
+	for (; (s = memchr(s, '"', end - s)) && (s + len + 2 <= end); s++) {
+		if (!memcmp(s + 1, etag, len) && (s[len + 1] == '"'))
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Accept-Encoding: gzip, deflate, br;q=0.9 ... gzip;q=0 means not acceptable */
+static int http_accept_gzip(const struct http_slice *value)
+{
+	const char *s = value->ptr, *end = value->ptr + value->len;
+	const char *coding, *q;
+
+	for (; s < end; s = coding + 1) {
+		coding = memchr(s, ',', end - s);
+		if (!coding)
+			coding = end;
+
+		while ((s < coding) && (*s == ' '))
+			s++;
+
+		if ((coding - s < 4) || strncasecmp(s, "gzip", 4))
+			continue;
+
+		/* Ex, "gzip", "gzip;q=0.5" or "gzip ; q=0" */
+		for (s += 4; (s < coding) && (*s == ' '); s++)
+			;
+		if (s == coding)
+			return 1;
+
+		if (*s != ';')
+			continue;
+
+		q = memmem(s, coding - s, "q=", 2);
+		if (!q)
+			return 1;
+
+		/* q=0, q=0. or q=0.000 */
+		for (q += 2; (q < coding) && ((*q == '0') || (*q == '.')); q++)
+			;
+
+		return (q < coding) && (*q >= '1') && (*q <= '9');
+	}
+
+	return 0;
+}
+
+static void http_asset_response(connection *conn, struct http_request *req, struct http_asset *asset)
+{
+	const struct http_slice *value;
+	int immutable = 0, gzip = 0;
+
+	/* index.html refers assets by ?v=ETAG, a new version comes with a new URL */
+	value = http_request_arg(req, "v");
+	if (value && http_slice_equal(value, asset->etag))
+		immutable = 1;
+
+	value = http_request_header(req, "If-None-Match");
+	if (value && http_etag_match(value, asset->etag)) {
+		http_response_queue(conn, http_304, strlen(http_304), NULL);
+		http_response_queue(conn, http_server, strlen(http_server), NULL);
+		http_response_queue(conn, http_connection(conn), strlen(http_connection(conn)), NULL);
+		http_response_queue(conn, asset->headers_304[immutable], strlen(asset->headers_304[immutable]), NULL);
+		return;
+	}
+
+	value = http_request_header(req, "Accept-Encoding");
+	if (asset->gzip && value && http_accept_gzip(value))
+		gzip = 1;
+
+	http_response_queue(conn, http_200, strlen(http_200), NULL);
+	http_response_queue(conn, http_server, strlen(http_server), NULL);
+	http_response_queue(conn, http_connection(conn), strlen(http_connection(conn)), NULL);
+	http_response_queue(conn, asset->headers[gzip][immutable], strlen(asset->headers[gzip][immutable]), NULL);
+	if (gzip)
+		http_response_queue(conn, asset->gzip, asset->gzip_end - asset->gzip, NULL);
+	else
+		http_response_queue(conn, asset->data, asset->data_end - asset->data, NULL);
+}
+
+static struct route_table *http_route_table;
+
+static void http_route_asset(struct route *route, void *ctx, struct http_request *req, connection *conn)
+{
+	http_asset_response(conn, req, route->data);
+}
+
+/* serve the asset named by route::data */
+static void http_route_asset_alias(struct route *route, void *ctx, struct http_request *req, connection *conn)
+{
+	char *name = route->data;
+
+	route = route_lookup(http_route_table, ROUTE_GET, name, strlen(name));
+	if (!route) {
+		http_response_404(conn);
+		return;
+	}
+
+	route->handler(route, ctx, req, conn);
+}
+
+static void http_route_template(struct route *route, void *ctx, struct http_request *req, connection *conn)
+{
+	char template_type[256];
+	char name[URL_LEN];
+
+	if (http_request_arg_str(req, "type", template_type, sizeof(template_type)) < 0) {
+		http_response_404(conn);
+		return;
+	}
+
+	snprintf(name, sizeof(name), "template/html/%s.html", template_type);
+	route = route_lookup(http_route_table, ROUTE_GET, name, strlen(name));
+	if (!route || (route->handler != http_route_asset)) {
+		http_response_404(conn);
+		return;
+	}
+
+	http_asset_response(conn, req, route->data);
+}
+
+static void http_route_ping(struct route *route, void *ctx, struct http_request *req, connection *conn)
+{
+	char *pong = "pong\r\n";
+
+	http_response_200(conn, pong, strlen(pong), http_content_type_none, http_content_type_html);
+}
+
+static void http_route_stats(struct route *route, void *ctx, struct http_request *req, connection *conn)
+{
+	size_t size = 8192;
+	char *stats = malloc(size);
+	int len = 0;
+
+	if (stats) {
+		len = snprintf(stats, size, "{");
+		len += pool_stats(stats + len, size - len);
+		len += snprintf(stats + len, len < size ? size - len : 0, ", ");
+		if (len < size)
+			len += admission_stats(stats + len, size - len);
+		len += snprintf(stats + len, len < size ? size - len : 0, ", ");
+		if (len < size)
+			len += sample_stats(stats + len, size - len);
+		len += snprintf(stats + len, len < size ? size - len : 0, ", ");
+		if (len < size)
+			len += response_stats(stats + len, size - len);
+		len += snprintf(stats + len, len < size ? size - len : 0, "}\r\n");
+	}
+
+	if (!stats || (len >= size)) {
+		http_response_404(conn);
+		free(stats);
+		return;
+	}
+
+	__http_response_200(conn, stats, len, http_content_type_none, http_content_type_html, stats);
+}
+
+static void http_route_showsamp(struct route *route, void *ctx, struct http_request *req, connection *conn)
+{
+	struct httpd_worker *worker = ctx;
+
+	http_showsamp(&worker->op, req, conn);
+}
+
+/* endpoints, each asset is also served by its name, Ex, js/atop.js */
+static struct route http_routes[] = {
+	{ "", ROUTE_GET, http_route_asset_alias, "index.html" },
+	{ "ping", ROUTE_GET, http_route_ping, NULL },
+	{ "help", ROUTE_GET, http_route_asset_alias, "help.html" },
+	{ "showsamp", ROUTE_GET, http_route_showsamp, NULL },
+	{ "stats", ROUTE_GET, http_route_stats, NULL },
+	{ "template_header", ROUTE_GET, http_route_asset_alias, "template/html/header.html" },
+	{ "template", ROUTE_GET, http_route_template, NULL },
+};
+
+static void http_routes_init(void)
+{
+	http_route_table = route_table_create();
+	if (!http_route_table)
+		goto error;
+
+	if (route_register_all(http_route_table, http_routes, sizeof(http_routes) / sizeof(http_routes[0])))
+		goto error;
+
+	for (int i = 0; i < NR_HTTP_ASSETS; i++) {
+		struct http_asset *asset = &http_assets[i];
+
+		asset->route.path = asset->name;
+		asset->route.methods = ROUTE_GET;
+		asset->route.handler = http_route_asset;
+		asset->route.data = asset;
+		if (route_register(http_route_table, &asset->route))
+			goto error;
+	}
+
+	return;
+
+error:
+	printf("Failed to build route table\n");
+	exit(1);
+}
+
+/*
+ * Decoding a sample costs much more than the others. The latest one is polled
+ * by dashboards, decoding all the labels is for bulk export.
+ */
+static int http_showsamp_lane(struct http_request *req)
+{
+	const struct http_slice *lables = http_request_arg(req, "lables");
+	long timestamp;
+
+	if (lables && memmem(lables->ptr, lables->len, "ALL", 3))
+		return ADMISSION_LANE_BULK;
+
+	if (!http_request_arg_long(req, "timestamp", &timestamp) && (timestamp >= rawlog_recent_time()))
+		return ADMISSION_LANE_LATEST;
+
+	return ADMISSION_LANE_HISTORY;
+}
+
+static void http_process_request(struct httpd_worker *worker, struct http_request *req, connection *conn)
+{
+	struct httpd_client *client = conn->private_data;
+	struct route *route = route_lookup(http_route_table, ROUTE_GET, req->path.ptr, req->path.len);
+	int lane = ADMISSION_LANE_STATIC;
 	int ret;
-	ret = setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &onoff, sizeof(onoff));
+
+	if (!route) {
+		http_response_404(conn);
+		return;
+	}
+
+	if (route->handler == http_route_showsamp)
+		lane = http_showsamp_lane(req);
+
+	ret = admission_enter(lane, client->client_key);
 	if (ret) {
+		log_debug("reject conn %d in lane %d: %d\n", conn->fd, lane, ret);
+		http_response_retry(conn, ret == -EBUSY ? http_503 : http_429);
+		return;
+	}
+
+	route->handler(route, worker, req, conn);
+	admission_exit(lane);
+}
+
+static time_t httpd_now_ms()
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+static struct httpd_client *httpd_client_create(struct httpd_worker *worker, connection *conn)
+{
+	struct httpd_client *client;
+	struct epoll_event event;
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	int onoff = 1;
+
+	if (!conn->is_local && setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &onoff, sizeof(onoff))) {
 		printf("failed to set socket to TCP_NODELAY\n");
-		return ret;
+		return NULL;
 	}
 
-	ret = fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) & ~O_NONBLOCK);
-	if (ret) {
-		printf("failed to set conn to blocking\n");
-		return ret;
+	client = pool_alloc(&httpd_client_pool);
+	if (!client)
+		return NULL;
+
+	client->conn = conn;
+	client->worker = worker;
+	client->keepalive = 1;
+	if (!getpeername(conn->fd, (struct sockaddr *)&addr, &addrlen))
+		client->client_key = admission_client_key((struct sockaddr *)&addr, addrlen);
+	if (conn->type->handshake) {
+		client->state = CLIENT_STATE_HANDSHAKE;
+		client->expire = httpd_now_ms() + HANDSHAKE_TIMEOUT * 1000;
+	} else {
+		client->state = CLIENT_STATE_IDLE;
+		client->expire = httpd_now_ms() + REQUEST_TIMEOUT * 1000;
+	}
+	conn->private_data = client;
+
+	event.events = EPOLLIN;
+	event.data.ptr = conn;
+	if (conn_polled(conn) && epoll_ctl(worker->epollfd, EPOLL_CTL_ADD, conn->fd, &event)) {
+		printf("Add conn into epoll failed: %m\n");
+		conn->private_data = NULL;
+		pool_free(&httpd_client_pool, client);
+		return NULL;
+	}
+
+	client->next = worker->clients;
+	if (worker->clients)
+		worker->clients->prev = client;
+	worker->clients = client;
+
+	return client;
+}
+
+static void httpd_client_close(struct httpd_client *client)
+{
+	struct httpd_worker *worker = client->worker;
+	connection *conn = client->conn;
+
+	if (conn_polled(conn))
+		epoll_ctl(worker->epollfd, EPOLL_CTL_DEL, conn->fd, NULL);
+	conn_close(conn);
+	conn_free(conn);
+	client->conn = NULL;
+	client->state = CLIENT_STATE_CLOSED;
+	httpd_outq_free(&client->outq);
+	if (client->h2) {
+		http2_session_destroy(client->h2);
+		client->h2 = NULL;
+	}
+
+	if (client->prev)
+		client->prev->next = client->next;
+	else
+		worker->clients = client->next;
+	if (client->next)
+		client->next->prev = client->prev;
+
+	/* the ready list frees it later */
+	if (client->is_ready)
+		return;
+
+	pool_free(&httpd_client_pool, client);
+}
+
+static void httpd_client_ready(struct httpd_client *client)
+{
+	struct httpd_worker *worker = client->worker;
+
+	if (client->is_ready)
+		return;
+
+	client->is_ready = 1;
+	client->ready_next = NULL;
+	if (worker->ready_tail)
+		worker->ready_tail->ready_next = client;
+	else
+		worker->ready = client;
+	worker->ready_tail = client;
+}
+
+static struct httpd_client *httpd_client_ready_pop(struct httpd_worker *worker)
+{
+	struct httpd_client *client = worker->ready;
+
+	if (!client)
+		return NULL;
+
+	worker->ready = client->ready_next;
+	if (!worker->ready)
+		worker->ready_tail = NULL;
+	client->is_ready = 0;
+
+	return client;
+}
+
+/* close the connections which make no progress in time */
+static void httpd_client_expire(struct httpd_worker *worker)
+{
+	struct httpd_client *client, *next;
+	time_t now = httpd_now_ms();
+
+	for (client = worker->clients; client; client = next) {
+		next = client->next;
+		if (now >= client->expire) {
+			log_debug("close conn %d in state %d after %d requests\n", client->conn->fd, client->state, client->nr_requests);
+			httpd_client_close(client);
+		}
+	}
+}
+
+/* parse the value of "Connection" header, keep the current one by default */
+static int httpd_request_keepalive(struct http_request *req, int keepalive)
+{
+	const struct http_slice *value = http_request_header(req, "Connection");
+
+	if (!value)
+		return keepalive;
+
+	if (http_slice_caseequal(value, "close"))
+		return 0;
+
+	if (http_slice_caseequal(value, "keep-alive"))
+		return 1;
+
+	return keepalive;
+}
+
+static int httpd_client_upgrade(struct httpd_client *client);
+
+/*
+ * Handle the request at the head of inbuf. Return the length of it, or -1 if
+ * the request is not supported. The caller makes sure that it's parsed.
+ */
+static int httpd_handle_request(struct httpd_worker *worker, struct httpd_client *client)
+{
+	struct http_request *req = &client->request;
+
+	/* support GET request only */
+	if (!http_slice_equal(&req->method, "GET"))
+		return -1;
+
+	if (!httpd_client_upgrade(client))
+		return req->len;
+
+	/* HTTP 1.0 closes connection by default */
+	client->keepalive = httpd_request_keepalive(req, req->minor == 1);
+	client->nr_requests++;
+	if (!config.keepalive_timeout || (client->nr_requests >= config.keepalive_requests)
+	    || __atomic_load_n(&httpd_draining, __ATOMIC_RELAXED))
+		client->keepalive = 0;
+
+	client->state = CLIENT_STATE_WRITING;
+	http_process_request(worker, req, client->conn);
+
+	return req->len;
+}
+
+static int httpd_client_poll(struct httpd_client *client, int pollout)
+{
+	struct epoll_event event;
+
+	if ((client->pollout == pollout) || !conn_polled(client->conn))
+		return 0;
+
+	event.events = EPOLLIN | (pollout ? EPOLLOUT : 0);
+	event.data.ptr = client->conn;
+	if (epoll_ctl(client->worker->epollfd, EPOLL_CTL_MOD, client->conn->fd, &event)) {
+		printf("Modify conn in epoll failed: %m\n");
+		return -errno;
+	}
+
+	client->pollout = pollout;
+	return 0;
+}
+
+/* send queued responses as many as possible, wait for EPOLLOUT for the rest */
+static int httpd_client_flush(struct httpd_client *client)
+{
+	struct httpd_outq *outq = &client->outq;
+	struct iovec iovs[OUTQ_MAX_IOVS];
+	int iovcnt, ret, i;
+
+	while (outq->bytes) {
+		struct httpd_chunk *chunk = &outq->chunks[outq->head];
+
+		if (chunk->fd >= 0) {
+			ret = conn_sendfile(client->conn, chunk->fd, chunk->off, chunk->iov.iov_len);
+		} else {
+			/* gather memory chunks until the next file chunk */
+			iovcnt = 0;
+			for (i = outq->head; (i < outq->nr_chunks) && (iovcnt < OUTQ_MAX_IOVS); i++) {
+				if (outq->chunks[i].fd >= 0)
+					break;
+
+				iovs[iovcnt++] = outq->chunks[i].iov;
+			}
+
+			/* nothing follows the last response of a connection */
+			if (!client->keepalive && !client->h2 && (i == outq->nr_chunks))
+				ret = conn_writev_close(client->conn, iovs, iovcnt);
+			else
+				ret = conn_writev(client->conn, iovs, iovcnt);
+		}
+		if ((ret == -EAGAIN) || (ret == 0))
+			break;
+
+		if (ret < 0)
+			return ret;
+
+		httpd_outq_pop(outq, ret);
+		client->expire = httpd_now_ms() + REQUEST_TIMEOUT * 1000;
 	}
 
-	struct timeval tv = {.tv_sec = 5, .tv_usec = 0};
-	ret = setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
-	if (ret) {
-		printf("failed to set socket to SNDTIMEO\n");
-		return ret;
+	if (!outq->bytes)
+		httpd_outq_pop(outq, 0);
+
+	return httpd_client_poll(client, !!outq->bytes);
+}
+
+static int httpd_h2_send(void *ctx, void *buf, size_t len, void *free_ptr)
+{
+	struct httpd_client *client = ctx;
+
+	if (httpd_outq_push(&client->outq, buf, len, free_ptr)) {
+		free(free_ptr);
+		return -ENOMEM;
 	}
 
 	return 0;
 }
 
-static void http_response_200(connection *conn, char *buf, size_t len, char *encoding, char* content_type)
+static int httpd_h2_writable(void *ctx)
 {
-	struct iovec iovs[3], *iov;
-	int ret;
-	char content[128] = {0};
-	int content_length = 0;
+	struct httpd_client *client = ctx;
 
-	ret = http_prepare_response(conn);
-	if (ret) {
-		goto closeconn;
-	}
+	return client->outq.bytes < OUTQ_HIGH_WATER;
+}
 
-	/* 1, http code */
-	iov = &iovs[0];
-	iov->iov_base = http_200;
-	iov->iov_len = strlen(http_200);
+/*
+ * Handle a request of an HTTP/2 stream by the same routes. The response is
+ * queued aside, then its header is translated and the body is taken over.
+ */
+static int httpd_h2_request(void *ctx, int32_t stream_id, struct http_request *req)
+{
+	struct httpd_client *client = ctx;
+	struct httpd_outq response = { 0 };
+	char head[INBUF_SIZE];
+	size_t head_len = 0, body_len = 0;
+	char *body = NULL;
+	void *free_ptr = NULL;
+	int i, ret = -1;
+
+	if (!http_slice_equal(&req->method, "GET"))
+		return -1;
 
-	/* 2, http generic content */
-	iov = &iovs[1];
+	client->nr_requests++;
+	client->stream = &response;
+	http_process_request(client->worker, req, client->conn);
+	client->stream = NULL;
 
-	content_length = sprintf(content, http_generic, encoding, content_type, len);
-	iov->iov_base = content;
-	iov->iov_len = content_length;
+	/* the header ends by an empty line */
+	for (i = 0; i < response.nr_chunks; i++) {
+		struct iovec *iov = &response.chunks[i].iov;
 
-	/* 3, sample data record */
-	iov = &iovs[2];
-	iov->iov_base = buf;
-	iov->iov_len = len;
+		if (head_len + iov->iov_len > sizeof(head))
+			goto out;
 
-	conn_writev(conn, iovs, sizeof(iovs) / sizeof(iovs[0]));
+		memcpy(head + head_len, iov->iov_base, iov->iov_len);
+		head_len += iov->iov_len;
+		if ((head_len >= 4) && !memcmp(head + head_len - 4, "\r\n\r\n", 4)) {
+			i++;
+			break;
+		}
+	}
 
-closeconn:
-	conn_close(conn);
+	if (i == response.nr_chunks - 1) {
+		/* the body is a single chunk usually */
+		body = response.chunks[i].iov.iov_base;
+		body_len = response.chunks[i].iov.iov_len;
+		free_ptr = response.chunks[i].free_ptr;
+		response.chunks[i].free_ptr = NULL;
+	} else if (i < response.nr_chunks) {
+		for (int j = i; j < response.nr_chunks; j++)
+			body_len += response.chunks[j].iov.iov_len;
+
+		body = free_ptr = malloc(body_len);
+		if (!body)
+			goto out;
+
+		body_len = 0;
+		for (; i < response.nr_chunks; i++) {
+			memcpy(body + body_len, response.chunks[i].iov.iov_base, response.chunks[i].iov.iov_len);
+			body_len += response.chunks[i].iov.iov_len;
+		}
+	}
+
+	ret = http2_submit_response(client->h2, stream_id, head, head_len, body, body_len, free_ptr);
+
+out:
+	httpd_outq_free(&response);
+	return ret;
 }
 
-static void http_show_samp_done(struct output *op, connection *conn)
+static const struct http2_ops httpd_h2_ops = {
+	.send = httpd_h2_send,
+	.writable = httpd_h2_writable,
+	.request = httpd_h2_request,
+};
+
+/* feed the received bytes to the session, then send as many frames as possible */
+static int httpd_client_h2_update(struct httpd_client *client)
 {
-	if (op->encoding == http_content_type_none) {
-		http_response_200(conn, op->ob.buf, op->ob.offset, op->encoding, http_content_type_html);
-		return;
-	}
+	size_t queued;
 
-	/* compress data for encoding deflate */
-	char *compbuf = malloc(op->ob.offset);
-	unsigned long complen = op->ob.offset;
+	if (client->inbytes) {
+		if (http2_session_recv(client->h2, client->inbuf, client->inbytes) < 0)
+			return -1;
 
-	if (compress((Bytef *)compbuf, &complen, (Bytef *)op->ob.buf, op->ob.offset) != Z_OK){
-		http_prepare_response(conn);
-		conn_write(conn, http_404, strlen(http_404));
+		client->inbytes = 0;
 	}
 
-	http_response_200(conn, compbuf, complen, http_content_type_deflate, http_content_type_html);
-	free(compbuf);
-}
+	/* stop if nothing is queued, or the socket is full */
+	do {
+		if (http2_session_send(client->h2) < 0)
+			return -1;
 
-static int http_arg_long(char *req, char *needle, long *l)
-{
-	char *s = strstr(req, needle);
-	if (!s)
-		return -1;
+		queued = client->outq.bytes;
+		if (httpd_client_flush(client) < 0)
+			return -1;
+	} while (queued && !client->outq.bytes);
 
-	s += strlen(needle);
-	if (*s != '=')
-		return -1;
+	if (!client->outq.bytes) {
+		if (!http2_session_alive(client->h2))
+			return -1;
 
-	*l = atol(++s);
+		client->expire = httpd_now_ms() + config.keepalive_timeout * 1000;
+	}
 
 	return 0;
 }
 
-static int http_arg_str(char *req, char *needle, char *p, int len)
+static int httpd_client_h2_start(struct httpd_client *client)
 {
-        char *s = strstr(req, needle);
-        if (!s)
-                return -1;
+	client->h2 = http2_session_create(&httpd_h2_ops, client);
+	if (!client->h2)
+		return -1;
 
-        s += strlen(needle);
-        if (*s++ != '=')
-                return -1;
+	client->state = CLIENT_STATE_HTTP2;
+	return httpd_client_h2_update(client);
+}
+
+/*
+ * Switch to HTTP/2 by "Upgrade: h2c" on cleartext, the request becomes the
+ * stream 1. Return -1 to keep serving HTTP/1.1.
+ */
+static int httpd_client_upgrade(struct httpd_client *client)
+{
+	struct http_request *req = &client->request;
+	const struct http_slice *upgrade = http_request_header(req, "Upgrade");
+	const struct http_slice *settings = http_request_header(req, "HTTP2-Settings");
 
-        char *e = strchr(s, '&');
-        if (!e)
-                e = s + strlen(s);
+	if (!upgrade || !settings || !http_slice_caseequal(upgrade, "h2c") ||
+	    !strcmp(client->conn->type->get_type(client->conn), CONN_TYPE_TLS))
+		return -1;
 
-	if (e - s > len)
+	client->h2 = http2_session_create(&httpd_h2_ops, client);
+	if (!client->h2)
 		return -1;
 
-        memcpy(p, s, e - s);
-        p[e - s] = '\0';
-	while ((p = strstr(p, "%2C")) != NULL)
-	{
-		*(p++) = ',';
-		memmove(p, p + 2, strlen(p));
+	if (http2_session_upgrade(client->h2, settings)) {
+		http2_session_destroy(client->h2);
+		client->h2 = NULL;
+		return -1;
 	}
 
-        return 0;
+	/* frames of the session follow it */
+	http_response_queue(client->conn, http_101, strlen(http_101), NULL);
+	client->state = CLIENT_STATE_HTTP2;
+	httpd_h2_request(client, 1, req);
+
+	return 0;
 }
 
-static void http_showsamp(char *req, connection *conn)
+/*
+ * Move the client to the next state by the queued responses and the bytes in
+ * inbuf. Return -1 if the connection should be closed.
+ */
+static int httpd_client_update(struct httpd_client *client)
 {
-	time_t timestamp = 0;
-	char lables[1024];
-	char encoding[16];
+	time_t now = httpd_now_ms();
+	int ret;
 
-	if (http_arg_long(req, "timestamp", &timestamp) < 0) {
-		char *err = "missing timestamp\r\n";
-		http_response_200(conn, err, strlen(err), http_content_type_none, http_content_type_html);
-		return;
-	}
+	if (client->h2)
+		return httpd_client_h2_update(client);
 
-	if (http_arg_str(req, "lables", lables, sizeof(lables)) < 0) {
-		char *err = "missing lables\r\n";
-		http_response_200(conn, err, strlen(err), http_content_type_none, http_content_type_html);
-		return;
+	if (client->outq.bytes) {
+		/* wait for the peer to take the responses before serving more */
+		if (!client->keepalive || (client->outq.bytes >= OUTQ_HIGH_WATER)) {
+			client->state = CLIENT_STATE_WRITING;
+			return 0;
+		}
+	} else if (!client->keepalive) {
+		return -1;
 	}
 
-	defop.encoding = http_content_type_deflate;
-	if (http_arg_str(req, "encoding", encoding, sizeof(encoding)) == 0) {
-		if (!strcmp(encoding, "none")) {
-			defop.encoding = http_content_type_none;
-		} else if (!strcmp(encoding, "deflate")) {
-			defop.encoding = http_content_type_deflate;
+	if (!client->inbytes) {
+		if (client->outq.bytes) {
+			client->state = CLIENT_STATE_WRITING;
 		} else {
-			char *err = "encoding supports none/deflate only\r\n";
-			http_response_200(conn, err, strlen(err), http_content_type_none, http_content_type_html);
-			return;
+			client->state = CLIENT_STATE_IDLE;
+			client->expire = now + config.keepalive_timeout * 1000;
 		}
+		return 0;
 	}
 
-	if (rawlog_get_record(timestamp, lables, conn) < 0) {
-		char *err = "missing sample\r\n";
-		http_response_200(conn, err, strlen(err), http_content_type_none, http_content_type_html);
-		return;
+	/* HTTP/2 with prior knowledge starts by the preface */
+	if (!client->nr_requests) {
+		ret = http2_preface_match(client->inbuf, client->inbytes);
+		if (ret > 0)
+			return httpd_client_h2_start(client);
+
+		if (ret == 0)
+			goto incomplete;
 	}
-}
 
-/* Import a binary file */
-#define IMPORT_BIN(sect, file, sym) asm (	\
-	".section " #sect "\n"			\
-	".global " #sym "\n"			\
-	".global " #sym "_end\n"		\
-	#sym ":\n"				\
-	".incbin \"" file "\"\n"		\
-	#sym "_end:\n"				\
-	".section \".text\"\n")
+	/* resume parsing from the last read */
+	ret = http_parse_request(&client->request, client->inbuf, client->inbytes);
+	if (ret < 0)
+		return -1;
 
-/* Build help.html into atop binary */
-IMPORT_BIN(".rodata", "http/help.html", help);
-extern char help[], help_end[];
+	if (ret > 0) {
+		client->state = CLIENT_STATE_PROCESSING;
+		httpd_client_ready(client);
+		return 0;
+	}
 
-static void http_help(connection *conn)
-{
-	http_response_200(conn, help, help_end - help, http_content_type_none, http_content_type_html);
-}
+incomplete:
+	/* the request doesn't fit in inbuf */
+	if (client->inbytes == INBUF_SIZE)
+		return -1;
 
-/* Build favicon.ico into atop binary */
-IMPORT_BIN(".rodata", "http/favicon.ico", favicon);
-extern char favicon[], favicon_end[];
+	/* the whole request should arrive in time, don't renew the deadline */
+	if (client->state != CLIENT_STATE_READING) {
+		client->state = CLIENT_STATE_READING;
+		client->expire = now + REQUEST_TIMEOUT * 1000;
+	}
 
-static void http_favicon(connection *conn)
-{
-	http_response_200(conn, favicon, favicon_end - favicon, http_content_type_none, http_content_type_html);
+	return 0;
 }
 
-/* Build index.html into atop binary */
-IMPORT_BIN(".rodata", "http/index.html", http_index_html);
-extern char http_index_html[], http_index_html_end[];
-
-static void http_index(connection *conn)
+/* serve one request only, the pipelined ones wait for the next round */
+static void httpd_client_process(struct httpd_worker *worker, struct httpd_client *client)
 {
-	http_response_200(conn, http_index_html, http_index_html_end - http_index_html, http_content_type_none, http_content_type_html);
-}
+	int ret;
 
-/* Build atop.js into atop binary */
-IMPORT_BIN(".rodata", "http/js/atop.js", atop_js);
-extern char atop_js[], atop_js_end[];
+	ret = httpd_handle_request(worker, client);
+	if (ret < 0)
+		goto close_conn;
 
-static void http_get_atop_js(connection *conn)
-{
-	http_response_200(conn, atop_js, atop_js_end - atop_js, http_content_type_none, http_content_type_javascript);
-}
+	client->inbytes -= ret;
+	memmove(client->inbuf, client->inbuf + ret, client->inbytes + 1);
+	http_request_reset(&client->request);
 
-/* Build atop_parse.js into atop binary */
-IMPORT_BIN(".rodata", "http/js/atop_parse.js", atop_parse_js);
-extern char atop_parse_js[], atop_parse_js_end[];
+	if (httpd_client_flush(client) < 0)
+		goto close_conn;
 
-static void http_get_atop_parse_js(connection *conn)
-{
-	http_response_200(conn, atop_parse_js, atop_parse_js_end - atop_parse_js, http_content_type_none, http_content_type_javascript);
-}
+	if (httpd_client_update(client) < 0)
+		goto close_conn;
 
-/* Build atop_compare_fc.js into atop binary */
-IMPORT_BIN(".rodata", "http/js/atop_compare_fc.js", atop_compare_fc_js);
-extern char atop_compare_fc_js[], atop_compare_fc_js_end[];
+	return;
 
-static void http_get_atop_compare_fc_js(connection *conn)
-{
-	http_response_200(conn, atop_compare_fc_js, atop_compare_fc_js_end - atop_compare_fc_js, http_content_type_none, http_content_type_javascript);
+close_conn:
+	httpd_client_close(client);
 }
 
-/* Build atop.css into atop binary */
-IMPORT_BIN(".rodata", "http/css/atop.css", http_css);
-extern char http_css[], http_css_end[];
-
-static void http_get_css(connection *conn)
+/* return -1 if the client is closed */
+static int httpd_client_writable(struct httpd_worker *worker, struct httpd_client *client)
 {
-	http_response_200(conn, http_css, http_css_end - http_css, http_content_type_none, http_content_type_css);
-}
+	if ((httpd_client_flush(client) < 0) || (httpd_client_update(client) < 0)) {
+		httpd_client_close(client);
+		return -1;
+	}
 
-/* Build template.html into atop binary */
-IMPORT_BIN(".rodata", "http/template/html/header.html", header_html_template);
-extern char header_html_template[], header_html_template_end[];
+	return 0;
+}
 
-IMPORT_BIN(".rodata", "http/template/html/generic.html", generic_html_template);
-extern char generic_html_template[], generic_html_template_end[];
+static void httpd_client_readable(struct httpd_worker *worker, struct httpd_client *client)
+{
+	int ret;
 
-IMPORT_BIN(".rodata", "http/template/html/memory.html", memory_html_template);
-extern char memory_html_template[], memory_html_template_end[];
+	/* buf is full, the queued request will free some */
+	if (client->inbytes == INBUF_SIZE)
+		return;
 
-IMPORT_BIN(".rodata", "http/template/html/disk.html", disk_html_template);
-extern char disk_html_template[], disk_html_template_end[];
+	ret = conn_read(client->conn, client->inbuf + client->inbytes, INBUF_SIZE - client->inbytes);
+	if (ret == -EAGAIN)
+		return;
 
-IMPORT_BIN(".rodata", "http/template/html/command_line.html", command_line_html_template);
-extern char command_line_html_template[], command_line_html_template_end[];
+	if (ret <= 0)
+		goto close_conn;
 
-static void http_get_template_header(connection *conn)
-{
-	http_response_200(conn, header_html_template, header_html_template_end - header_html_template, http_content_type_none, http_content_type_html);
-}
+	client->inbytes += ret;
+	client->inbuf[client->inbytes] = '\0';
 
-static void http_get_template(char *req, connection *conn)
-{
-	char template_type[256];
-	if (http_arg_str(req, "type", template_type, sizeof(template_type)) < 0)
+	if (client->state == CLIENT_STATE_PROCESSING)
 		return;
 
-	if (!strcmp(template_type, "generic")) {
-		http_response_200(conn, generic_html_template, generic_html_template_end - generic_html_template, http_content_type_none, http_content_type_html);
-	} else if (!strcmp(template_type, "memory")) {
-		http_response_200(conn, memory_html_template, memory_html_template_end - memory_html_template, http_content_type_none, http_content_type_html);
-	} else if (!strcmp(template_type, "disk")) {
-		http_response_200(conn, disk_html_template, disk_html_template_end - disk_html_template, http_content_type_none, http_content_type_html);
-	} else if (!strcmp(template_type, "command_line")) {
-		http_response_200(conn, command_line_html_template, command_line_html_template_end - command_line_html_template, http_content_type_none, http_content_type_html);
-	} else {
-		http_prepare_response(conn);
-		conn_write(conn, http_404, strlen(http_404));
-	}
-}
+	if (httpd_client_update(client) < 0)
+		goto close_conn;
 
-static void http_ping(connection *conn)
-{
-	char *pong = "pong\r\n";
+	/* buf is full, but we can not search the end of HTTP header */
+	if ((client->state == CLIENT_STATE_READING) && (client->inbytes == INBUF_SIZE))
+		goto close_conn;
 
-	http_response_200(conn, pong, strlen(pong), http_content_type_none, http_content_type_html);
+	return;
+
+close_conn:
+	httpd_client_close(client);
 }
 
-static void http_process_request(char *req, connection *conn)
+/* continue the handshake, a stalled one doesn't block the others */
+static void httpd_client_handshake(struct httpd_worker *worker, struct httpd_client *client)
 {
-	char location[URL_LEN] = {0};
-	char *c;
+	int ret = conn_handshake(client->conn);
+	const char *protocol;
 
-	if (strlen(req) > URL_LEN) {
-		http_prepare_response(conn);
-		conn_write(conn, http_404, strlen(http_404));
-		return;
-	}
+	if (ret < 0)
+		goto close_conn;
 
-	c = strchr(req, '?');
-	if (c)
-		memcpy(location, req, c - req);
-	else
-		memcpy(location, req, strlen(req));
+	if (ret) {
+		if (httpd_client_poll(client, ret == CONN_HANDSHAKE_WANT_WRITE) < 0)
+			goto close_conn;
 
-	if (strlen(location) == 0) {
-		http_index(conn);
 		return;
 	}
 
-	if (!strcmp(location, "ping"))
-		http_ping(conn);
-	else if (!strcmp(location, "help"))
-		http_help(conn);
-	else if (!strcmp(location, "favicon.ico"))
-		http_favicon(conn);
-	else if (!strcmp(location, "showsamp"))
-		http_showsamp(req, conn);
-	else if (!strcmp(location, "index.html"))
-		http_index(conn);
-	else if (!strcmp(location, "js/atop.js"))
-		http_get_atop_js(conn);
-	else if (!strcmp(location, "js/atop_parse.js"))
-		http_get_atop_parse_js(conn);
-	else if (!strcmp(location, "js/atop_compare_fc.js"))
-		http_get_atop_compare_fc_js(conn);
-	else if (!strcmp(location, "css/atop.css"))
-		http_get_css(conn);
-	else if (!strcmp(location, "template_header"))
-		http_get_template_header(conn);
-	else if (!strcmp(location, "template"))
-		http_get_template(req, conn);
-	else {
-		http_prepare_response(conn);
-		conn_write(conn, http_404, strlen(http_404));
-	}
+	client->state = CLIENT_STATE_IDLE;
+	client->expire = httpd_now_ms() + REQUEST_TIMEOUT * 1000;
+	if (httpd_client_poll(client, 0) < 0)
+		goto close_conn;
+
+	protocol = conn_get_protocol(client->conn);
+	if (protocol && !strcmp(protocol, HTTP2_ALPN) && (httpd_client_h2_start(client) < 0))
+		goto close_conn;
+
+	/* the request may arrive with the handshake, and be buffered already */
+	httpd_client_readable(worker, client);
+	return;
+
+close_conn:
+	httpd_client_close(client);
 }
 
-static time_t httpd_now_ms()
+/* serve one request of each ready client, new ready ones wait for next round */
+static void httpd_client_run_ready(struct httpd_worker *worker)
 {
-	struct timeval now;
+	struct httpd_client *client, *tail = worker->ready_tail;
 
-	gettimeofday(&now, NULL);
+	while (tail && (client = httpd_client_ready_pop(worker))) {
+		int last = (client == tail);
 
-	return now.tv_sec * 1000 + now.tv_usec / 1000;
+		if (client->state == CLIENT_STATE_CLOSED)
+			pool_free(&httpd_client_pool, client);
+		else
+			httpd_client_process(worker, client);
+
+		if (last)
+			break;
+	}
 }
 
-static void httpd_handle_request(connection *conn) {
-	char inbuf[INBUF_SIZE] = {0};
-	int inbytes = 0;
-	char httpreq[URL_LEN] = {0};
-	time_t timeout = httpd_now_ms() + 100;
+/* drain the accept queue of @listener, a burst of connections arrives at once */
+static void httpd_accept(struct httpd_worker *worker, connection *listener)
+{
+	struct httpd_client *client;
+	connection *conn;
 	int ret;
-	char *httpver;
 
-	ret = fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
-	if (ret) {
-		printf("failed to set conn to non_blocking");
-		goto close_fd;
-	}
+	for (int i = 0; i < MAX_ACCEPTS; i++) {
+		conn = conn_create(listener->type, -1, NULL);
+		if (!conn)
+			return;
+
+		ret = conn_accept(listener, conn);
+		if (ret < 0) {
+			conn_close(conn);
+			conn_free(conn);
 
-	for ( ; ; ) {
-		time_t now = httpd_now_ms();
-		if (now >= timeout)
-			goto close_fd;
+			/* the peer has gone, or a failed TLS setup */
+			if ((ret == -ECONNABORTED) || (ret == -EINVAL))
+				continue;
 
-		struct pollfd pfd = {.fd = conn->fd, .events = POLLIN, .revents = 0};
-		ret = poll(&pfd, 1, timeout - now);
-		if (ret <= 0)
-		{
-			if (ret != 0) {
-				goto close_fd;
-			}
-			continue;
+			if (ret != -EAGAIN)
+				log_debug("accept failed: %s\n", strerror(-ret));
+			return;
 		}
 
-		ret = conn_read(conn, inbuf + inbytes, sizeof(inbuf) - inbytes);
-		if (ret < 0)
-		{
-			if (ret != -EAGAIN) {
-				goto close_fd;
-			}
+		client = httpd_client_create(worker, conn);
+		if (!client) {
+			conn_close(conn);
+			conn_free(conn);
 			continue;
 		}
 
-		inbytes += ret;
-		if ((inbytes >= 4) && strstr(inbuf, "\r\n\r\n"))
-			break;
+		/* ClientHello usually arrives with the connection */
+		if (client->state == CLIENT_STATE_HANDSHAKE)
+			httpd_client_handshake(worker, client);
+	}
+}
 
-		/* buf is full, but we can not search the end of HTTP header */
-		if (inbytes == sizeof(inbuf))
-			goto close_fd;
+static void httpd_event(struct httpd_worker *worker, connection *conn, uint32_t events)
+{
+	struct httpd_client *client = conn->private_data;
+
+	/* listeners have no private data */
+	if (!client) {
+		httpd_accept(worker, conn);
+		return;
 	}
 
-	/* support GET request only */
-	if (strncmp("GET ", inbuf, 4))
-		goto close_fd;
+	if (client->state == CLIENT_STATE_HANDSHAKE) {
+		httpd_client_handshake(worker, client);
+		return;
+	}
 
-	/* support HTTP 1.1 request only */
-	httpver = strstr(inbuf, "HTTP/1.1");
-	if (!httpver)
-		goto close_fd;
+	if ((events & EPOLLOUT) && httpd_client_writable(worker, client))
+		return;
 
-	/* Ex, GET /hello HTTP/1.1 */
-	if ((httpver - inbuf > URL_LEN + 6) || (httpver - inbuf < 6))
-		goto close_fd;
+	if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+		httpd_client_readable(worker, client);
+}
 
-	memcpy(httpreq, inbuf + 5, httpver - inbuf - 6);
-	http_process_request(httpreq, conn);
+/*
+ * Index rawlogs off the serving threads, requests use the index published by
+ * the last update. Records are indexed by inotify once they are written, and
+ * rescan periodically if inotify fails, Ex, the log path is not created yet.
+ */
+static void *httpd_rescan_routine(void *arg)
+{
+	char *log_path = arg;
 
-close_fd:
-	conn_close(conn);
-	return;
+	while (1) {
+		if (!access(log_path, R_OK))
+			rawlog_watch(log_path);
+
+		sleep(RESCAN_INTERVAL);
+		if (rawlog_parse_all(log_path))
+			printf("%s: rawlog parse failed\n", __func__);
+	}
+
+	return NULL;
 }
 
-static void httpd_update_cache(char *log_path)
+/*
+ * Stop accepting, the new process takes the listening sockets. Idle keep-alive
+ * clients are closed, others are closed once the response is sent, or after
+ * DRAIN_TIMEOUT. Return 1 if no client is left.
+ */
+static int httpd_worker_drain(struct httpd_worker *worker)
 {
-	static time_t update;
-	time_t now = time(NULL);
+	struct httpd_client *client, *next;
+	time_t now = httpd_now_ms();
 
-	if (now - update < 3)
-		return;
+	if (!worker->drain_expire) {
+		for (int i = 0; i < CONN_TYPE_MAX; i++) {
+			connection *listener = worker->listeners[i];
 
-	if (rawlog_parse_all(log_path)) {
-		printf("%s: rawlog parse failed\n", __func__);
+			if (!listener)
+				continue;
+
+			/* it's freed by the main thread which created it */
+			epoll_ctl(worker->epollfd, EPOLL_CTL_DEL, listener->fd, NULL);
+			conn_close(listener);
+		}
+
+		worker->drain_expire = now + DRAIN_TIMEOUT * 1000;
+	}
+
+	/* a new connection is served, its request is on the way */
+	for (client = worker->clients; client; client = next) {
+		int idle = client->nr_requests && !client->inbytes && !client->outq.bytes &&
+			   ((client->state == CLIENT_STATE_IDLE) || (client->state == CLIENT_STATE_HTTP2));
+
+		next = client->next;
+		if (idle || (now >= worker->drain_expire))
+			httpd_client_close(client);
 	}
 
-	update = now;
+	return !worker->clients;
 }
 
-static void *httpd_routine(connection **listeners, char *log_path)
+static void *httpd_routine(void *arg)
 {
+	struct httpd_worker *worker = arg;
+	connection **listeners = worker->listeners;
 	int epollfd;
 	int ret = 0;
 	int nr_listener = 0;
-	connection *listener;
-	struct epoll_event event;
+	connection *listener, *conn;
+	struct epoll_event event, events[MAX_EVENTS];
+	int pending;
 
 	epollfd = epoll_create1(0);
 	if (epollfd < 0) {
 		printf("Failed create epollfd\n");
 		exit(1);
 	}
+	worker->epollfd = epollfd;
 
 	for (int i = 0; i < CONN_TYPE_MAX; i++) {
 		listener = listeners[i];
@@ -554,14 +1698,15 @@ static void *httpd_routine(connection **listeners, char *log_path)
 		printf("Listen Nothing, Exit.\n");
 		exit(1);
 	}
+	pthread_barrier_wait(&httpd_listening);
 
-	printf("Ready to serve\n");
+	printf("Worker %d ready to serve\n", worker->id);
+	time_t expire = httpd_now_ms();
 	while (1) {
-		ret = epoll_wait(epollfd, &event, 1, 1000);
-		if (!ret) {
-			continue;
-		}
+		conntype_flush();
 
+		/* don't sleep if there are pipelined requests to serve */
+		ret = epoll_wait(epollfd, events, MAX_EVENTS, (worker->ready || conntype_has_pending()) ? 0 : 1000);
 		if (ret < 0) {
 			if (errno == EINTR) {
 				continue;
@@ -571,24 +1716,48 @@ static void *httpd_routine(connection **listeners, char *log_path)
 			}
 		}
 
-		listener = event.data.ptr;
-		connection *conn;
-		conn = conn_create(listener->type, -1, NULL);
-		ret = conn_accept(listener, conn);
-		if (ret < 0) {
-			conn_close(conn);
-			free(conn);
-			continue;
+		for (int i = 0; i < ret; i++)
+			httpd_event(worker, events[i].data.ptr, events[i].events);
+
+		/* the connections driven by completions, Ex, io_uring */
+		while ((conn = conntype_pending(&pending)))
+			httpd_event(worker, conn, pending);
+
+		if (worker->ready)
+			httpd_client_run_ready(worker);
+
+		/* check timeout connections once a second */
+		if (httpd_now_ms() - expire >= 1000) {
+			httpd_client_expire(worker);
+			expire = httpd_now_ms();
 		}
 
-		httpd_handle_request(conn);
-		httpd_update_cache(log_path);
-		free(conn);
+		if (__atomic_load_n(&httpd_draining, __ATOMIC_RELAXED) && httpd_worker_drain(worker))
+			break;
 	}
 
+	close(epollfd);
+	cache_index_release();
 	return NULL;
 }
 
+/* upgrade on SIGUSR2, return once the new process is serving */
+static void httpd_wait_upgrade(sigset_t *set)
+{
+	int sig;
+
+	while (1) {
+		if (sigwait(set, &sig))
+			continue;
+
+		printf("Upgrade by %s\n", httpd_argv[0]);
+		if (!upgrade_exec(httpd_argv))
+			return;
+
+		printf("Upgrade failed, keep serving\n");
+	}
+}
+
 static int httpd(struct atophttd_context ctx)
 {
 	signal(SIGPIPE, SIG_IGN);
@@ -596,12 +1765,12 @@ static int httpd(struct atophttd_context ctx)
 	int conn_index, ret;
 
 	if (ctx.port > 0) {
-		conn_index = get_conntype_index_by_name(CONN_TYPE_SOCKET);
+		conn_index = get_conntype_index_by_name(ctx.conn_type);
 		if (conn_index < 0) {
-			printf("Failed finding connectin listener of %s\n", CONN_TYPE_SOCKET);
+			printf("Failed finding connectin listener of %s\n", ctx.conn_type);
 			exit(1);
 		}
-		listener = conn_create(get_conntype_by_name(CONN_TYPE_SOCKET), ctx.port, ctx.addr);
+		listener = conn_create(get_conntype_by_name(ctx.conn_type), ctx.port, ctx.addr);
 		ctx.listeners[conn_index] = listener;
 	}
 
@@ -621,15 +1790,94 @@ static int httpd(struct atophttd_context ctx)
 		ctx.listeners[conn_index] = listener;
 	}
 
+	if (unix_config.path) {
+		conn_index = get_conntype_index_by_name(CONN_TYPE_UNIX);
+		if (conn_index < 0) {
+			exit(1);
+		}
+		ctx.listeners[conn_index] = conn_create(get_conntype_by_name(CONN_TYPE_UNIX), -1, unix_config.path);
+	}
+
         if (ctx.daemonmode)
                 daemon(0, 0);
 
-	httpd_routine(ctx.listeners, ctx.log_path);
+	http_assets_init();
+	http_routes_init();
+
+	struct httpd_worker *workers = calloc(ctx.workers, sizeof(struct httpd_worker));
+	if (!workers) {
+		printf("Failed to allocate %d workers\n", ctx.workers);
+		exit(1);
+	}
+
+	/* workers inherit the mask, SIGUSR2 is taken by this thread only */
+	sigset_t upgrade_set;
+	sigemptyset(&upgrade_set);
+	sigaddset(&upgrade_set, SIGUSR2);
+	pthread_sigmask(SIG_BLOCK, &upgrade_set, NULL);
+	pthread_barrier_init(&httpd_listening, NULL, ctx.workers + 1);
+
+	pthread_t rescan;
+	ret = pthread_create(&rescan, NULL, httpd_rescan_routine, ctx.log_path);
+	if (ret) {
+		printf("Failed to create rescan thread: %s\n", strerror(ret));
+		exit(1);
+	}
+	pthread_detach(rescan);
+
+	for (int i = 0; i < ctx.workers; i++) {
+		struct httpd_worker *worker = &workers[i];
+
+		worker->id = i;
+		worker->op.output_type = OUTPUT_BUF;
+		worker->op.done = http_show_samp_done;
+
+		/* the first worker takes the listeners, others bind their own by SO_REUSEPORT */
+		for (int j = 0; j < CONN_TYPE_MAX; j++) {
+			listener = ctx.listeners[j];
+			if (!listener)
+				continue;
+
+			if (i > 0)
+				listener = conn_create(listener->type, listener->port, listener->bindaddr);
+
+			worker->listeners[j] = listener;
+		}
+
+		ret = pthread_create(&worker->thread, NULL, httpd_routine, worker);
+		if (ret) {
+			printf("Failed to create worker %d: %s\n", i, strerror(ret));
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&httpd_listening);
+	ret = listen_fd_close_inherited();
+	if (ret)
+		printf("Closed %d listening sockets of the previous process, more than workers\n", ret);
+	upgrade_ready();
+	upgrade_notify_systemd();
+
+	httpd_wait_upgrade(&upgrade_set);
+	rawlog_index_stop();
+	__atomic_store_n(&httpd_draining, 1, __ATOMIC_RELAXED);
+
+	for (int i = 0; i < ctx.workers; i++) {
+		pthread_join(workers[i].thread, NULL);
+		for (int j = 0; j < CONN_TYPE_MAX; j++) {
+			if (workers[i].listeners[j])
+				conn_free(workers[i].listeners[j]);
+		}
+	}
+
+	printf("Drained, exit\n");
+
+	free(workers);
 	return 0;
 }
 
 int __debug = 0;
-static char *short_opts = "dDhHp:a:P:t::A:C:c:k:V";
+static char *short_opts = "dDhHp:a:P:i:t::A:C:c:k:w:K:R:T:b:e:f:r:l:m:M:u:U:V";
 
 static struct option long_opts[] = {
 	{ "daemon",		no_argument,		0,	'd' },
@@ -637,11 +1885,25 @@ static struct option long_opts[] = {
 	{ "port",		required_argument,	0,	'p' },
 	{ "addr",		required_argument,	0,	'a' },
 	{ "path",		required_argument,	0,	'P' },
+	{ "index-dir",		required_argument,	0,	'i' },
 	{ "tls-port",		optional_argument,	0,	't'},
 	{ "tls-addr",		required_argument,	0,	'A'},
 	{ "ca-cert-file",	required_argument,	0,	'C' },
 	{ "cert-file",		required_argument,	0,	'c' },
 	{ "key-file",		required_argument,	0,	'k' },
+	{ "workers",		required_argument,	0,	'w' },
+	{ "keepalive-timeout",	required_argument,	0,	'K' },
+	{ "keepalive-requests",	required_argument,	0,	'R' },
+	{ "conn-type",		required_argument,	0,	'T' },
+	{ "backlog",		required_argument,	0,	'b' },
+	{ "defer-accept",	required_argument,	0,	'e' },
+	{ "fastopen",		required_argument,	0,	'f' },
+	{ "rate-limit",		required_argument,	0,	'r' },
+	{ "lane-limit",		required_argument,	0,	'l' },
+	{ "sample-cache",	required_argument,	0,	'm' },
+	{ "response-cache",	required_argument,	0,	'M' },
+	{ "unix-path",		required_argument,	0,	'u' },
+	{ "unix-allow",		required_argument,	0,	'U' },
 	{ "help",		no_argument,		0,	'h' },
 	{ "hide-cmdline",	no_argument,		0,	'H' },
 	{ "version",		no_argument,		0,	'V' },
@@ -656,11 +1918,25 @@ static void httpd_showhelp(void)
 	printf("  -p/--port PORT      \n    listen to PORT, default %d\n", DEFAULT_PORT);
 	printf("  -a/--addr ADDR      \n    bind to ADDR, default bind local host\n");
 	printf("  -P/--path PATH      \n    atop log path, default %s\n", DEFAULT_LOG_PATH);
+	printf("  -i/--index-dir DIR  \n    save the index of rawlogs to DIR to restart quickly, default disabled\n");
 	printf("  -t/--tls-port PORT  \n    listen to TLS PORT, default %d\n", DEFAULT_TLS_PORT);
 	printf("  -A/--tls-addr ADDR  \n    bind to TLS ADDR, default bind * (all addresses)\n");
 	printf("  -C/--ca-cert-file PATH\n    Path to the server TLS trusted CA cert file, default %s\n", DEFAULT_CA_FILE);
 	printf("  -c/--cert-file PATH \n    Path to the server TLS cert file, default %s\n", DEFAULT_CERT_FILE);
 	printf("  -k/--key-file PATH  \n    Path to the server TLS key file, default %s\n", DEFAULT_KEY_FILE);
+	printf("  -w/--workers N      \n    serve requests by N worker threads, default 1\n");
+	printf("  -K/--keepalive-timeout SEC\n    close idle connection after SEC seconds, 0 disables keep-alive, default %d\n", DEFAULT_KEEPALIVE_TIMEOUT);
+	printf("  -R/--keepalive-requests N\n    close connection after N requests, default %d\n", DEFAULT_KEEPALIVE_REQUESTS);
+	printf("  -T/--conn-type TYPE \n    serve PORT by connection TYPE, %s or %s, default %s\n", CONN_TYPE_SOCKET, CONN_TYPE_URING, CONN_TYPE_SOCKET);
+	printf("  -b/--backlog N      \n    queue up to N connections to accept, default %d\n", DEFAULT_BACKLOG);
+	printf("  -e/--defer-accept SEC\n    accept connection once its request arrives, wait up to SEC seconds, default 0 (disabled)\n");
+	printf("  -f/--fastopen QLEN  \n    enable TCP Fast Open with QLEN pending requests, default 0 (disabled)\n");
+	printf("  -r/--rate-limit N   \n    serve N tokens per second to each client address, a request of static/latest/history/bulk lane costs 1/1/4/16 tokens, 0 disables, default %d\n", DEFAULT_RATE_LIMIT);
+	printf("  -l/--lane-limit LANE=N\n    serve up to N requests of LANE (static, latest, history or bulk) at the same time, default half of workers for history, a quarter for bulk\n");
+	printf("  -m/--sample-cache MB\n    keep up to MB of decoded samples for all the workers, 0 disables, default %d\n", DEFAULT_SAMPLE_CACHE);
+	printf("  -M/--response-cache MB\n    keep up to MB of rendered sample responses for all the workers, 0 disables, default %d\n", DEFAULT_RESPONSE_CACHE);
+	printf("  -u/--unix-path PATH \n    listen to unix socket PATH too, a leading '@' for the abstract namespace, Ex, @atophttpd\n");
+	printf("  -U/--unix-allow USER\n    serve unix socket peers of USER (name or uid) only, root and the user of atophttpd are always allowed, repeat it for more users\n");
 	printf("  -H/--hide-cmdline   \n    hide cmdline for security protection\n");
 	printf("  -h/--help           \n    show help\n\n");
 	printf("  maintained by       \n    zhenwei pi<pizhenwei@bytedance.com> (HTTP backend)\n");
@@ -677,6 +1953,7 @@ static void httpd_showversion(void)
 int main(int argc, char *argv[])
 {
 	int args, errno;
+	char *exe;
 	int ch;
 
 	while (1) {
@@ -702,6 +1979,9 @@ int main(int argc, char *argv[])
 			case 'P':
 				config.log_path = optarg;
 				break;
+			case 'i':
+				rawlog_index_dir = optarg;
+				break;
 			case 't':
 				if (optarg)
 					config.tls_ctx_config.tls_port = atoi(optarg);
@@ -720,6 +2000,109 @@ int main(int argc, char *argv[])
 			case 'k':
 				config.tls_ctx_config.key_file = optarg;
 				break;
+			case 'w':
+				config.workers = atoi(optarg);
+				if (config.workers < 1 || config.workers > MAX_WORKERS) {
+					printf("workers should be in range [1, %d]\n", MAX_WORKERS);
+					return -1;
+				}
+				break;
+			case 'K':
+				config.keepalive_timeout = atoi(optarg);
+				if (config.keepalive_timeout < 0) {
+					printf("keepalive-timeout should not be negative\n");
+					return -1;
+				}
+				break;
+			case 'R':
+				config.keepalive_requests = atoi(optarg);
+				if (config.keepalive_requests < 1) {
+					printf("keepalive-requests should be at least 1\n");
+					return -1;
+				}
+				break;
+			case 'T':
+				if (strcasecmp(optarg, CONN_TYPE_SOCKET) && strcasecmp(optarg, CONN_TYPE_URING)) {
+					printf("conn-type should be %s or %s\n", CONN_TYPE_SOCKET, CONN_TYPE_URING);
+					return -1;
+				}
+				config.conn_type = optarg;
+				break;
+			case 'b':
+				listen_config.backlog = atoi(optarg);
+				if (listen_config.backlog < 1) {
+					printf("backlog should be at least 1\n");
+					return -1;
+				}
+				break;
+			case 'e':
+				listen_config.defer_accept = atoi(optarg);
+				if (listen_config.defer_accept < 0) {
+					printf("defer-accept should not be negative\n");
+					return -1;
+				}
+				break;
+			case 'f':
+				listen_config.fastopen = atoi(optarg);
+				if (listen_config.fastopen < 0) {
+					printf("fastopen should not be negative\n");
+					return -1;
+				}
+				break;
+			case 'r':
+				admission_config.rate = atoi(optarg);
+				if (admission_config.rate < 0) {
+					printf("rate-limit should not be negative\n");
+					return -1;
+				}
+				break;
+			case 'l': {
+				char *value = strchr(optarg, '=');
+				char name[16];
+				int lane = -1;
+
+				/* keep argv untouched, it's executed again on upgrade */
+				if (value && (value - optarg < sizeof(name))) {
+					snprintf(name, sizeof(name), "%.*s", (int)(value++ - optarg), optarg);
+					lane = admission_lane_by_name(name);
+				}
+				if (!value || (lane < 0) || (atoi(value) < 1)) {
+					printf("lane-limit should be LANE=N, LANE is static, latest, history or bulk, N is at least 1\n");
+					return -1;
+				}
+				admission_config.max_inflight[lane] = atoi(value);
+				break;
+			}
+			case 'm':
+				if (atoi(optarg) < 0) {
+					printf("sample-cache should not be negative\n");
+					return -1;
+				}
+				sample_config.max_size = (size_t)atoi(optarg) << 20;
+				break;
+			case 'M':
+				if (atoi(optarg) < 0) {
+					printf("response-cache should not be negative\n");
+					return -1;
+				}
+				response_config.max_size = (size_t)atoi(optarg) << 20;
+				break;
+			case 'u':
+				unix_config.path = optarg;
+				break;
+			case 'U': {
+				struct passwd *pw = getpwnam(optarg);
+				char *end;
+				long uid = pw ? pw->pw_uid : strtol(optarg, &end, 10);
+
+				if ((!pw && (*end || (end == optarg) || (uid < 0)))
+				    || (unix_config.nr_allow_uids == MAX_UNIX_ALLOW_UIDS)) {
+					printf("unix-allow should be a user name or uid, up to %d users\n", MAX_UNIX_ALLOW_UIDS);
+					return -1;
+				}
+				unix_config.allow_uids[unix_config.nr_allow_uids++] = uid;
+				break;
+			}
 			case 'H':
 				hidecmdline = 1;
 				break;
@@ -740,6 +2123,21 @@ int main(int argc, char *argv[])
 		return -1;
 	}
 
+	/* optional, index rawlogs without it */
+	if (rawlog_index_dir) {
+		mkdir(rawlog_index_dir, 0755);
+		rawlog_index_dir = realpath(rawlog_index_dir, NULL);
+		if (!rawlog_index_dir)
+			printf("%s: index dir is unavailable: %m\n", __func__);
+	}
+
+	/* executed again on upgrade, the daemon mode changes the cwd */
+	if (strchr(argv[0], '/') && (exe = realpath(argv[0], NULL)))
+		argv[0] = exe;
+	httpd_argv = argv;
+	if (upgrade_inherit() < 0)
+		printf("%s: failed to take over the previous process, start as usual\n", __func__);
+
 	if (rawlog_parse_all(config.log_path)) {
 		printf("%s: rawlog parse failed\n", __func__);
 		return -1;
@@ -748,6 +2146,7 @@ int main(int argc, char *argv[])
 	log_debug("%s runs with log path(%s), port(%d)\n", argv[0], config.log_path, config.port);
 
 	printf("%s runs with log path(%s), port(%d)\n", argv[0], config.log_path, config.port);
+	admission_init(config.workers);
 	conntype_initialize();
 	errno = httpd(config);
 
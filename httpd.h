@@ -21,8 +21,33 @@ extern int __debug;
 				__func__, __LINE__, ##args);	\
 	}
 
+struct output;
+struct cache_t;
+
+/* save the index of each rawlog here to restart quickly, NULL to disable */
+extern char *rawlog_index_dir;
+/* the upgraded process owns the index files, leave them alone */
+void rawlog_index_stop(void);
 int rawlog_parse_all(const char *path);
-int rawlog_get_record(time_t ts, char *lables, connection *conn);
+
+/*
+ * Index rawlogs of @path by inotify, the appended records are indexed once
+ * they are written. It returns only on failure, Ex, @path is removed.
+ */
+int rawlog_watch(const char *path);
+int rawlog_get_record(time_t ts, char *lables, struct output *op, connection *conn);
+
+/*
+ * rawlog_get_record() in two steps, the record of @ts is kept by this thread
+ * until the next lookup. NULL if there is none. By @dir CACHE_BEFORE/AFTER,
+ * the closest record before/after @ts if there is no record at @ts, across
+ * the gaps between rawlogs. By 0, the next one of the same rawlog.
+ */
+struct cache_t *rawlog_find_record(time_t ts, int dir, off_t *off);
+int rawlog_output_record(struct cache_t *cache, off_t off, char *lables, struct output *op, connection *conn);
+
+/* time of the latest sample, 0 if there is none */
+time_t rawlog_recent_time(void);
 
 typedef struct atophttpd_tls_context_config {
 	int tls_port;
@@ -35,7 +60,11 @@ typedef struct atophttpd_tls_context_config {
 struct atophttd_context {
 	int port;
         int daemonmode;
+	int workers;
+	int keepalive_timeout;
+	int keepalive_requests;
 	char *addr;
+	char *conn_type;
 	char *log_path;
 
 	atophttpd_tls_context_config tls_ctx_config;
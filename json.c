@@ -63,20 +63,51 @@ static void json_print_PRE();
 */
 struct labeldef {
 	char *label;
-	int valid;
-	void (*prifunc)(int, char *, struct sstat *, struct tstat *, int);
+	void (*prifunc)(struct output *, int, char *, struct sstat *, struct tstat *, int);
 };
 
-extern struct output defop;
+static struct labeldef labeldefs[] = {
+	{ "CPU",	json_print_CPU },
+	{ "cpu",	json_print_cpu },
+	{ "CPL",	json_print_CPL },
+	{ "GPU",	json_print_GPU },
+	{ "MEM",	json_print_MEM },
+	{ "SWP",	json_print_SWP },
+	{ "PAG",	json_print_PAG },
+	{ "PSI",	json_print_PSI },
+	{ "LVM",	json_print_LVM },
+	{ "MDD",	json_print_MDD },
+	{ "DSK",	json_print_DSK },
+	{ "NFM",	json_print_NFM },
+	{ "NFC",	json_print_NFC },
+	{ "NFS",	json_print_NFS },
+	{ "NET",	json_print_NET },
+	{ "IFB",	json_print_IFB },
+	{ "NUM",	json_print_NUM },
+	{ "NUC",	json_print_NUC },
+	{ "LLC",	json_print_LLC },
+
+	{ "PRG",	json_print_PRG },
+	{ "PRC",	json_print_PRC },
+	{ "PRM",	json_print_PRM },
+	{ "PRD",	json_print_PRD },
+	{ "PRN",	json_print_PRN },
+	{ "PRE",	json_print_PRE },
+};
+
+#define NUMLABELS	(sizeof(labeldefs) / sizeof(struct labeldef))
 
-static int jsondef(char *pd, struct labeldef *labeldef, int numlabels)
+/* set bit i of @mask for labeldefs[i], the errors go to @op if any */
+static int jsondef(struct output *op, char *pd, unsigned int *mask)
 {
 	int i;
 	char		*p, *ep = pd + strlen(pd);
 
+	*mask = 0;
 	if (*pd == '-') {
 		char *err =  "json lables should be followed by label list\n";
-		output_samp(&defop, err, strlen(err));
+		if (op)
+			output_samp(op, err, strlen(err));
 		return -EINVAL;
 	}
 
@@ -92,24 +123,25 @@ static int jsondef(char *pd, struct labeldef *labeldef, int numlabels)
 		/*
 		** check if the next label exists
 		*/
-		for (i = 0; i < numlabels; i++)
+		for (i = 0; i < NUMLABELS; i++)
 		{
-			if (!strcmp(labeldef[i].label, pd)) {
-				labeldef[i].valid = 1;
+			if (!strcmp(labeldefs[i].label, pd)) {
+				*mask |= 1U << i;
 				break;
 			}
 		}
 
-		if (i == numlabels)
+		if (i == NUMLABELS)
 		{
 			if (!strcmp("ALL", pd)) {
-				for (i = 0; i < numlabels; i++)
-					labeldef[i].valid = 1;
+				*mask = (1U << NUMLABELS) - 1;
 				break;
-			} else {
+			} else if (op) {
 				char err[64];
 				snprintf(err, sizeof(err), "json lables not supported: %s\n", pd);
-				output_samp(&defop, err, strlen(err));
+				output_samp(op, err, strlen(err));
+				return -EINVAL;
+			} else {
 				return -EINVAL;
 			}
 		}
@@ -120,62 +152,29 @@ static int jsondef(char *pd, struct labeldef *labeldef, int numlabels)
 	return 0;
 }
 
-int jsonout(int flags, char *pd, time_t curtime, int numsecs,
-         struct devtstat *devtstat, struct sstat *sstat,
-         int nexit, unsigned int noverflow, char flag, connection *conn)
+/*
+ * Normalize the labels of a request, Ex "MEM,CPU" and "CPU,MEM" get the same
+ * mask. @pd is left untouched.
+ */
+int jsonlabels(const char *pd, unsigned int *mask)
 {
-	char header[256], general[256];
-	struct tstat *tmp = devtstat->taskall;
-	int buflen = 0;
-	int i, ret;
+	char labels[LINE_BUF_SIZE];
 
-	struct labeldef	labeldef[] = {
-		{ "CPU",	0,	json_print_CPU },
-		{ "cpu",	0,	json_print_cpu },
-		{ "CPL",	0,	json_print_CPL },
-		{ "GPU",	0,	json_print_GPU },
-		{ "MEM",	0,	json_print_MEM },
-		{ "SWP",	0,	json_print_SWP },
-		{ "PAG",	0,	json_print_PAG },
-		{ "PSI",	0,	json_print_PSI },
-		{ "LVM",	0,	json_print_LVM },
-		{ "MDD",	0,	json_print_MDD },
-		{ "DSK",	0,	json_print_DSK },
-		{ "NFM",	0,	json_print_NFM },
-		{ "NFC",	0,	json_print_NFC },
-		{ "NFS",	0,	json_print_NFS },
-		{ "NET",	0,	json_print_NET },
-		{ "IFB",	0,	json_print_IFB },
-		{ "NUM",	0,	json_print_NUM },
-		{ "NUC",	0,	json_print_NUC },
-		{ "LLC",	0,	json_print_LLC },
-
-		{ "PRG",	0,	json_print_PRG },
-		{ "PRC",	0,	json_print_PRC },
-		{ "PRM",	0,	json_print_PRM },
-		{ "PRD",	0,	json_print_PRD },
-		{ "PRN",	0,	json_print_PRN },
-		{ "PRE",	0,	json_print_PRE },
-	};
-
-	int numlabels = sizeof(labeldef) / sizeof(struct labeldef);
-
-	ret = jsondef(pd, labeldef, numlabels);
-	if (ret) {
-		output_samp_done(&defop, conn);
-		return ret;
-	}
+	if (strlen(pd) >= sizeof(labels))
+		return -EINVAL;
 
-	buflen = snprintf(general, sizeof(general),
-			"{\"host\": \"%s\", "
-			"\"timestamp\": %ld, "
-			"\"elapsed\": %d",
-			utsname.nodename,
-			curtime,
-			numsecs
-			);
+	strcpy(labels, pd);
 
-	output_samp(&defop, general, buflen);
+	return jsondef(NULL, labels, mask);
+}
+
+/*
+ * Fix up a decoded sample once, jsonout() never modifies it, so a sample is
+ * shared by the workers.
+ */
+void jsonprep(struct devtstat *devtstat, struct sstat *sstat)
+{
+	struct tstat *tmp = devtstat->taskall;
 
 	/* Replace " with # in case json can not parse this out */
 	for (int k = 0; k < devtstat->ntaskall; k++, tmp++) {
@@ -193,19 +192,52 @@ int jsonout(int flags, char *pd, time_t curtime, int numsecs,
 				tmp->gen.cmdline[j] = '#';
 	}
 
-	for (i = 0; i < numlabels; i++) {
-		if (!labeldef[i].valid)
+	if (sstat->cpu.all.instr == 1) {
+		sstat->cpu.all.instr = 0;
+		sstat->cpu.all.cycle = 0;
+	}
+}
+
+int jsonout(int flags, char *pd, time_t curtime, int numsecs,
+         struct devtstat *devtstat, struct sstat *sstat,
+         int nexit, unsigned int noverflow, char flag, struct output *op,
+         connection *conn)
+{
+	char header[256], general[256];
+	int buflen = 0;
+	unsigned int mask;
+	int i, ret;
+
+	ret = jsondef(op, pd, &mask);
+	if (ret) {
+		output_samp_done(op, conn);
+		return ret;
+	}
+
+	buflen = snprintf(general, sizeof(general),
+			"{\"host\": \"%s\", "
+			"\"timestamp\": %ld, "
+			"\"elapsed\": %d",
+			utsname.nodename,
+			curtime,
+			numsecs
+			);
+
+	output_samp(op, general, buflen);
+
+	for (i = 0; i < NUMLABELS; i++) {
+		if (!(mask & (1U << i)))
 			continue;
 
 		/* prepare generic columns */
 		snprintf(header, sizeof header, "\"%s\"",
-				labeldef[i].label);
+				labeldefs[i].label);
 		/* call all print-functions */
-		(labeldef[i].prifunc)(flags, header, sstat, devtstat->taskall, devtstat->ntaskall);
+		(labeldefs[i].prifunc)(op, flags, header, sstat, devtstat->taskall, devtstat->ntaskall);
 	}
 
-	output_samp(&defop, "}\n", 2);
-	output_samp_done(&defop, conn);
+	output_samp(op, "}\n", 2);
+	output_samp_done(op, conn);
 
 	return 0;
 }
@@ -233,7 +265,7 @@ json_calc_freqscale(count_t maxfreq, count_t cnt, count_t ticks,
 	}
 }
 
-static void json_print_CPU(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_CPU(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	count_t maxfreq = 0;
 	count_t cnt = 0;
@@ -252,11 +284,6 @@ static void json_print_CPU(int flags, char *hp, struct sstat *ss, struct tstat *
 	maxfreq = ss->cpu.cpu[0].freqcnt.maxfreq;
 	json_calc_freqscale(maxfreq, cnt, ticks, &freq, &freqperc);
 
-	if (ss->cpu.all.instr == 1) {
-		ss->cpu.all.instr = 0;
-		ss->cpu.all.cycle = 0;
-	}
-
 	buflen = snprintf(buf, sizeof(buf), ", %s: {"
 		"\"hertz\": %u, "
 		"\"nrcpu\": %lld, "
@@ -291,10 +318,10 @@ static void json_print_CPU(int flags, char *hp, struct sstat *ss, struct tstat *
 		ss->cpu.all.cycle
 		);
 
-	output_samp(&defop, buf, buflen);
+	output_samp(op, buf, buflen);
 }
 
-static void json_print_cpu(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_cpu(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int i;
 	count_t maxfreq = 0;
@@ -307,11 +334,11 @@ static void json_print_cpu(int flags, char *hp, struct sstat *ss, struct tstat *
 
 	char br[LEN_HP_SIZE];
 	buflen = sprintf(br, ", %s: [", hp);
-	output_samp(&defop, br, buflen);
+	output_samp(op, br, buflen);
 
 	for (i = 0; i < ss->cpu.nrcpu; i++) {
 		if (i > 0) {
-			output_samp(&defop, ", ", 2);
+			output_samp(op, ", ", 2);
 		}
 		cnt = ss->cpu.cpu[i].freqcnt.cnt;
 		ticks = ss->cpu.cpu[i].freqcnt.ticks;
@@ -348,13 +375,13 @@ static void json_print_cpu(int flags, char *hp, struct sstat *ss, struct tstat *
 			ss->cpu.cpu[i].instr,
 			ss->cpu.cpu[i].cycle
 			);
-		output_samp(&defop, buf, buflen);
+		output_samp(op, buf, buflen);
 	}
 
-	output_samp(&defop, "]", 1);
+	output_samp(op, "]", 1);
 }
 
-static void json_print_CPL(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_CPL(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int buflen = 0;
 	char buf[LINE_BUF_SIZE];
@@ -372,10 +399,10 @@ static void json_print_CPL(int flags, char *hp, struct sstat *ss, struct tstat *
 		ss->cpu.csw,
 		ss->cpu.devint);
 
-	output_samp(&defop, buf, buflen);
+	output_samp(op, buf, buflen);
 }
 
-static void json_print_GPU(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_GPU(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int i;
 	int buflen = 0;
@@ -383,11 +410,11 @@ static void json_print_GPU(int flags, char *hp, struct sstat *ss, struct tstat *
 
 	char br[LEN_HP_SIZE];
 	buflen = sprintf(br, ", %s: [", hp);
-	output_samp(&defop, br, buflen);
+	output_samp(op, br, buflen);
 
 	for (i = 0; i < ss->gpu.nrgpus; i++) {
 		if (i > 0) {
-			output_samp(&defop, ", ", 2);
+			output_samp(op, ", ", 2);
 		}
 		buflen = snprintf(buf, sizeof(buf), "{\"gpuid\": %d, "
 			"\"busid\": \"%.19s\", "
@@ -411,13 +438,13 @@ static void json_print_GPU(int flags, char *hp, struct sstat *ss, struct tstat *
 			ss->gpu.gpu[i].gpuperccum,
 			ss->gpu.gpu[i].memperccum,
 			ss->gpu.gpu[i].memusecum);
-		output_samp(&defop, buf, buflen);
+		output_samp(op, buf, buflen);
 	}
 
-	output_samp(&defop, "]", 1);
+	output_samp(op, "]", 1);
 }
 
-static void json_print_MEM(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_MEM(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int buflen = 0;
 	char buf[LINE_BUF_SIZE];
@@ -459,10 +486,10 @@ static void json_print_MEM(int flags, char *hp, struct sstat *ss, struct tstat *
 		ss->mem.tcpsock * pagesize,
 		ss->mem.udpsock * pagesize);
 
-	output_samp(&defop, buf, buflen);
+	output_samp(op, buf, buflen);
 }
 
-static void json_print_SWP(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_SWP(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int buflen = 0;
 	char buf[LINE_BUF_SIZE];
@@ -480,10 +507,10 @@ static void json_print_SWP(int flags, char *hp, struct sstat *ss, struct tstat *
 		ss->mem.committed * pagesize,
 		ss->mem.commitlim * pagesize);
 
-	output_samp(&defop, buf, buflen);
+	output_samp(op, buf, buflen);
 }
 
-static void json_print_PAG(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_PAG(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int buflen = 0;
 	char buf[LINE_BUF_SIZE];
@@ -515,10 +542,10 @@ static void json_print_PAG(int flags, char *hp, struct sstat *ss, struct tstat *
 		ss->mem.swouts,
 		ss->mem.oomkills);
 
-	output_samp(&defop, buf, buflen);
+	output_samp(op, buf, buflen);
 }
 
-static void json_print_PSI(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_PSI(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	if ( !(ss->psi.present) )
 		return;
@@ -560,10 +587,10 @@ static void json_print_PSI(int flags, char *hp, struct sstat *ss, struct tstat *
 		ss->psi.iofull.avg10, ss->psi.iofull.avg60,
 		ss->psi.iofull.avg300, ss->psi.iofull.total);
 
-	output_samp(&defop, buf, buflen);
+	output_samp(op, buf, buflen);
 }
 
-static void json_print_LVM(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_LVM(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int i;
 	int buflen = 0;
@@ -571,11 +598,11 @@ static void json_print_LVM(int flags, char *hp, struct sstat *ss, struct tstat *
 
 	char br[LEN_HP_SIZE];
 	buflen = sprintf(br, ", %s: [", hp);
-	output_samp(&defop, br, buflen);
+	output_samp(op, br, buflen);
 
 	for (i = 0; ss->dsk.lvm[i].name[0]; i++) {
 		if (i > 0) {
-			output_samp(&defop, ", ", 2);
+			output_samp(op, ", ", 2);
 		}
 		buflen = snprintf(buf, sizeof(buf), "{\"lvmname\": \"%.19s\", "
 			"\"io_ms\": %lld, "
@@ -595,13 +622,13 @@ static void json_print_LVM(int flags, char *hp, struct sstat *ss, struct tstat *
 			ss->dsk.lvm[i].nwsect,
 			ss->dsk.lvm[i].avque,
 			ss->dsk.lvm[i].inflight);
-		output_samp(&defop, buf, buflen);
+		output_samp(op, buf, buflen);
 	}
 
-	output_samp(&defop, "]", 1);
+	output_samp(op, "]", 1);
 }
 
-static void json_print_MDD(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_MDD(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int i;
 	int buflen = 0;
@@ -609,11 +636,11 @@ static void json_print_MDD(int flags, char *hp, struct sstat *ss, struct tstat *
 
 	char br[LEN_HP_SIZE];
 	buflen = sprintf(br, ", %s: [", hp);
-	output_samp(&defop, br, buflen);
+	output_samp(op, br, buflen);
 
 	for (i = 0; ss->dsk.mdd[i].name[0]; i++) {
 		if (i > 0) {
-			output_samp(&defop, ", ", 2);
+			output_samp(op, ", ", 2);
 		}
 		buflen = snprintf(buf, sizeof(buf), "{\"mddname\": \"%.19s\", "
 			"\"io_ms\": %lld, "
@@ -631,13 +658,13 @@ static void json_print_MDD(int flags, char *hp, struct sstat *ss, struct tstat *
 			ss->dsk.mdd[i].nwsect,
 			ss->dsk.mdd[i].avque,
 			ss->dsk.mdd[i].inflight);
-		output_samp(&defop, buf, buflen);
+		output_samp(op, buf, buflen);
 	}
 
-	output_samp(&defop, "]", 1);
+	output_samp(op, "]", 1);
 }
 
-static void json_print_DSK(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_DSK(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int i;
 	int buflen = 0;
@@ -645,11 +672,11 @@ static void json_print_DSK(int flags, char *hp, struct sstat *ss, struct tstat *
 
         char br[LEN_HP_SIZE];
         buflen = sprintf(br, ", %s: [", hp);
-        output_samp(&defop, br, buflen);
+        output_samp(op, br, buflen);
 
 	for (i = 0; ss->dsk.dsk[i].name[0]; i++) {
 		if (i > 0) {
-			output_samp(&defop, ", ", 2);
+			output_samp(op, ", ", 2);
 		}
 		buflen = snprintf(buf, sizeof(buf), "{\"dskname\": \"%.19s\", "
 			"\"io_ms\": %lld, "
@@ -669,13 +696,13 @@ static void json_print_DSK(int flags, char *hp, struct sstat *ss, struct tstat *
 			ss->dsk.dsk[i].nwsect,
 			ss->dsk.dsk[i].avque,
 			ss->dsk.dsk[i].inflight);
-		output_samp(&defop, buf, buflen);
+		output_samp(op, buf, buflen);
 	}
 
-	output_samp(&defop, "]", 1);
+	output_samp(op, "]", 1);
 }
 
-static void json_print_NFM(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_NFM(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int i;
 	int buflen = 0;
@@ -683,11 +710,11 @@ static void json_print_NFM(int flags, char *hp, struct sstat *ss, struct tstat *
 
         char br[LEN_HP_SIZE];
         buflen = sprintf(br, ", %s: [", hp);
-        output_samp(&defop, br, buflen);
+        output_samp(op, br, buflen);
 
 	for (i = 0; i < ss->nfs.nfsmounts.nrmounts; i++) {
 		if (i > 0) {
-			output_samp(&defop, ", ", 2);
+			output_samp(op, ", ", 2);
 		}
 		buflen = snprintf(buf, sizeof(buf), "{\"mountdev\": \"%.19s\", "
 			"\"bytestotread\": %lld, "
@@ -707,13 +734,13 @@ static void json_print_NFM(int flags, char *hp, struct sstat *ss, struct tstat *
 			ss->nfs.nfsmounts.nfsmnt[i].bytesdwrite,
 			ss->nfs.nfsmounts.nfsmnt[i].pagesmread * pagesize,
 			ss->nfs.nfsmounts.nfsmnt[i].pagesmwrite * pagesize);
-		output_samp(&defop, buf, buflen);
+		output_samp(op, buf, buflen);
 	}
 
-	output_samp(&defop, "]", 1);
+	output_samp(op, "]", 1);
 }
 
-static void json_print_NFC(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_NFC(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int buflen = 0;
 	char buf[LINE_BUF_SIZE];
@@ -731,10 +758,10 @@ static void json_print_NFC(int flags, char *hp, struct sstat *ss, struct tstat *
 		ss->nfs.client.rpcretrans,
 		ss->nfs.client.rpcautrefresh);
 
-	output_samp(&defop, buf, buflen);
+	output_samp(op, buf, buflen);
 }
 
-static void json_print_NFS(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_NFS(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int buflen = 0;
 	char buf[LINE_BUF_SIZE];
@@ -772,10 +799,10 @@ static void json_print_NFS(int flags, char *hp, struct sstat *ss, struct tstat *
 		ss->nfs.server.rcmiss,
 		ss->nfs.server.rcnoca);
 
-	output_samp(&defop, buf, buflen);
+	output_samp(op, buf, buflen);
 }
 
-static void json_print_NET(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_NET(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int i;
 	int buflen = 0;
@@ -824,15 +851,15 @@ static void json_print_NET(int flags, char *hp, struct sstat *ss, struct tstat *
 		ss->net.icmpv6.Icmp6InMsgs,
 		ss->net.icmpv4.OutMsgs +
 		ss->net.icmpv6.Icmp6OutMsgs);
-	output_samp(&defop, buf, buflen);
+	output_samp(op, buf, buflen);
 
 	char br[LEN_HP_SIZE];
         buflen = sprintf(br, ", %s: [", hp);
-        output_samp(&defop, br, buflen);
+        output_samp(op, br, buflen);
 
 	for (i = 0; ss->intf.intf[i].name[0]; i++) {
 		if (i > 0) {
-			output_samp(&defop, ", ", 2);
+			output_samp(op, ", ", 2);
 		}
 		buflen = snprintf(buf, sizeof(buf), "{\"name\": \"%.19s\", "
 			"\"rpack\": %lld, "
@@ -860,13 +887,13 @@ static void json_print_NET(int flags, char *hp, struct sstat *ss, struct tstat *
 			ss->intf.intf[i].scollis,
 			ss->intf.intf[i].rmultic,
 			ss->intf.intf[i].duplex);
-		output_samp(&defop, buf, buflen);
+		output_samp(op, buf, buflen);
 	}
 
-	output_samp(&defop, "]", 1);
+	output_samp(op, "]", 1);
 }
 
-static void json_print_IFB(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_IFB(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int i;
 	int buflen = 0;
@@ -874,11 +901,11 @@ static void json_print_IFB(int flags, char *hp, struct sstat *ss, struct tstat *
 
         char br[LEN_HP_SIZE];
         buflen = sprintf(br, ", %s: [", hp);
-        output_samp(&defop, br, buflen);
+        output_samp(op, br, buflen);
 
 	for (i = 0; i < ss->ifb.nrports; i++) {
 		if (i > 0) {
-			output_samp(&defop, ", ", 2);
+			output_samp(op, ", ", 2);
 		}
 		buflen = snprintf(buf, sizeof(buf), "{\"ibname\": \"%.19s\", "
 			"\"portnr\": \"%hd\", "
@@ -896,13 +923,13 @@ static void json_print_IFB(int flags, char *hp, struct sstat *ss, struct tstat *
 			ss->ifb.ifb[i].sndb,
 			ss->ifb.ifb[i].rcvp,
 			ss->ifb.ifb[i].sndp);
-		output_samp(&defop, buf, buflen);
+		output_samp(op, buf, buflen);
 	}
 
-	output_samp(&defop, "]", 1);
+	output_samp(op, "]", 1);
 }
 
-static void json_print_NUM(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_NUM(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int i;
 	int buflen = 0;
@@ -910,11 +937,11 @@ static void json_print_NUM(int flags, char *hp, struct sstat *ss, struct tstat *
 
         char br[LEN_HP_SIZE];
         buflen = sprintf(br, ", %s: [", hp);
-        output_samp(&defop, br, buflen);
+        output_samp(op, br, buflen);
 
 	for (i = 0; i < ss->memnuma.nrnuma; i++) {
 		if (i > 0) {
-			output_samp(&defop, ", ", 2);
+			output_samp(op, ", ", 2);
 		}
 		buflen = snprintf(buf, sizeof(buf), "{\"frag\": \"%f\", "
 			"\"totmem\": %lld, "
@@ -938,13 +965,13 @@ static void json_print_NUM(int flags, char *hp, struct sstat *ss, struct tstat *
 			ss->memnuma.numa[i].slabreclaim * pagesize,
 			ss->memnuma.numa[i].shmem * pagesize,
 			ss->memnuma.numa[i].tothp * ss->mem.hugepagesz);
-		output_samp(&defop, buf, buflen);
+		output_samp(op, buf, buflen);
 	}
 
-	output_samp(&defop, "]", 1);
+	output_samp(op, "]", 1);
 }
 
-static void json_print_NUC(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_NUC(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int i;
 	int buflen = 0;
@@ -952,11 +979,11 @@ static void json_print_NUC(int flags, char *hp, struct sstat *ss, struct tstat *
 
 	char br[LEN_HP_SIZE];
 	buflen = sprintf(br, ", %s: [", hp);
-	output_samp(&defop, br, buflen);
+	output_samp(op, br, buflen);
 
 	for (i = 0; i < ss->cpunuma.nrnuma; i++) {
 		if (i > 0) {
-			output_samp(&defop, ", ", 2);
+			output_samp(op, ", ", 2);
 		}
 		buflen = snprintf(buf, sizeof(buf), "{\"numanr\": \"%d\", "
 				"\"nrcpu\": %lld, "
@@ -980,13 +1007,13 @@ static void json_print_NUC(int flags, char *hp, struct sstat *ss, struct tstat *
 				ss->cpunuma.numa[i].Stime,
 				ss->cpunuma.numa[i].steal,
 				ss->cpunuma.numa[i].guest);
-		output_samp(&defop, buf, buflen);
+		output_samp(op, buf, buflen);
 	}
 
-	output_samp(&defop, "]", 1);
+	output_samp(op, "]", 1);
 }
 
-static void json_print_LLC(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_LLC(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int i;
 	int buflen = 0;
@@ -994,11 +1021,11 @@ static void json_print_LLC(int flags, char *hp, struct sstat *ss, struct tstat *
 
         char br[LEN_HP_SIZE];
         buflen = sprintf(br, ", %s: [", hp);
-        output_samp(&defop, br, buflen);
+        output_samp(op, br, buflen);
 
 	for (i = 0; i < ss->llc.nrllcs; i++) {
 		if (i > 0) {
-			output_samp(&defop, ", ", 2);
+			output_samp(op, ", ", 2);
 		}
 		buflen = snprintf(buf, sizeof(buf), "{\"LLC\": \"%3d\", "
 			"\"occupancy\": \"%3.1f\", "
@@ -1008,23 +1035,23 @@ static void json_print_LLC(int flags, char *hp, struct sstat *ss, struct tstat *
 			ss->llc.perllc[i].occupancy * 100,
 			ss->llc.perllc[i].mbm_total,
 			ss->llc.perllc[i].mbm_local);
-		output_samp(&defop, buf, buflen);
+		output_samp(op, buf, buflen);
 	}
 
-	output_samp(&defop, "]", 1);
+	output_samp(op, "]", 1);
 }
 
 /*
 ** print functions for process-level statistics
 */
-static void json_print_PRG(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_PRG(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int i, exitcode;
 	int buflen = 0;
 	char buf[LINE_BUF_SIZE];
 	char br[LEN_HP_SIZE];
 	buflen = sprintf(br, ", %s: [", hp);
-	output_samp(&defop, br, buflen);
+	output_samp(op, br, buflen);
 
 	static char st[3];
 
@@ -1054,7 +1081,7 @@ static void json_print_PRG(int flags, char *hp, struct sstat *ss, struct tstat *
 		}
 
 		if (i > 0) {
-			output_samp(&defop, ", ", 2);
+			output_samp(op, ", ", 2);
 		}
 
 		/* using getpwuid() & getpwuid to convert ruid & euid to string seems better, but the two functions take a long time */
@@ -1098,13 +1125,13 @@ static void json_print_PRG(int flags, char *hp, struct sstat *ss, struct tstat *
 			ps->gen.elaps,
 			!!ps->gen.isproc, /* convert to boolean */
 			ps->gen.container[0] ? ps->gen.container:"-");
-		output_samp(&defop, buf, buflen);
+		output_samp(op, buf, buflen);
 	}
 
-	output_samp(&defop, "]", 1);
+	output_samp(op, "]", 1);
 }
 
-static void json_print_PRC(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_PRC(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int i;
 	int buflen = 0;
@@ -1112,13 +1139,13 @@ static void json_print_PRC(int flags, char *hp, struct sstat *ss, struct tstat *
 
         char br[LEN_HP_SIZE];
         buflen = sprintf(br, ", %s: [", hp);
-        output_samp(&defop, br, buflen);
+        output_samp(op, br, buflen);
 
 	for (i = 0; i < nact; i++, ps++) {
 		if (ps->gen.tgid == ps->gen.pid && !ps->gen.isproc)
 			continue;
 		if (i > 0) {
-			output_samp(&defop, ", ", 2);
+			output_samp(op, ", ", 2);
 		}
 		buflen = snprintf(buf, sizeof(buf), "{\"pid\": %d, "
 			"\"utime\": %lld, "
@@ -1142,13 +1169,13 @@ static void json_print_PRC(int flags, char *hp, struct sstat *ss, struct tstat *
 			ps->cpu.rundelay/1000000,
 			ps->cpu.blkdelay*1000/hertz,
 			ps->cpu.sleepavg);
-		output_samp(&defop, buf, buflen);
+		output_samp(op, buf, buflen);
 	}
 
-	output_samp(&defop, "]", 1);
+	output_samp(op, "]", 1);
 }
 
-static void json_print_PRM(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_PRM(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int i;
 	int buflen = 0;
@@ -1156,13 +1183,13 @@ static void json_print_PRM(int flags, char *hp, struct sstat *ss, struct tstat *
 
         char br[LEN_HP_SIZE];
         buflen = sprintf(br, ", %s: [", hp);
-        output_samp(&defop, br, buflen);
+        output_samp(op, br, buflen);
 
 	for (i = 0; i < nact; i++, ps++) {
 		if (ps->gen.tgid == ps->gen.pid && !ps->gen.isproc)
 			continue;
 		if (i > 0) {
-			output_samp(&defop, ", ", 2);
+			output_samp(op, ", ", 2);
 		}
 		buflen = snprintf(buf, sizeof(buf), "{\"pid\": %d, "
 			"\"vmem\": %lld, "
@@ -1193,13 +1220,13 @@ static void json_print_PRM(int flags, char *hp, struct sstat *ss, struct tstat *
 			ps->mem.vswap,
 			ps->mem.pmem == (unsigned long long)-1LL ?
 			0:ps->mem.pmem);
-		output_samp(&defop, buf, buflen);
+		output_samp(op, buf, buflen);
 	}
 
-	output_samp(&defop, "]", 1);
+	output_samp(op, "]", 1);
 }
 
-static void json_print_PRD(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_PRD(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	int i;
 	int buflen = 0;
@@ -1207,13 +1234,13 @@ static void json_print_PRD(int flags, char *hp, struct sstat *ss, struct tstat *
 
         char br[LEN_HP_SIZE];
         buflen = sprintf(br, ", %s: [", hp);
-        output_samp(&defop, br, buflen);
+        output_samp(op, br, buflen);
 
 	for (i = 0; i < nact; i++, ps++) {
 		if (ps->gen.tgid == ps->gen.pid && !ps->gen.isproc)
 			continue;
 		if (i > 0) {
-			output_samp(&defop, ", ", 2);
+			output_samp(op, ", ", 2);
 		}
 		buflen = snprintf(buf, sizeof(buf), "{\"pid\": %d, "
 			"\"rio\": %lld, "
@@ -1224,13 +1251,13 @@ static void json_print_PRD(int flags, char *hp, struct sstat *ss, struct tstat *
 			ps->gen.pid,
 			ps->dsk.rio, ps->dsk.rsz,
 			ps->dsk.wio, ps->dsk.wsz, ps->dsk.cwsz);
-		output_samp(&defop, buf, buflen);
+		output_samp(op, buf, buflen);
 	}
 
-	output_samp(&defop, "]", 1);
+	output_samp(op, "]", 1);
 }
 
-static void json_print_PRN(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_PRN(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	if (!(flags & NETATOP))
 		return;
@@ -1241,13 +1268,13 @@ static void json_print_PRN(int flags, char *hp, struct sstat *ss, struct tstat *
 
         char br[LEN_HP_SIZE];
         buflen = sprintf(br, ", %s: [", hp);
-        output_samp(&defop, br, buflen);
+        output_samp(op, br, buflen);
 
 	for (i = 0; i < nact; i++, ps++) {
 		if (ps->gen.tgid == ps->gen.pid && !ps->gen.isproc)
 			continue;
 		if (i > 0) {
-			output_samp(&defop, ", ", 2);
+			output_samp(op, ", ", 2);
 		}
 		buflen = snprintf(buf, sizeof(buf), "{\"pid\": %d, "
 			"\"tcpsnd\": \"%lld\", "
@@ -1263,13 +1290,13 @@ static void json_print_PRN(int flags, char *hp, struct sstat *ss, struct tstat *
 			ps->net.tcprcv, ps->net.tcprsz,
 			ps->net.udpsnd, ps->net.udpssz,
 			ps->net.udprcv, ps->net.udprsz);
-		output_samp(&defop, buf, buflen);
+		output_samp(op, buf, buflen);
 	}
 
-	output_samp(&defop, "]", 1);
+	output_samp(op, "]", 1);
 }
 
-static void json_print_PRE(int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
+static void json_print_PRE(struct output *op, int flags, char *hp, struct sstat *ss, struct tstat *ps, int nact)
 {
 	if (!(flags & GPUSTAT) )
 		return;
@@ -1280,13 +1307,13 @@ static void json_print_PRE(int flags, char *hp, struct sstat *ss, struct tstat *
 
         char br[LEN_HP_SIZE];
         buflen = sprintf(br, ", %s: [", hp);
-        output_samp(&defop, br, buflen);
+        output_samp(op, br, buflen);
 
 	for (i = 0; i < nact; i++, ps++) {
 		if (ps->gen.tgid == ps->gen.pid && !ps->gen.isproc)
 			continue;
 		if (i > 0) {
-			output_samp(&defop, ", ", 2);
+			output_samp(op, ", ", 2);
 		}
 		buflen = snprintf(buf, sizeof(buf), "{\"pid\": %d, "
 			"\"gpustate\": \"%c\", "
@@ -1306,8 +1333,8 @@ static void json_print_PRE(int flags, char *hp, struct sstat *ss, struct tstat *
 			ps->gpu.memnow,
 			ps->gpu.memcum,
 			ps->gpu.sample);
-		output_samp(&defop, buf, buflen);
+		output_samp(op, buf, buflen);
 	}
 
-	output_samp(&defop, "]", 1);
+	output_samp(op, "]", 1);
 }
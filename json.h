@@ -15,7 +15,10 @@
 #include "photosyst.h"
 #include "photoproc.h"
 #include "connection.h"
+#include "output.h"
 
-int jsonout(int, char *, time_t, int, struct devtstat *, struct sstat *, int, unsigned int, char, connection* connection);
+void jsonprep(struct devtstat *, struct sstat *);
+int jsonlabels(const char *, unsigned int *);
+int jsonout(int, char *, time_t, int, struct devtstat *, struct sstat *, int, unsigned int, char, struct output *, connection* connection);
 
 #endif
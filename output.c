@@ -66,7 +66,8 @@ void output_samp_done(struct output *op, connection *conn)
 
 	if (op->output_type == OUTPUT_BUF)
 	{
-		memset(op->ob.buf, 0x00, op->ob.offset);
+		if (op->ob.buf)
+			memset(op->ob.buf, 0x00, op->ob.offset);
 		op->ob.offset = 0;
 	}
 }
@@ -0,0 +1,230 @@
+/*
+ * Copyright 2023 zhenwei pi
+ *
+ * Authors:
+ *   zhenwei pi <pizhenwei@bytedance.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+static struct pool *pools;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the pools of a thread are owned by its token, dropped by the key on exit */
+static __thread char pool_thread_token;
+static pthread_key_t pool_thread_key;
+static pthread_once_t pool_thread_once = PTHREAD_ONCE_INIT;
+
+/* the thread is exiting, its pools are freed with its TLS */
+static void pool_thread_exit(void *owner)
+{
+	struct pool **pprev, *pool;
+	void *obj;
+
+	pthread_mutex_lock(&pools_lock);
+	for (pprev = &pools; *pprev; ) {
+		pool = *pprev;
+		if (pool->owner != owner) {
+			pprev = &pool->next;
+			continue;
+		}
+
+		*pprev = pool->next;
+		while ((obj = pool->free_list)) {
+			pool->free_list = *(void **)obj;
+			free(obj);
+		}
+		pool->nr_free = 0;
+	}
+	pthread_mutex_unlock(&pools_lock);
+}
+
+static void pool_thread_key_create(void)
+{
+	pthread_key_create(&pool_thread_key, pool_thread_exit);
+}
+
+/* a thread registers its pool on the first allocation */
+static void pool_register(struct pool *pool)
+{
+	pthread_once(&pool_thread_once, pool_thread_key_create);
+	pthread_setspecific(pool_thread_key, &pool_thread_token);
+
+	pthread_mutex_lock(&pools_lock);
+	pool->next = pools;
+	pools = pool;
+	pool->owner = &pool_thread_token;
+	pthread_mutex_unlock(&pools_lock);
+}
+
+void *pool_alloc(struct pool *pool)
+{
+	void *obj = pool->free_list;
+
+	if (!pool->owner)
+		pool_register(pool);
+
+	pool->allocs++;
+	if (obj) {
+		pool->free_list = *(void **)obj;
+		pool->nr_free--;
+		pool->reuses++;
+		memset(obj, 0x00, pool->size);
+	} else {
+		obj = calloc(1, pool->size);
+		if (!obj)
+			return NULL;
+	}
+
+	pool->in_use++;
+	return obj;
+}
+
+void pool_free(struct pool *pool, void *obj)
+{
+	if (!obj)
+		return;
+
+	pool->in_use--;
+	if (pool->nr_free >= pool->max_free) {
+		free(obj);
+		return;
+	}
+
+	*(void **)obj = pool->free_list;
+	pool->free_list = obj;
+	pool->nr_free++;
+}
+
+int pool_stats(char *buf, size_t size)
+{
+	struct pool *pool, *prev;
+	int len, ret;
+
+	len = snprintf(buf, size, "\"pools\": [");
+
+	pthread_mutex_lock(&pools_lock);
+	for (pool = pools; pool; pool = pool->next) {
+		unsigned long allocs = 0, reuses = 0, in_use = 0, nr_free = 0;
+
+		/* the first one of the name sums up */
+		for (prev = pools; prev != pool; prev = prev->next) {
+			if (!strcmp(prev->name, pool->name))
+				break;
+		}
+		if (prev != pool)
+			continue;
+
+		for (prev = pool; prev; prev = prev->next) {
+			if (strcmp(prev->name, pool->name))
+				continue;
+
+			allocs += prev->allocs;
+			reuses += prev->reuses;
+			in_use += prev->in_use;
+			nr_free += prev->nr_free;
+		}
+
+		ret = snprintf(buf + len, len < size ? size - len : 0,
+			       "%s{\"name\": \"%s\", \"size\": %zu, \"allocs\": %lu, \"reuses\": %lu, \"in_use\": %lu, \"free\": %lu}",
+			       len > strlen("\"pools\": [") ? ", " : "", pool->name, pool->size, allocs, reuses, in_use, nr_free);
+		len += ret;
+	}
+	pthread_mutex_unlock(&pools_lock);
+
+	len += snprintf(buf + len, len < size ? size - len : 0, "]");
+
+	return len;
+}
+
+#ifdef POOL_TEST
+/*
+ * Build and run the test and the benchmark by:
+ * gcc -O2 -DPOOL_TEST pool.c -o pool_test -pthread && ./pool_test
+ */
+#include <assert.h>
+#include <time.h>
+
+#define POOL_TEST_LOOPS	(1024 * 1024)
+
+static long pool_test_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* a connection comes with a 4KB buffer, like httpd_client */
+static __thread struct pool test_pool = POOL_INITIALIZER("test", 4200, 2);
+
+static void *pool_test_thread(void *arg)
+{
+	char buf[1024];
+
+	pool_free(&test_pool, pool_alloc(&test_pool));
+	pool_stats(buf, sizeof(buf));
+	assert(strstr(buf, "\"allocs\": 6, \"reuses\": 1"));
+
+	return NULL;
+}
+
+int main()
+{
+	char buf[1024];
+	void *objs[4];
+	void *volatile sink;
+	long start, pool_ns, calloc_ns;
+
+	for (int i = 0; i < 4; i++) {
+		objs[i] = pool_alloc(&test_pool);
+		memset(objs[i], 0xff, test_pool.size);
+	}
+	for (int i = 0; i < 4; i++)
+		pool_free(&test_pool, objs[i]);
+
+	assert(test_pool.nr_free == 2);
+	assert(!test_pool.in_use);
+	objs[0] = pool_alloc(&test_pool);
+	assert(!((char *)objs[0])[100] && (test_pool.reuses == 1) && (test_pool.allocs == 5));
+	pool_free(&test_pool, objs[0]);
+
+	pool_stats(buf, sizeof(buf));
+	printf("%s\n", buf);
+	assert(strstr(buf, "\"name\": \"test\", \"size\": 4200, \"allocs\": 5, \"reuses\": 1"));
+
+	/* the pool of an exited thread is dropped */
+	pthread_t thread;
+	pthread_create(&thread, NULL, pool_test_thread, NULL);
+	pthread_join(thread, NULL);
+	pool_stats(buf, sizeof(buf));
+	assert(strstr(buf, "\"allocs\": 5, \"reuses\": 1"));
+
+	start = pool_test_now_ns();
+	for (int i = 0; i < POOL_TEST_LOOPS; i++) {
+		sink = pool_alloc(&test_pool);
+		pool_free(&test_pool, sink);
+	}
+	pool_ns = pool_test_now_ns() - start;
+
+	start = pool_test_now_ns();
+	for (int i = 0; i < POOL_TEST_LOOPS; i++) {
+		sink = calloc(1, test_pool.size);
+		free(sink);
+	}
+	calloc_ns = pool_test_now_ns() - start;
+
+	printf("pool %.1f ns/alloc, calloc %.1f ns/alloc\n", (double)pool_ns / POOL_TEST_LOOPS,
+	       (double)calloc_ns / POOL_TEST_LOOPS);
+
+	return 0;
+}
+#endif
@@ -0,0 +1,47 @@
+/*
+ * Copyright 2023 zhenwei pi
+ *
+ * Authors:
+ *   zhenwei pi <pizhenwei@bytedance.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stddef.h>
+
+/*
+ * Freelist of fixed size objects. A pool is used by a single thread only,
+ * declare it by __thread and POOL_INITIALIZER, an object is freed by the
+ * thread which allocated it. Freed objects are kept for the next allocation,
+ * up to @max_free. The pools of a thread are dropped once it exits.
+ */
+struct pool {
+	const char *name;
+	size_t size;
+	int max_free;
+	int nr_free;
+	void *free_list;
+	struct pool *next;	/* registered pools, for stats */
+	void *owner;		/* of the thread, see pool_register() */
+
+	/* read by other threads for stats, no lock */
+	unsigned long allocs;	/* by pool_alloc() */
+	unsigned long reuses;	/* served by free_list */
+	unsigned long in_use;
+};
+
+#define POOL_INITIALIZER(_name, _size, _max_free)	\
+	{ .name = _name, .size = _size, .max_free = _max_free }
+
+/* zeroed object, NULL on no memory */
+void *pool_alloc(struct pool *pool);
+void pool_free(struct pool *pool, void *obj);
+
+/* counters of all the pools summed by name, a JSON member, return the length */
+int pool_stats(char *buf, size_t size);
+
+#endif
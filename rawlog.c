@@ -16,6 +16,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
@@ -30,6 +31,8 @@
 #include "httpd.h"
 #include "json.h"
 #include "rawlog.h"
+#include "response.h"
+#include "sample.h"
 
 /* a little tricky: implemented in atop/version.c */
 unsigned short getnumvers(void);
@@ -52,9 +55,99 @@ static int rawlog_verify_rawheader(struct rawheader *rh)
 	return 0;
 }
 
+/*
+ * atop writes a record by several writes, the compressed parts follow the
+ * record header. Index it once all of them are written.
+ */
+static int rawlog_record_complete(struct rawrecord *rr, off_t off, struct stat *statbuf)
+{
+	return off + sizeof(*rr) + rr->scomplen + rr->pcomplen <= statbuf->st_size;
+}
+
+/*
+ * The index of a rawlog is saved to rawlog_index_dir by the same name, a
+ * restart loads it, and reads the records following the saved ones only.
+ * It's saved again once RAWLOG_INDEX_SAVE_RECORDS records are appended.
+ */
+#define RAWLOG_INDEX_SAVE_RECORDS	64
+
+char *rawlog_index_dir;
+static int rawlog_index_stopped;
+
+void rawlog_index_stop(void)
+{
+	__atomic_store_n(&rawlog_index_stopped, 1, __ATOMIC_RELAXED);
+}
+
+static int rawlog_index_path(const char *path, char *buf, size_t size)
+{
+	const char *name = strrchr(path, '/');
+
+	if (!rawlog_index_dir || __atomic_load_n(&rawlog_index_stopped, __ATOMIC_RELAXED))
+		return -ENOENT;
+
+	name = name ? name + 1 : path;
+	if (snprintf(buf, size, "%s/%s.idx", rawlog_index_dir, name) >= size)
+		return -ENAMETOOLONG;
+
+	return 0;
+}
+
+/* return the offset following the loaded records, or 0 to read all */
+static off_t rawlog_index_load(struct cache_t *cache, int fd, struct stat *statbuf)
+{
+	struct rawrecord rr;
+	char path[PATH_MAX];
+	off_t off;
+
+	if (rawlog_index_path(cache->name, path, sizeof(path)) || cache_file_load(cache, path, statbuf))
+		return 0;
+
+	/* the saved tail is still there, Ex, the rawlog is not rewritten */
+	off = cache_elem_off(cache, cache->nr_elems - 1);
+	if ((pread(fd, &rr, sizeof(rr), off) != sizeof(rr))
+	    || (rr.curtime != cache_elem_time(cache, cache->nr_elems - 1))
+	    || !rawlog_record_complete(&rr, off, statbuf)) {
+		log_debug("\"%s\" mismatches the rawlog, ignore it\n", path);
+		cache->nr_elems = cache->saved_elems = 0;
+		cache->next_off = 0;
+		return 0;
+	}
+
+	log_debug("\"%s\" has %d records\n", path, cache->nr_elems);
+	return cache->next_off;
+}
+
+static void rawlog_index_save(struct cache_t *cache, struct stat *statbuf)
+{
+	static int warned;
+	char path[PATH_MAX];
+	int ret;
+
+	if (cache->saved_elems && (cache->nr_elems - cache->saved_elems < RAWLOG_INDEX_SAVE_RECORDS))
+		return;
+
+	if (rawlog_index_path(cache->name, path, sizeof(path)))
+		return;
+
+	/* the index works without it, complain once */
+	ret = cache_file_save(cache, path, statbuf->st_ino);
+	if (ret && !warned) {
+		printf("%s: save \"%s\" failed: %s\n", __func__, path, strerror(-ret));
+		warned = 1;
+	}
+}
+
+static void rawlog_index_remove(const char *name)
+{
+	char path[PATH_MAX];
+
+	if (!rawlog_index_path(name, path, sizeof(path)))
+		unlink(path);
+}
+
 static int rawlog_rebuild_one(struct cache_t *cache)
 {
-	struct cache_elem_t *elem = &cache->elems[cache->nr_elems - 1];
 	struct rawrecord rr;
 	int ret = 0;
 
@@ -64,34 +157,36 @@ static int rawlog_rebuild_one(struct cache_t *cache)
 		return -errno;
 	}
 
-	off_t off = elem->off;
-	ssize_t len = pread(fd, &rr, sizeof(rr), off);
-	if (len < sizeof(rr))
+	struct stat statbuf;
+	ret = fstat(fd, &statbuf);
+	if (ret < 0) {
+		printf("%s: fstat \"%s\" failed: %m\n", __func__, cache->name);
+		ret = -errno;
 		goto close_fd;
+	}
 
-	off = off + sizeof(rr) + rr.scomplen + rr.pcomplen;
+	/* a record back in time is indexed before the later ones, resume by offset */
+	off_t off = cache->next_off;
+	ssize_t len;
 	while (1) {
 		len = pread(fd, &rr, sizeof(rr), off);
-		if (len < sizeof(rr))
+		if ((len < sizeof(rr)) || !rawlog_record_complete(&rr, off, &statbuf))
 			break;
 
-		cache_set(cache, rr.curtime, off);
+		if (cache_set(cache, rr.curtime, off)) {
+			printf("%s: \"%s\" has too large records to index @%ld\n", __func__, cache->name, off);
+			break;
+		}
 		off = off + sizeof(rr) + rr.scomplen + rr.pcomplen;
 	}
+	cache->next_off = off;
 
 	log_debug("\"%s\" has %d records of time[%ld - %ld]\n", cache->name,
-		cache->nr_elems, cache->elems[0].time, cache->elems[cache->nr_elems - 1].time);
-
-	struct stat statbuf;
-	ret = fstat(fd, &statbuf);
-	if (ret < 0) {
-		printf("%s: fstat \"%s\" failed: %m\n", __func__, cache->name);
-		ret = -errno;
-		goto close_fd;
-	}
+		cache->nr_elems, cache_elem_time(cache, 0), cache_elem_time(cache, cache->nr_elems - 1));
 
 	cache->st_size = statbuf.st_size;
 	cache->st_mtim = statbuf.st_mtim;
+	rawlog_index_save(cache, &statbuf);
 
 close_fd:
 	close(fd);
@@ -122,7 +217,7 @@ static int rawlog_parse_one(const char *path)
 			return 0;
 		}
 
-		return rawlog_rebuild_one(cache);
+		return rawlog_rebuild_one(cache_modify(cache));
 	}
 
 	fd = open(path, O_RDONLY);
@@ -131,11 +226,11 @@ static int rawlog_parse_one(const char *path)
 		return -errno;
 	}
 
-	/* 1, read rawheader */
+	/* 1, read rawheader, a new rawlog is being written if it's partial */
 	len = read(fd, &rh, sizeof(rh));
 	if (len < sizeof(rh)) {
-		printf("%s: \"%s\" is not atop rawlog file\n", __func__, path);
-		ret = -EINVAL;
+		log_debug("\"%s\" has no complete rawheader\n", path);
+		ret = -EAGAIN;
 		goto close_fd;
 	}
 
@@ -153,29 +248,36 @@ static int rawlog_parse_one(const char *path)
 	}
 	cache->flags = rh.supportflags;
 
-	/* 3, read all rawrecords, cache time&off mapping */
-	off = lseek(fd, 0, SEEK_CUR);
+	/* 3, update rawlog size & st_mtim */
+	ret = fstat(fd, &statbuf);
+	if (ret < 0) {
+		printf("%s: fstat \"%s\" failed", __func__, path);
+		ret = -errno;
+		goto free_cache;
+	}
+
+	/* 4, read all rawrecords, cache time&off mapping, or the unsaved ones */
+	off = rawlog_index_load(cache, fd, &statbuf);
+	if (!off)
+		off = lseek(fd, 0, SEEK_CUR);
 	if (off < 0) {
 		printf("%s: move offset failed\n", __func__);
 		ret = -errno;
-		goto close_fd;
+		goto free_cache;
 	}
 	while (1) {
 		len = pread(fd, &rr, sizeof(rr), off);
-		if (len < sizeof(rr))
+		if ((len < sizeof(rr)) || !rawlog_record_complete(&rr, off, &statbuf))
 			break;
 
-		cache_set(cache, rr.curtime, off);
+		if (cache_set(cache, rr.curtime, off)) {
+			printf("%s: \"%s\" has too large records to index @%ld\n", __func__, cache->name, off);
+			break;
+		}
 		off = off + sizeof(rr) + rr.scomplen + rr.pcomplen;
 	}
 
-	/* 4, update rawlog size & st_mtim */
-	ret = fstat(fd, &statbuf);
-	if (ret < 0) {
-		printf("%s: fstat \"%s\" failed", __func__, path);
-		ret = -errno;
-		goto close_fd;
-	}
+	cache->next_off = off;
 	cache->st_size = statbuf.st_size;
 	cache->st_mtim = statbuf.st_mtim;
 
@@ -183,7 +285,8 @@ static int rawlog_parse_one(const char *path)
 		goto free_cache;
 
 	log_debug("\"%s\" has %d records of time[%ld - %ld]\n", path, cache->nr_elems,
-		cache->elems[0].time, cache->elems[cache->nr_elems - 1].time);
+		cache_elem_time(cache, 0), cache_elem_time(cache, cache->nr_elems - 1));
+	rawlog_index_save(cache, &statbuf);
 	ret = 0;
 	goto close_fd;
 
@@ -215,34 +318,156 @@ int rawlog_parse_all(const char *path)
 		rawlog_parse_one(name);
 	}
 
-	cache_sort();
+	cache_publish();
 
 	closedir(dir);
 
 	return 0;
 }
 
+/* the rawlog of @name is gone, drop all of it */
+static void rawlog_forget(const char *name)
+{
+	cache_free(name);
+	rawlog_index_remove(name);
+	sample_forget(name);
+	response_forget(name);
+}
+
+#define RAWLOG_WATCH_EVENTS	(IN_MODIFY | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+				 IN_DELETE_SELF | IN_MOVE_SELF)
+
+int rawlog_watch(const char *path)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	char name[PATH_MAX];
+	struct inotify_event *event;
+	ssize_t len;
+	int fd, ret;
+
+	fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0) {
+		printf("%s: inotify init failed: %m\n", __func__);
+		return -errno;
+	}
+
+	if (inotify_add_watch(fd, path, RAWLOG_WATCH_EVENTS) < 0) {
+		printf("%s: watch \"%s\" failed: %m\n", __func__, path);
+		ret = -errno;
+		goto close_fd;
+	}
+
+	/* records written before watching */
+	rawlog_parse_all(path);
+
+	while (1) {
+		len = read(fd, buf, sizeof(buf));
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			printf("%s: read events failed: %m\n", __func__);
+			ret = -errno;
+			goto close_fd;
+		}
+
+		/* a batch of events, the index is published once */
+		for (char *p = buf; p < buf + len; p += sizeof(*event) + event->len) {
+			event = (struct inotify_event *)p;
+			if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+				printf("%s: \"%s\" is removed\n", __func__, path);
+				ret = -ENOENT;
+				goto close_fd;
+			}
+
+			/* events are lost, rescan all */
+			if (event->mask & IN_Q_OVERFLOW) {
+				rawlog_parse_all(path);
+				continue;
+			}
+
+			if (!event->len || (event->mask & IN_ISDIR))
+				continue;
+
+			snprintf(name, sizeof(name), "%s/%s", path, event->name);
+			if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+				rawlog_forget(name);
+				continue;
+			}
+
+			/* replaced by another file, Ex, renamed over it, parse it as a new one */
+			if ((event->mask & (IN_CREATE | IN_MOVED_TO)) && cache_find(name))
+				rawlog_forget(name);
+
+			rawlog_parse_one(name);
+		}
+
+		cache_publish();
+	}
+
+close_fd:
+	close(fd);
+	return ret;
+}
+
+time_t rawlog_recent_time(void)
+{
+	struct cache_t *cache = cache_get_recent(cache_index_get());
+	time_t ts = 0;
+
+	if (cache && cache->nr_elems)
+		ts = cache_elem_time(cache, cache->nr_elems - 1);
+
+	return ts;
+}
+
+/*
+ * Buffers to decode a record, kept by each worker for the next request. They
+ * grow to the largest record, which is about the same size all the time.
+ */
+struct rawlog_buf {
+	void *buf;
+	unsigned long size;
+};
+
+static __thread struct rawlog_buf rawlog_inbuf;
+static __thread struct rawlog_buf rawlog_sstat;
+static __thread struct rawlog_buf rawlog_taskall;
+static __thread struct rawlog_buf rawlog_procall;
+static __thread struct rawlog_buf rawlog_procactive;
+
+static void *rawlog_buf_get(struct rawlog_buf *rb, unsigned long size)
+{
+	/* at least 1 byte, the same as malloc(0) */
+	if (!size)
+		size = 1;
+
+	if (size <= rb->size)
+		return rb->buf;
+
+	/* no copy by realloc, the content is going to be overwritten */
+	free(rb->buf);
+	rb->buf = malloc(size);
+	rb->size = rb->buf ? size : 0;
+
+	return rb->buf;
+}
+
 static int rawlog_uncompress_record(int fd, void *outbuf, unsigned long *outlen, unsigned long inlen)
 {
 	Byte *inbuf;
-	int ret = 0;
 
-	inbuf = malloc(inlen);
+	inbuf = rawlog_buf_get(&rawlog_inbuf, inlen);
 	if (!inbuf)
 		return -ENOMEM;
 
-	if (read(fd, inbuf, inlen) != inlen) {
-		ret = -EIO;
-		goto free_buf;
-	}
+	if (read(fd, inbuf, inlen) != inlen)
+		return -EIO;
 
 	if (uncompress(outbuf, outlen, inbuf, inlen) != Z_OK)
-		ret = -ENODATA;
+		return -ENODATA;
 
-free_buf:
-	free(inbuf);
-
-	return ret;
+	return 0;
 }
 
 static int rawlog_get_sstat(int fd, struct sstat *sstat, unsigned long len)
@@ -252,43 +477,24 @@ static int rawlog_get_sstat(int fd, struct sstat *sstat, unsigned long len)
 	return rawlog_uncompress_record(fd, sstat, &outlen, len);
 }
 
-static void rawlog_free_devtstat(struct devtstat *devtstat)
-{
-	free(devtstat->taskall);
-	free(devtstat->procall);
-	free(devtstat->procactive);
-}
-
 static int rawlog_get_devtstat(int fd, struct devtstat *devtstat, struct rawrecord *rr)
 {
 	unsigned long outlen = sizeof(struct tstat) * rr->ndeviat;
 	int ret;
 	unsigned long ntaskall = 0, nprocall = 0, nprocactive = 0, ntaskactive = 0;
 
-	/* 1, allocate memory */
+	/* 1, get buffers of this worker */
 	memset(devtstat, 0x00, sizeof(struct devtstat));
-	devtstat->taskall = malloc(outlen);
-	if (!devtstat->taskall) {
-		ret = -ENOMEM;
-		goto free_devtstat;
-	}
-
-	devtstat->procall = malloc(sizeof(struct tstat*) * rr->totproc);
-	if (!devtstat->procall) {
-		ret = -ENOMEM;
-		goto free_devtstat;
-	}
-
-	devtstat->procactive = malloc(sizeof(struct tstat*) * rr->nactproc);
-	if (!devtstat->procactive) {
-		ret = -ENOMEM;
-		goto free_devtstat;
-	}
+	devtstat->taskall = rawlog_buf_get(&rawlog_taskall, outlen);
+	devtstat->procall = rawlog_buf_get(&rawlog_procall, sizeof(struct tstat*) * rr->totproc);
+	devtstat->procactive = rawlog_buf_get(&rawlog_procactive, sizeof(struct tstat*) * rr->nactproc);
+	if (!devtstat->taskall || !devtstat->procall || !devtstat->procactive)
+		return -ENOMEM;
 
 	/* 2, read record and uncompress */
 	ret = rawlog_uncompress_record(fd, devtstat->taskall, &outlen, rr->pcomplen);
 	if (ret)
-		goto free_devtstat;
+		return ret;
 
 	/* 3, build devtstat */
 	for ( ; ntaskall < rr->ndeviat; ntaskall++)
@@ -314,13 +520,7 @@ static int rawlog_get_devtstat(int fd, struct devtstat *devtstat, struct rawreco
 	devtstat->totslpu = rr->totslpu;
 	devtstat->totzombie = rr->totzomb;
 
-
 	return 0;
-
-free_devtstat:
-	rawlog_free_devtstat(devtstat);
-
-	return ret;
 }
 
 static int rawlog_record_flags(int hflags, int rflags)
@@ -353,53 +553,74 @@ static int rawlog_record_flags(int hflags, int rflags)
 	return ret;
 }
 
-int rawlog_get_record(time_t ts, char *labels, connection *conn)
+struct cache_t *rawlog_find_record(time_t ts, int dir, off_t *off)
 {
-	struct rawrecord rr;
-	struct sstat *sstat;
-	struct devtstat devtstat;
-	ssize_t len;
-	int fd;
-	int ret = 0;
-	int flags;
-	off_t off;
+	/* the snapshot is kept by this thread, rescan goes on meanwhile */
+	struct cache_index *index = cache_index_get();
+	struct cache_t *cache;
 	time_t recent_ts;
 
-	sstat = malloc(sizeof(struct sstat));
-	if (sstat == NULL) {
-		log_debug("can't alloc mem for sstat\n");
-		return -ENOMEM;
+	if (dir) {
+		cache = cache_get_nearest(index, ts, dir, off);
+		if (!cache)
+			return NULL;
+
+		goto found;
 	}
 
-	struct cache_t *cache = cache_get(ts, &off);
+	cache = cache_get(index, ts, off);
 	if (cache)
 		goto found;
 
 	log_debug("no record @%ld\n", ts);
 
-	cache = cache_get_recent();
-	if (!cache) {
-		ret = -EIO;
-		goto free_sstat;
-	}
+	cache = cache_get_recent(index);
+	if (!cache)
+		return NULL;
 
-	recent_ts = cache->elems[cache->nr_elems - 1].time;
-	if (ts < recent_ts) {
-		ret = -EIO;
-		goto free_sstat;
-	}
+	recent_ts = cache_elem_time(cache, cache->nr_elems - 1);
+	if (ts < recent_ts)
+		return NULL;
 
-	off = cache->elems[cache->nr_elems - 1].off;
-	log_debug("use recent @%ld from %s\n", cache->elems[cache->nr_elems - 1].time, cache->name);
+	*off = cache_elem_off(cache, cache->nr_elems - 1);
+	log_debug("use recent @%ld from %s\n", recent_ts, cache->name);
 
 found:
-	log_debug("time %ld, off %ld in %s\n", ts, off, cache->name);
+	log_debug("time %ld, off %ld in %s\n", ts, *off, cache->name);
+
+	return cache;
+}
+
+int rawlog_output_record(struct cache_t *cache, off_t off, char *labels, struct output *op, connection *conn)
+{
+	struct rawrecord rr;
+	struct sstat *sstat;
+	struct devtstat devtstat;
+	struct sample *sample;
+	ssize_t len;
+	int fd;
+	int ret = 0;
+	int flags;
+
+	/* decoded by any worker recently, Ex, the latest one */
+	sample = sample_get(cache->name, off);
+	if (sample) {
+		jsonout(sample->flags, labels, sample->curtime, sample->interval, sample->devtstat,
+			sample->sstat, sample->nexit, sample->noverflow, 0, op, conn);
+		sample_put(sample);
+		return 0;
+	}
+
+	sstat = rawlog_buf_get(&rawlog_sstat, sizeof(struct sstat));
+	if (sstat == NULL) {
+		log_debug("can't alloc mem for sstat\n");
+		return -ENOMEM;
+	}
 
 	fd = open(cache->name, O_RDONLY);
 	if (fd < 0) {
 		printf("%s: open \"%s\" failed: %m\n", __func__, cache->name);
-		ret = -errno;
-		goto free_sstat;
+		return -errno;
 	}
 
 	ret = lseek(fd, off, SEEK_CUR);
@@ -411,33 +632,50 @@ found:
 
 	len = read(fd, &rr, sizeof(rr));
 	if (len != sizeof(rr)) {
-		printf("%s: time %ld, off %ld in %s, incomplete record\n", __func__, ts, off, cache->name);
+		printf("%s: off %ld in %s, incomplete record\n", __func__, off, cache->name);
 		ret = -EIO;
 		goto close_fd;
 	}
-	log_debug("time %ld, off %ld in %s, rr.curtime %ld\n", ts, off, cache->name, rr.curtime);
+	log_debug("off %ld in %s, rr.curtime %ld\n", off, cache->name, rr.curtime);
 
 	ret = rawlog_get_sstat(fd, sstat, rr.scomplen);
 	if (ret) {
-		printf("%s: time %ld, off %ld in %s, get sstat failed\n", __func__, ts, off, cache->name);
+		printf("%s: off %ld in %s, get sstat failed\n", __func__, off, cache->name);
 		goto close_fd;
 	}
 
 	ret = rawlog_get_devtstat(fd, &devtstat, &rr);
 	if (ret) {
-		printf("%s: time %ld, off %ld in %s, get devtstat failed\n", __func__, ts, off, cache->name);
+		printf("%s: off %ld in %s, get devtstat failed\n", __func__, off, cache->name);
 		goto close_fd;
 	}
 
 	flags = rawlog_record_flags(cache->flags, rr.flags);
-	jsonout(flags, labels, rr.curtime, rr.interval, &devtstat, sstat, rr.nexit, rr.noverflow, 0, conn);
+	close(fd);
+
+	jsonprep(&devtstat, sstat);
+	/* the last record of a rawlog is polled, the others are mostly asked once */
+	sample_add(cache->name, off, &rr, flags, sstat, &devtstat,
+		   off == cache_elem_off(cache, cache->nr_elems - 1));
+
+	jsonout(flags, labels, rr.curtime, rr.interval, &devtstat, sstat, rr.nexit, rr.noverflow, 0, op, conn);
 
-	rawlog_free_devtstat(&devtstat);
+	return 0;
 
 close_fd:
 	close(fd);
-free_sstat:
-	free(sstat);
 
 	return ret;
 }
+
+int rawlog_get_record(time_t ts, char *labels, struct output *op, connection *conn)
+{
+	struct cache_t *cache;
+	off_t off;
+
+	cache = rawlog_find_record(ts, 0, &off);
+	if (!cache)
+		return -EIO;
+
+	return rawlog_output_record(cache, off, labels, op, conn);
+}
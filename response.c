@@ -0,0 +1,376 @@
+/*
+ * Copyright 2023 zhenwei pi
+ *
+ * Authors:
+ *   zhenwei pi <pizhenwei@bytedance.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "response.h"
+
+#define RESPONSE_HASH_SIZE	1024
+
+struct response_config response_config = {
+	.max_size = DEFAULT_RESPONSE_CACHE << 20,
+};
+
+/* a response is referenced by the cache, and by the queued chunks sending it */
+static pthread_mutex_t response_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct response *response_hash[RESPONSE_HASH_SIZE];
+static struct response response_lru = { .prev = &response_lru, .next = &response_lru };
+static size_t response_size;
+static unsigned long nr_responses;
+static unsigned long response_hits, response_misses, response_evicts;
+
+static unsigned int response_hash_key(const struct response_key *key)
+{
+	unsigned int hash = key->off ^ (key->off >> 32);
+	const char *name = key->name;
+
+	hash = hash * 31 + key->labels;
+	while (*name)
+		hash = hash * 31 + *name++;
+
+	return hash % RESPONSE_HASH_SIZE;
+}
+
+static int response_key_equal(const struct response_key *a, const struct response_key *b)
+{
+	return (a->off == b->off) && (a->labels == b->labels) && (a->hidecmdline == b->hidecmdline)
+	       && !strcmp(a->encoding, b->encoding) && !strcmp(a->name, b->name);
+}
+
+static void response_free(struct response *resp)
+{
+	free((char *)resp->key.name);
+	if (resp->fd >= 0) {
+		munmap(resp->body, resp->len);
+		close(resp->fd);
+	} else {
+		free(resp->body);
+	}
+	free(resp);
+}
+
+/* move @body into a sealed memfd, and map it. Return the fd or -errno */
+static int response_memfd(struct response *resp, char *body, size_t len)
+{
+	size_t offset = 0;
+	ssize_t ret;
+	void *map;
+	int fd;
+
+	fd = memfd_create("atophttpd-response", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return -errno;
+
+	while (offset < len) {
+		ret = write(fd, body + offset, len - offset);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			goto close_fd;
+		}
+
+		offset += ret;
+	}
+
+	/* the body is immutable from now on, sendfile never sees a partial one */
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL))
+		goto close_fd;
+
+	map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+		goto close_fd;
+
+	free(body);
+	resp->body = map;
+	resp->fd = fd;
+
+	return fd;
+
+close_fd:
+	ret = -errno;
+	close(fd);
+	return ret;
+}
+
+void response_put(struct response *resp)
+{
+	if (__atomic_sub_fetch(&resp->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	response_free(resp);
+}
+
+static struct response *response_lookup(const struct response_key *key)
+{
+	struct response *resp = response_hash[response_hash_key(key)];
+
+	for ( ; resp; resp = resp->hash_next) {
+		if (response_key_equal(&resp->key, key))
+			return resp;
+	}
+
+	return NULL;
+}
+
+static void response_lru_del(struct response *resp)
+{
+	resp->prev->next = resp->next;
+	resp->next->prev = resp->prev;
+}
+
+static void response_lru_add(struct response *resp)
+{
+	resp->next = response_lru.next;
+	resp->prev = &response_lru;
+	response_lru.next->prev = resp;
+	response_lru.next = resp;
+}
+
+/* drop it from the cache, the caller puts it out of the lock */
+static void response_unlink(struct response *resp)
+{
+	struct response **pprev = &response_hash[response_hash_key(&resp->key)];
+
+	while (*pprev != resp)
+		pprev = &(*pprev)->hash_next;
+	*pprev = resp->hash_next;
+
+	response_lru_del(resp);
+	response_size -= resp->size;
+	nr_responses--;
+}
+
+static void response_put_list(struct response *list)
+{
+	struct response *resp;
+
+	while (list) {
+		resp = list;
+		list = list->hash_next;
+		response_put(resp);
+	}
+}
+
+struct response *response_get(const struct response_key *key)
+{
+	struct response *resp;
+
+	if (!response_config.max_size)
+		return NULL;
+
+	pthread_mutex_lock(&response_lock);
+	resp = response_lookup(key);
+	if (resp) {
+		response_lru_del(resp);
+		response_lru_add(resp);
+		__atomic_add_fetch(&resp->refs, 1, __ATOMIC_RELAXED);
+		response_hits++;
+	} else {
+		response_misses++;
+	}
+	pthread_mutex_unlock(&response_lock);
+
+	return resp;
+}
+
+struct response *response_add(const struct response_key *key, char *body, size_t len)
+{
+	struct response *resp, *cached, *evicted = NULL;
+	size_t size;
+
+	size = sizeof(struct response) + strlen(key->name) + 1 + len;
+	if (size > response_config.max_size)
+		return NULL;
+
+	resp = calloc(1, sizeof(*resp));
+	if (!resp)
+		return NULL;
+
+	resp->key = *key;
+	resp->key.name = strdup(key->name);
+	if (!resp->key.name) {
+		free(resp);
+		return NULL;
+	}
+
+	resp->body = body;
+	resp->len = len;
+	resp->size = size;
+	resp->fd = -1;
+	resp->refs = 2;		/* one for the cache, one for the caller */
+
+	/* it's sent from memory if memfd fails */
+	if (len >= RESPONSE_MEMFD_MIN)
+		response_memfd(resp, body, len);
+
+	pthread_mutex_lock(&response_lock);
+	/* another worker rendered it meanwhile, send that one */
+	cached = response_lookup(key);
+	if (cached) {
+		__atomic_add_fetch(&cached->refs, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&response_lock);
+		response_free(resp);
+		return cached;
+	}
+
+	resp->hash_next = response_hash[response_hash_key(key)];
+	response_hash[response_hash_key(key)] = resp;
+	response_lru_add(resp);
+	response_size += size;
+	nr_responses++;
+
+	while (response_size > response_config.max_size) {
+		struct response *victim = response_lru.prev;
+
+		response_unlink(victim);
+		victim->hash_next = evicted;
+		evicted = victim;
+		response_evicts++;
+	}
+	pthread_mutex_unlock(&response_lock);
+
+	response_put_list(evicted);
+
+	return resp;
+}
+
+void response_forget(const char *name)
+{
+	struct response *resp, *next, *forgotten = NULL;
+
+	pthread_mutex_lock(&response_lock);
+	for (resp = response_lru.next; resp != &response_lru; resp = next) {
+		next = resp->next;
+		if (strcmp(resp->key.name, name))
+			continue;
+
+		response_unlink(resp);
+		resp->hash_next = forgotten;
+		forgotten = resp;
+	}
+	pthread_mutex_unlock(&response_lock);
+
+	response_put_list(forgotten);
+}
+
+int response_stats(char *buf, size_t size)
+{
+	int len;
+
+	pthread_mutex_lock(&response_lock);
+	len = snprintf(buf, size, "\"responses\": {\"max_size\": %zu, \"size\": %zu, \"nr\": %lu, "
+		       "\"hits\": %lu, \"misses\": %lu, \"evicts\": %lu}",
+		       response_config.max_size, response_size, nr_responses,
+		       response_hits, response_misses, response_evicts);
+	pthread_mutex_unlock(&response_lock);
+
+	return len;
+}
+
+#ifdef RESPONSE_TEST
+/*
+ * gcc -O2 -DRESPONSE_TEST response.c -o response_test -pthread && ./response_test
+ */
+#include <assert.h>
+
+static char *body(const char *s)
+{
+	return strdup(s);
+}
+
+int main()
+{
+	struct response_key key = { .name = "a", .off = 0, .labels = 1, .encoding = "" };
+	struct response_key other;
+	struct response *resp, *held;
+	char *dup;
+	size_t one;
+	char buf[256];
+
+	assert(!response_get(&key));
+	resp = response_add(&key, body("{}"), 2);
+	assert(resp && (resp->len == 2) && !strcmp(resp->body, "{}"));
+	response_put(resp);
+
+	resp = response_get(&key);
+	assert(resp && !memcmp(resp->body, "{}", 2));
+	held = resp;
+	one = response_size;
+
+	/* any field of the key makes a different body */
+	other = key;
+	other.labels = 3;
+	assert(!response_get(&other));
+	other = key;
+	other.encoding = "Content-Encoding: deflate\r\n";
+	assert(!response_get(&other));
+	other = key;
+	other.hidecmdline = 1;
+	assert(!response_get(&other));
+	other = key;
+	other.name = "b";
+	assert(!response_get(&other));
+
+	/* rendered by two workers at the same time, both send the first one */
+	dup = body("{}");
+	resp = response_add(&key, dup, 2);
+	assert(resp == held);
+	response_put(resp);
+	assert(nr_responses == 1);
+
+	/* a body larger than the cache is left to the caller */
+	response_config.max_size = one * 2;
+	dup = malloc(one * 2);
+	assert(!response_add(&other, dup, one * 2));
+	free(dup);
+
+	/* up to 2 responses, the least recently used one goes */
+	key.off = 1;
+	response_put(response_add(&key, body("{}"), 2));
+	key.off = 0;
+	response_put(response_get(&key));
+	key.off = 2;
+	response_put(response_add(&key, body("{}"), 2));
+	assert(nr_responses == 2);
+	key.off = 1;
+	assert(!response_get(&key));
+
+	/* a connection still sends the evicted or forgotten one */
+	response_forget("a");
+	assert(!nr_responses && !response_size);
+	assert(!memcmp(held->body, "{}", 2));
+	response_put(held);
+
+	/* a large body is moved into memfd, it reads the same */
+	response_config.max_size = RESPONSE_MEMFD_MIN * 4;
+	dup = malloc(RESPONSE_MEMFD_MIN);
+	memset(dup, 'x', RESPONSE_MEMFD_MIN);
+	resp = response_add(&key, dup, RESPONSE_MEMFD_MIN);
+	assert(resp && (resp->fd >= 0) && (resp->body[RESPONSE_MEMFD_MIN - 1] == 'x'));
+	assert(pread(resp->fd, buf, 1, RESPONSE_MEMFD_MIN - 1) == 1 && (buf[0] == 'x'));
+	response_put(resp);
+	response_forget("a");
+
+	response_stats(buf, sizeof(buf));
+	printf("%s\n", buf);
+	assert(strstr(buf, "\"hits\": 2, \"misses\": 6, \"evicts\": 1"));
+
+	return 0;
+}
+#endif
@@ -0,0 +1,70 @@
+/*
+ * Copyright 2023 zhenwei pi
+ *
+ * Authors:
+ *   zhenwei pi <pizhenwei@bytedance.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef _RESPONSE_H_
+#define _RESPONSE_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * A record never changes once it's written, so does its rendered body. A
+ * dashboard asks for the same labels of the latest sample again and again,
+ * it's rendered and compressed once, then the connections send the same body.
+ * A large body is kept in a sealed memfd, and sent by sendfile, its pages go to
+ * the socket without copying. It's mapped for the ones sending it from memory,
+ * Ex, TLS and HTTP/2.
+ */
+struct response_key {
+	const char *name;	/* of the rawlog */
+	off_t off;		/* of the record */
+	unsigned int labels;	/* by jsonlabels() */
+	char *encoding;		/* the Content-Encoding header, a static string */
+	int hidecmdline;
+};
+
+struct response {
+	struct response_key key;	/* name is a copy */
+	char *body;
+	size_t len;
+	int fd;				/* the sealed memfd of body, or -1 */
+	size_t size;
+	int refs;
+	struct response *prev, *next;	/* LRU list */
+	struct response *hash_next;
+};
+
+struct response_config {
+	size_t max_size;	/* in bytes, 0 disables */
+};
+
+#define DEFAULT_RESPONSE_CACHE	32	/* MB */
+#define RESPONSE_MEMFD_MIN	(64 * 1024)	/* keep a larger body in memfd */
+
+extern struct response_config response_config;
+
+/* the cached body of @key, response_put() it once it's sent */
+struct response *response_get(const struct response_key *key);
+void response_put(struct response *resp);
+
+/*
+ * Cache @body of @len bytes allocated by malloc, the response takes @body
+ * and it's returned referenced. NULL if it's not cached, @body is left to
+ * the caller then.
+ */
+struct response *response_add(const struct response_key *key, char *body, size_t len);
+
+/* the rawlog @name is removed */
+void response_forget(const char *name);
+
+/* counters in JSON, return the length */
+int response_stats(char *buf, size_t size);
+
+#endif
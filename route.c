@@ -0,0 +1,282 @@
+/*
+ * Copyright 2023 zhenwei pi
+ *
+ * Authors:
+ *   zhenwei pi <pizhenwei@bytedance.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "route.h"
+
+#define ROUTE_TABLE_MIN_SLOTS	64
+
+/*
+ * Open addressing hash table, keep the load factor under 1/2 so a lookup
+ * usually hits in the first slot. It's built at start up, then it's read only
+ * and shared by all the workers.
+ */
+struct route_slot {
+	uint32_t hash;
+	size_t len;
+	struct route *route;
+};
+
+struct route_table {
+	struct route_slot *slots;
+	unsigned int mask;
+	int nr_routes;
+};
+
+/* FNV-1a */
+static uint32_t route_hash(const char *path, size_t len)
+{
+	uint32_t hash = 2166136261u;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)path[i];
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+static struct route_slot *route_slot_find(struct route_table *table, uint32_t hash, const char *path, size_t len)
+{
+	struct route_slot *slot;
+
+	for (unsigned int i = hash; ; i++) {
+		slot = &table->slots[i & table->mask];
+		if (!slot->route)
+			return slot;
+
+		if ((slot->hash == hash) && (slot->len == len) && !memcmp(slot->route->path, path, len))
+			return slot;
+	}
+}
+
+static int route_table_grow(struct route_table *table)
+{
+	struct route_slot *slots = table->slots;
+	unsigned int nr_slots = table->mask + 1;
+	struct route_slot *slot;
+
+	table->slots = calloc(nr_slots * 2, sizeof(struct route_slot));
+	if (!table->slots) {
+		table->slots = slots;
+		return -ENOMEM;
+	}
+
+	table->mask = nr_slots * 2 - 1;
+	for (unsigned int i = 0; i < nr_slots; i++) {
+		if (!slots[i].route)
+			continue;
+
+		slot = route_slot_find(table, slots[i].hash, slots[i].route->path, slots[i].len);
+		*slot = slots[i];
+	}
+
+	free(slots);
+	return 0;
+}
+
+struct route_table *route_table_create(void)
+{
+	struct route_table *table = calloc(1, sizeof(struct route_table));
+
+	if (!table)
+		return NULL;
+
+	table->slots = calloc(ROUTE_TABLE_MIN_SLOTS, sizeof(struct route_slot));
+	if (!table->slots) {
+		free(table);
+		return NULL;
+	}
+
+	table->mask = ROUTE_TABLE_MIN_SLOTS - 1;
+	return table;
+}
+
+void route_table_destroy(struct route_table *table)
+{
+	free(table->slots);
+	free(table);
+}
+
+int route_register(struct route_table *table, struct route *route)
+{
+	size_t len = strlen(route->path);
+	uint32_t hash = route_hash(route->path, len);
+	struct route_slot *slot;
+
+	if ((table->nr_routes + 1) * 2 > table->mask + 1) {
+		if (route_table_grow(table))
+			return -ENOMEM;
+	}
+
+	slot = route_slot_find(table, hash, route->path, len);
+	if (slot->route)
+		return -EEXIST;
+
+	slot->hash = hash;
+	slot->len = len;
+	slot->route = route;
+	table->nr_routes++;
+
+	return 0;
+}
+
+int route_register_all(struct route_table *table, struct route *routes, int nr_routes)
+{
+	int ret;
+
+	for (int i = 0; i < nr_routes; i++) {
+		ret = route_register(table, &routes[i]);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+struct route *route_lookup(struct route_table *table, int method, const char *path, size_t len)
+{
+	struct route_slot *slot = route_slot_find(table, route_hash(path, len), path, len);
+
+	if (!slot->route || !(slot->route->methods & method))
+		return NULL;
+
+	return slot->route;
+}
+
+int route_dispatch(struct route_table *table, int method, void *ctx, struct http_request *req, connection *conn)
+{
+	struct route *route = route_lookup(table, method, req->path.ptr, req->path.len);
+
+	if (!route)
+		return -ENOENT;
+
+	route->handler(route, ctx, req, conn);
+	return 0;
+}
+
+#ifdef ROUTE_TEST
+/*
+ * Build and run the test and the benchmark of dispatch cost by:
+ * gcc -O2 -DROUTE_TEST route.c http_parser.c -o route_test && ./route_test
+ */
+#include <assert.h>
+#include <stdio.h>
+#include <time.h>
+
+#define ROUTE_TEST_LOOKUPS	(4 * 1024 * 1024)
+
+static int handled;
+
+static void route_test_handler(struct route *route, void *ctx, struct http_request *req, connection *conn)
+{
+	handled++;
+}
+
+static long route_test_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* dispatch cost of the hash table and a strcmp chain with @nr_routes routes */
+static void route_bench(int nr_routes)
+{
+	struct route_table *table = route_table_create();
+	struct route *routes = calloc(nr_routes, sizeof(struct route));
+	struct http_request *reqs = calloc(nr_routes, sizeof(struct http_request));
+	volatile int found = 0;
+	long start, hash_ns, chain_ns;
+
+	for (int i = 0; i < nr_routes; i++) {
+		char path[64];
+
+		snprintf(path, sizeof(path), "template/html/endpoint_%d.html", i);
+		routes[i].path = strdup(path);
+		routes[i].methods = ROUTE_GET;
+		routes[i].handler = route_test_handler;
+		reqs[i].path.ptr = routes[i].path;
+		reqs[i].path.len = strlen(path);
+	}
+
+	assert(!route_register_all(table, routes, nr_routes));
+
+	/* visit the routes in a stride, don't let the hardware prefetch help */
+	start = route_test_now_ns();
+	for (int i = 0, idx = 0; i < ROUTE_TEST_LOOKUPS; i++, idx = (idx + 7919) % nr_routes)
+		route_dispatch(table, ROUTE_GET, NULL, &reqs[idx], NULL);
+	hash_ns = route_test_now_ns() - start;
+
+	start = route_test_now_ns();
+	for (int i = 0, idx = 0; i < ROUTE_TEST_LOOKUPS; i++, idx = (idx + 7919) % nr_routes) {
+		struct http_slice *path = &reqs[idx].path;
+
+		for (int j = 0; j < nr_routes; j++) {
+			if (!strncmp(routes[j].path, path->ptr, path->len) && !routes[j].path[path->len]) {
+				found++;
+				break;
+			}
+		}
+	}
+	chain_ns = route_test_now_ns() - start;
+
+	printf("%6d routes: hash %6.1f ns/dispatch, strcmp chain %8.1f ns/dispatch\n",
+	       nr_routes, (double)hash_ns / ROUTE_TEST_LOOKUPS, (double)chain_ns / ROUTE_TEST_LOOKUPS);
+
+	for (int i = 0; i < nr_routes; i++)
+		free(routes[i].path);
+	free(routes);
+	free(reqs);
+	route_table_destroy(table);
+}
+
+int main()
+{
+	struct route routes[] = {
+		{ "", ROUTE_GET, route_test_handler, NULL },
+		{ "ping", ROUTE_GET, route_test_handler, NULL },
+		{ "showsamp", ROUTE_GET, route_test_handler, NULL },
+	};
+	struct route dup = { "ping", ROUTE_GET, route_test_handler, NULL };
+	struct route_table *table = route_table_create();
+	struct http_request req;
+	const char *bufs[] = {
+		"GET / HTTP/1.1\r\n\r\n",
+		"GET /?x=1 HTTP/1.1\r\n\r\n",
+		"GET /showsamp?lables=ALL HTTP/1.1\r\n\r\n",
+		"GET /showsam HTTP/1.1\r\n\r\n",
+	};
+
+	assert(!route_register_all(table, routes, 3));
+	assert(route_register(table, &dup) == -EEXIST);
+	assert(route_lookup(table, ROUTE_GET, "ping", 4) == &routes[1]);
+	assert(route_lookup(table, ROUTE_GET, "pingx", 4) == &routes[1]);
+	assert(!route_lookup(table, ROUTE_GET, "pin", 3));
+	assert(!route_lookup(table, 0, "ping", 4));
+	for (int i = 0; i < 4; i++) {
+		http_request_reset(&req);
+		assert(http_parse_request(&req, bufs[i], strlen(bufs[i])) > 0);
+		assert(route_dispatch(table, ROUTE_GET, NULL, &req, NULL) == (i < 3 ? 0 : -ENOENT));
+	}
+	assert(handled == 3);
+	route_table_destroy(table);
+
+	for (int nr_routes = 8; nr_routes <= 4096; nr_routes *= 4)
+		route_bench(nr_routes);
+
+	return 0;
+}
+#endif
@@ -0,0 +1,49 @@
+/*
+ * Copyright 2023 zhenwei pi
+ *
+ * Authors:
+ *   zhenwei pi <pizhenwei@bytedance.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef _ROUTE_H_
+#define _ROUTE_H_
+
+#include <stddef.h>
+
+#include "connection.h"
+#include "http_parser.h"
+
+/* methods of a route, bitmask */
+#define ROUTE_GET	(1 << 0)
+
+struct route;
+
+/* @ctx is the argument of route_dispatch() */
+typedef void (*route_handler)(struct route *route, void *ctx, struct http_request *req, connection *conn);
+
+struct route {
+	char *path;		/* without leading '/' and query */
+	int methods;
+	route_handler handler;
+	void *data;		/* for handler, Ex, a static asset */
+};
+
+struct route_table;
+
+struct route_table *route_table_create(void);
+void route_table_destroy(struct route_table *table);
+
+/* the table refers @route, so it must outlive the table */
+int route_register(struct route_table *table, struct route *route);
+int route_register_all(struct route_table *table, struct route *routes, int nr_routes);
+
+/* @path is not necessarily null terminated, NULL if no route matches */
+struct route *route_lookup(struct route_table *table, int method, const char *path, size_t len);
+
+/* route @req to its handler by the path, return -ENOENT if no route matches */
+int route_dispatch(struct route_table *table, int method, void *ctx, struct http_request *req, connection *conn);
+
+#endif
@@ -0,0 +1,353 @@
+/*
+ * Copyright 2023 zhenwei pi
+ *
+ * Authors:
+ *   zhenwei pi <pizhenwei@bytedance.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "atop.h"
+#include "photoproc.h"
+#include "photosyst.h"
+#include "rawlog.h"
+#include "sample.h"
+
+#define SAMPLE_HASH_SIZE	256
+#define SAMPLE_SEEN_SIZE	1024
+
+struct sample_config sample_config = {
+	.max_size = DEFAULT_SAMPLE_CACHE << 20,
+};
+
+/* a sample is referenced by the cache, and by the workers using it */
+static pthread_mutex_t sample_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sample *sample_hash[SAMPLE_HASH_SIZE];
+static struct sample sample_lru = { .prev = &sample_lru, .next = &sample_lru };
+static size_t sample_size;
+static unsigned long nr_samples;
+static unsigned long sample_hits, sample_misses, sample_evicts, sample_skips;
+/* hashes of the samples missed once, a history record is mostly asked once */
+static unsigned int sample_seen[SAMPLE_SEEN_SIZE];
+
+static unsigned int sample_hash_full(const char *name, off_t off)
+{
+	unsigned int hash = off ^ (off >> 32);
+
+	while (*name)
+		hash = hash * 31 + *name++;
+
+	return hash;
+}
+
+static unsigned int sample_hash_key(const char *name, off_t off)
+{
+	return sample_hash_full(name, off) % SAMPLE_HASH_SIZE;
+}
+
+/* missed before, forget it then. Or remember it for the next miss */
+static int sample_seen_again(const char *name, off_t off)
+{
+	unsigned int hash = sample_hash_full(name, off) | 1;
+	unsigned int *seen = &sample_seen[hash % SAMPLE_SEEN_SIZE];
+	int ret = 1;
+
+	pthread_mutex_lock(&sample_lock);
+	if (*seen == hash) {
+		*seen = 0;
+	} else {
+		*seen = hash;
+		sample_skips++;
+		ret = 0;
+	}
+	pthread_mutex_unlock(&sample_lock);
+
+	return ret;
+}
+
+static void sample_free(struct sample *sample)
+{
+	if (sample->devtstat) {
+		free(sample->devtstat->procactive);
+		free(sample->devtstat->procall);
+		free(sample->devtstat->taskall);
+		free(sample->devtstat);
+	}
+	free(sample->sstat);
+	free(sample->name);
+	free(sample);
+}
+
+void sample_put(struct sample *sample)
+{
+	if (__atomic_sub_fetch(&sample->refs, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	sample_free(sample);
+}
+
+static struct sample *sample_lookup(const char *name, off_t off)
+{
+	struct sample *sample = sample_hash[sample_hash_key(name, off)];
+
+	for ( ; sample; sample = sample->hash_next) {
+		if ((sample->off == off) && !strcmp(sample->name, name))
+			return sample;
+	}
+
+	return NULL;
+}
+
+static void sample_lru_del(struct sample *sample)
+{
+	sample->prev->next = sample->next;
+	sample->next->prev = sample->prev;
+}
+
+static void sample_lru_add(struct sample *sample)
+{
+	sample->next = sample_lru.next;
+	sample->prev = &sample_lru;
+	sample_lru.next->prev = sample;
+	sample_lru.next = sample;
+}
+
+/* drop it from the cache, the caller puts it out of the lock */
+static void sample_unlink(struct sample *sample)
+{
+	struct sample **pprev = &sample_hash[sample_hash_key(sample->name, sample->off)];
+
+	while (*pprev != sample)
+		pprev = &(*pprev)->hash_next;
+	*pprev = sample->hash_next;
+
+	sample_lru_del(sample);
+	sample_size -= sample->size;
+	nr_samples--;
+}
+
+struct sample *sample_get(const char *name, off_t off)
+{
+	struct sample *sample;
+
+	if (!sample_config.max_size)
+		return NULL;
+
+	pthread_mutex_lock(&sample_lock);
+	sample = sample_lookup(name, off);
+	if (sample) {
+		sample_lru_del(sample);
+		sample_lru_add(sample);
+		__atomic_add_fetch(&sample->refs, 1, __ATOMIC_RELAXED);
+		sample_hits++;
+	} else {
+		sample_misses++;
+	}
+	pthread_mutex_unlock(&sample_lock);
+
+	return sample;
+}
+
+static struct sample *sample_copy(const char *name, off_t off, struct rawrecord *rr, int flags,
+				  struct sstat *sstat, struct devtstat *devtstat)
+{
+	struct devtstat *dst;
+	struct sample *sample;
+
+	sample = calloc(1, sizeof(*sample));
+	if (!sample)
+		return NULL;
+
+	sample->name = strdup(name);
+	sample->off = off;
+	sample->curtime = rr->curtime;
+	sample->interval = rr->interval;
+	sample->nexit = rr->nexit;
+	sample->noverflow = rr->noverflow;
+	sample->flags = flags;
+	sample->refs = 1;
+	sample->sstat = malloc(sizeof(struct sstat));
+
+	/* the pointers of procall and procactive point to the copied taskall */
+	dst = sample->devtstat = malloc(sizeof(struct devtstat));
+	if (!dst) {
+		sample_free(sample);
+		return NULL;
+	}
+
+	*dst = *devtstat;
+	dst->taskall = malloc(sizeof(struct tstat) * (devtstat->ntaskall ? devtstat->ntaskall : 1));
+	dst->procall = malloc(sizeof(struct tstat *) * (devtstat->nprocall ? devtstat->nprocall : 1));
+	dst->procactive = malloc(sizeof(struct tstat *) * (devtstat->nprocactive ? devtstat->nprocactive : 1));
+	if (!sample->name || !sample->sstat || !dst->taskall || !dst->procall || !dst->procactive) {
+		sample_free(sample);
+		return NULL;
+	}
+
+	memcpy(sample->sstat, sstat, sizeof(struct sstat));
+	memcpy(dst->taskall, devtstat->taskall, sizeof(struct tstat) * devtstat->ntaskall);
+	for (int i = 0; i < devtstat->nprocall; i++)
+		dst->procall[i] = dst->taskall + (devtstat->procall[i] - devtstat->taskall);
+	for (int i = 0; i < devtstat->nprocactive; i++)
+		dst->procactive[i] = dst->taskall + (devtstat->procactive[i] - devtstat->taskall);
+
+	return sample;
+}
+
+void sample_add(const char *name, off_t off, struct rawrecord *rr, int flags,
+		struct sstat *sstat, struct devtstat *devtstat, int latest)
+{
+	struct sample *sample, *evicted = NULL;
+	size_t size;
+
+	size = sizeof(struct sample) + strlen(name) + 1 + sizeof(struct sstat) + sizeof(struct devtstat)
+	       + sizeof(struct tstat) * devtstat->ntaskall
+	       + sizeof(struct tstat *) * (devtstat->nprocall + devtstat->nprocactive);
+	if (size > sample_config.max_size)
+		return;
+
+	if (!latest && !sample_seen_again(name, off))
+		return;
+
+	/* copy out of the lock, it's about a few MB */
+	sample = sample_copy(name, off, rr, flags, sstat, devtstat);
+	if (!sample)
+		return;
+	sample->size = size;
+
+	pthread_mutex_lock(&sample_lock);
+	/* another worker decoded it meanwhile */
+	if (sample_lookup(name, off)) {
+		pthread_mutex_unlock(&sample_lock);
+		sample_put(sample);
+		return;
+	}
+
+	sample->hash_next = sample_hash[sample_hash_key(name, off)];
+	sample_hash[sample_hash_key(name, off)] = sample;
+	sample_lru_add(sample);
+	sample_size += size;
+	nr_samples++;
+
+	while (sample_size > sample_config.max_size) {
+		struct sample *victim = sample_lru.prev;
+
+		sample_unlink(victim);
+		victim->hash_next = evicted;
+		evicted = victim;
+		sample_evicts++;
+	}
+	pthread_mutex_unlock(&sample_lock);
+
+	while (evicted) {
+		sample = evicted;
+		evicted = evicted->hash_next;
+		sample_put(sample);
+	}
+}
+
+void sample_forget(const char *name)
+{
+	struct sample *sample, *next, *forgotten = NULL;
+
+	pthread_mutex_lock(&sample_lock);
+	for (sample = sample_lru.next; sample != &sample_lru; sample = next) {
+		next = sample->next;
+		if (strcmp(sample->name, name))
+			continue;
+
+		sample_unlink(sample);
+		sample->hash_next = forgotten;
+		forgotten = sample;
+	}
+	pthread_mutex_unlock(&sample_lock);
+
+	while (forgotten) {
+		sample = forgotten;
+		forgotten = forgotten->hash_next;
+		sample_put(sample);
+	}
+}
+
+int sample_stats(char *buf, size_t size)
+{
+	int len;
+
+	pthread_mutex_lock(&sample_lock);
+	len = snprintf(buf, size, "\"samples\": {\"max_size\": %zu, \"size\": %zu, \"nr\": %lu, "
+		       "\"hits\": %lu, \"misses\": %lu, \"evicts\": %lu, \"skips\": %lu}",
+		       sample_config.max_size, sample_size, nr_samples,
+		       sample_hits, sample_misses, sample_evicts, sample_skips);
+	pthread_mutex_unlock(&sample_lock);
+
+	return len;
+}
+
+#ifdef SAMPLE_TEST
+/*
+ * gcc -O2 -DSAMPLE_TEST -Iatop sample.c -o sample_test -pthread && ./sample_test
+ */
+#include <assert.h>
+
+int main()
+{
+	struct tstat taskall[3] = { 0 };
+	struct tstat *procall[2] = { &taskall[0], &taskall[2] };
+	struct tstat *procactive[1] = { &taskall[2] };
+	struct devtstat devtstat = {
+		.taskall = taskall, .procall = procall, .procactive = procactive,
+		.ntaskall = 3, .nprocall = 2, .nprocactive = 1,
+	};
+	struct rawrecord rr = { .curtime = 100 };
+	static struct sstat sstat;
+	struct sample *sample, *held;
+	size_t one;
+	char buf[256];
+
+	assert(!sample_get("a", 0));
+	sample_add("a", 0, &rr, 1, &sstat, &devtstat, 1);
+	sample = sample_get("a", 0);
+	assert(sample && (sample->curtime == 100) && (sample->flags == 1));
+	assert(sample->devtstat->procall[1] == &sample->devtstat->taskall[2]);
+	assert(sample->devtstat->procactive[0] == &sample->devtstat->taskall[2]);
+	assert(!sample_get("a", 1) && !sample_get("b", 0));
+	one = sample_size;
+
+	/* up to 2 samples, the least recently used one goes */
+	sample_config.max_size = one * 2;
+	held = sample;
+	rr.curtime = 200;
+	sample_add("a", 1, &rr, 0, &sstat, &devtstat, 1);
+	sample_put(sample_get("a", 0));
+	rr.curtime = 300;
+	sample_add("a", 2, &rr, 0, &sstat, &devtstat, 1);
+	assert(nr_samples == 2);
+	assert(!sample_get("a", 1));
+
+	/* a worker still holds the evicted or forgotten one */
+	sample_forget("a");
+	assert(!nr_samples && !sample_size);
+	assert(held->curtime == 100);
+	sample_put(held);
+
+	/* a history record is cached on its second miss */
+	sample_add("b", 0, &rr, 0, &sstat, &devtstat, 0);
+	assert(!sample_get("b", 0));
+	sample_add("b", 0, &rr, 0, &sstat, &devtstat, 0);
+	sample = sample_get("b", 0);
+	assert(sample && (nr_samples == 1));
+	sample_put(sample);
+
+	sample_stats(buf, sizeof(buf));
+	printf("%s\n", buf);
+	assert(strstr(buf, "\"hits\": 3, \"misses\": 5, \"evicts\": 1, \"skips\": 1"));
+
+	return 0;
+}
+#endif
@@ -0,0 +1,68 @@
+/*
+ * Copyright 2023 zhenwei pi
+ *
+ * Authors:
+ *   zhenwei pi <pizhenwei@bytedance.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef _SAMPLE_H_
+#define _SAMPLE_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct devtstat;
+struct rawrecord;
+struct sstat;
+
+/*
+ * Decoded samples of all the workers, the least recently used ones are freed
+ * beyond sample_config.max_size. A dashboard and the browsers ask for the
+ * latest sample mostly, it's decoded once.
+ */
+struct sample {
+	char *name;		/* of the rawlog */
+	off_t off;		/* of the record */
+	time_t curtime;
+	int interval;
+	int nexit;
+	unsigned int noverflow;
+	int flags;
+	struct sstat *sstat;
+	struct devtstat *devtstat;
+	size_t size;
+	int refs;
+	struct sample *prev, *next;	/* LRU list */
+	struct sample *hash_next;
+};
+
+struct sample_config {
+	size_t max_size;	/* in bytes, 0 disables */
+};
+
+#define DEFAULT_SAMPLE_CACHE	64	/* MB */
+
+extern struct sample_config sample_config;
+
+/* the sample of record @off of rawlog @name, sample_put() it once it's used */
+struct sample *sample_get(const char *name, off_t off);
+void sample_put(struct sample *sample);
+
+/*
+ * Cache a copy of a decoded sample, it's never modified once cached. A copy
+ * is a few MB, so a sample is copied on its second miss, or on the first one
+ * if it's @latest, Ex, the last record polled by dashboards.
+ */
+void sample_add(const char *name, off_t off, struct rawrecord *rr, int flags,
+		struct sstat *sstat, struct devtstat *devtstat, int latest);
+
+/* the rawlog @name is removed */
+void sample_forget(const char *name);
+
+/* counters in JSON, return the length */
+int sample_stats(char *buf, size_t size);
+
+#endif
@@ -9,21 +9,28 @@
  * This work is licensed under the terms of the GNU GPL, version 2 or later.
  * See the COPYING file in the top-level directory.
  */
+#define _GNU_SOURCE
 #include "httpd.h"
+#include "pool.h"
 
 #include <errno.h>
 #include <netinet/in.h>
 #include <stdlib.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
 
 static connection_type CT_Socket;
+static __thread struct pool conn_socket_pool = POOL_INITIALIZER("tcp", sizeof(connection), 1024);
 
 static const char* conn_socket_get_type(connection* conn) {
 	return CONN_TYPE_SOCKET;
 }
 
 static connection* conn_socket_create(int port, char *addr) {
-	connection* conn = calloc(1, sizeof(connection));
+	connection* conn = pool_alloc(&conn_socket_pool);
+	if (!conn)
+		return NULL;
+
 	conn->type = &CT_Socket;
 	conn->fd = -1;
 	conn->port = port;
@@ -32,6 +39,10 @@ static connection* conn_socket_create(int port, char *addr) {
 	return conn;
 }
 
+static void conn_socket_free(connection* conn) {
+	pool_free(&conn_socket_pool, conn);
+}
+
 static int conn_socket_listen(connection* listener) {
 	int listenfd = -1;
 
@@ -58,7 +69,7 @@ static int conn_socket_accept(connection* listener, connection* conn) {
 	struct sockaddr_in cliaddr;
 	socklen_t addrlen = sizeof(cliaddr);
 
-	int clifd = accept(listener->fd, (struct sockaddr*)&cliaddr, &addrlen);
+	int clifd = accept4(listener->fd, (struct sockaddr*)&cliaddr, &addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
 	if (clifd < 0)
 		return -errno;
 
@@ -92,7 +103,22 @@ static int conn_socket_writev(struct connection* conn, const struct iovec* iov,
 	if (conn->fd == -1)
 		return -EINVAL;
 
-	return writev(conn->fd, iov, iovcnt);
+	int ret = writev(conn->fd, iov, iovcnt);
+	if (ret < 0)
+		return -errno;
+
+	return ret;
+}
+
+static int conn_socket_sendfile(struct connection* conn, int fd, off_t offset, size_t len) {
+	if (conn->fd == -1)
+		return -EINVAL;
+
+	int ret = sendfile(conn->fd, fd, &offset, len);
+	if (ret < 0)
+		return -errno;
+
+	return ret;
 }
 
 static int conn_socket_read(struct connection* conn, void* buf, size_t buf_len) {
@@ -100,13 +126,14 @@ static int conn_socket_read(struct connection* conn, void* buf, size_t buf_len)
 		return -EINVAL;
 
 	int ret = read(conn->fd, buf, buf_len);
-	if (ret <= 0) {
+	if (ret < 0) {
 		if (errno != EAGAIN) {
 			return -errno;
 		}
 		return -EAGAIN;
 	}
 
+	/* 0 means the peer closed the connection */
 	return ret;
 }
 
@@ -118,6 +145,7 @@ static connection_type CT_Socket = {
 	.cleanup = NULL,
 
 	.conn_create = conn_socket_create,
+	.conn_free = conn_socket_free,
 
 	.listen = conn_socket_listen,
 	.accept = conn_socket_accept,
@@ -126,6 +154,7 @@ static connection_type CT_Socket = {
 
 	.write = conn_socket_write,
 	.writev = conn_socket_writev,
+	.sendfile = conn_socket_sendfile,
 	.read = conn_socket_read};
 
 int register_conntype_socket() {
@@ -10,28 +10,156 @@
  * See the COPYING file in the top-level directory.
  */
 
+#include "http2.h"
 #include "httpd.h"
+#include "pool.h"
 
 #include <limits.h>
 #include <netinet/in.h>
 #include <openssl/err.h>
 #include <openssl/ssl.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 
 #ifdef USE_TLS
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
+
+/* the max bytes of a writev, partial writes resume from the queue */
+#define TLS_WRITEV_MAX (256 * 1024)
+/* the max plaintext of a TLS record */
+#define TLS_RECORD_MAX (16 * 1024)
+
+/*
+ * A client resumes its session from the cache (TLS 1.2 session ID) or from a
+ * ticket, and skips the certificate verification. Ticket keys rotate every
+ * TLS_SESSION_TIMEOUT, and the previous key still decrypts, so a ticket
+ * lives at least TLS_SESSION_TIMEOUT.
+ */
+#define TLS_SESSION_TIMEOUT	3600
+#define TLS_SESSION_CACHE_SIZE	4096
+#define TLS_SESSION_ID_CONTEXT	"atophttpd"
+
 typedef struct tls_connection {
 	connection c;
 	SSL* ssl;
+	char* record_buf;	/* gathers small iovecs into a record, TLS_RECORD_MAX */
 } tls_connection;
 
 SSL_CTX* tls_ctx = NULL;
 
 static connection_type CT_TLS;
+static __thread struct pool conn_tls_pool = POOL_INITIALIZER("tls", sizeof(tls_connection), 1024);
+static __thread struct pool tls_record_pool = POOL_INITIALIZER("tls_record", TLS_RECORD_MAX, 64);
 
 static const char* conn_tls_get_type(connection* conn) {
 	return CONN_TYPE_TLS;
 }
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+struct tls_ticket_key {
+	unsigned char name[16];
+	unsigned char aes_key[32];
+	unsigned char hmac_key[32];
+	time_t created;
+};
+
+/* [0] encrypts new tickets, [1] is the previous one */
+static struct tls_ticket_key tls_ticket_keys[2];
+static pthread_mutex_t tls_ticket_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int tls_ticket_key_rotate(time_t now) {
+	struct tls_ticket_key key;
+
+	if ((RAND_bytes(key.name, sizeof(key.name)) != 1) || (RAND_priv_bytes(key.aes_key, sizeof(key.aes_key)) != 1)
+	    || (RAND_priv_bytes(key.hmac_key, sizeof(key.hmac_key)) != 1))
+		return -EIO;
+
+	key.created = now;
+	tls_ticket_keys[1] = tls_ticket_keys[0];
+	tls_ticket_keys[0] = key;
+
+	return 0;
+}
+
+/* return 1 to use the key, 2 to use it and issue a new ticket, 0 on no key */
+static int tls_ticket_key_setup(struct tls_ticket_key *key, unsigned char iv[EVP_MAX_IV_LENGTH],
+				EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc) {
+	OSSL_PARAM params[] = {
+		OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key->hmac_key, sizeof(key->hmac_key)),
+		OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "sha256", 0),
+		OSSL_PARAM_construct_end()
+	};
+
+	if (!EVP_CipherInit_ex(cctx, EVP_aes_256_cbc(), NULL, key->aes_key, iv, enc)
+	    || !EVP_MAC_CTX_set_params(hctx, params))
+		return -1;
+
+	return 1;
+}
+
+static int tls_ticket_key_cb(SSL *ssl, unsigned char key_name[16], unsigned char iv[EVP_MAX_IV_LENGTH],
+			     EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc) {
+	time_t now = time(NULL);
+	int ret = 0;
+
+	pthread_mutex_lock(&tls_ticket_lock);
+	if (now - tls_ticket_keys[0].created >= TLS_SESSION_TIMEOUT) {
+		if (tls_ticket_key_rotate(now)) {
+			ret = -1;
+			goto out;
+		}
+	}
+
+	if (enc) {
+		if (RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1) {
+			ret = -1;
+			goto out;
+		}
+
+		memcpy(key_name, tls_ticket_keys[0].name, 16);
+		ret = tls_ticket_key_setup(&tls_ticket_keys[0], iv, cctx, hctx, 1);
+		goto out;
+	}
+
+	for (int i = 0; i < 2; i++) {
+		if (!tls_ticket_keys[i].created || memcmp(key_name, tls_ticket_keys[i].name, 16))
+			continue;
+
+		ret = tls_ticket_key_setup(&tls_ticket_keys[i], iv, cctx, hctx, 0);
+		/* renew the ticket encrypted by the previous key */
+		if ((ret == 1) && i)
+			ret = 2;
+		break;
+	}
+
+out:
+	pthread_mutex_unlock(&tls_ticket_lock);
+	return ret;
+}
+#endif
+
+/* prefer h2 if it's builtin, fallback to HTTP/1.1 */
+static const unsigned char tls_alpn_protos[] =
+#ifdef USE_HTTP2
+	"\x02h2"
+#endif
+	"\x08http/1.1";
+
+static int tls_alpn_select_cb(SSL* ssl, const unsigned char** out, unsigned char* outlen,
+			      const unsigned char* in, unsigned int inlen, void* arg) {
+	if (SSL_select_next_proto((unsigned char**)out, outlen, tls_alpn_protos, sizeof(tls_alpn_protos) - 1,
+				  in, inlen) != OPENSSL_NPN_NEGOTIATED)
+		return SSL_TLSEXT_ERR_NOACK;
+
+	return SSL_TLSEXT_ERR_OK;
+}
+
 static void tls_init(void) {
 	SSL_library_init();
 	OpenSSL_add_all_algorithms();
@@ -85,6 +213,30 @@ static int tls_configure(void* priv, int reconfigure) {
 
 	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
 
+	/* writev on a non-blocking socket retries from a new buffer */
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	/* resumption requires the context, otherwise it fails with peer verification */
+	SSL_CTX_set_session_id_context(ctx, (const unsigned char *)TLS_SESSION_ID_CONTEXT, strlen(TLS_SESSION_ID_CONTEXT));
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, TLS_SESSION_CACHE_SIZE);
+	SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	/* keys survive reconfiguration, tickets issued before stay valid */
+	if (SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, tls_ticket_key_cb) != 1) {
+		perror("ERROR setting session ticket key callback");
+		goto error;
+	}
+#endif
+
+#ifdef SSL_OP_ENABLE_KTLS
+	/* encrypt in kernel if the tls module is available, fallback silently */
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+	SSL_CTX_set_alpn_select_cb(ctx, tls_alpn_select_cb, NULL);
+
 	SSL_CTX_free(tls_ctx);
 	tls_ctx = ctx;
 	return 0;
@@ -103,7 +255,10 @@ static void tls_cleanup(void) {
 }
 
 static connection* conn_tls_create(int port, char *addr) {
-	tls_connection* conn = calloc(1, sizeof(tls_connection));
+	tls_connection* conn = pool_alloc(&conn_tls_pool);
+	if (!conn)
+		return NULL;
+
 	conn->c.type = &CT_TLS;
 	conn->c.fd = -1;
 	conn->c.port = port;
@@ -112,6 +267,10 @@ static connection* conn_tls_create(int port, char *addr) {
 	return (connection*)conn;
 }
 
+static void conn_tls_free(connection* conn) {
+	pool_free(&conn_tls_pool, conn);
+}
+
 static int conn_tls_listen(connection* listener) {
 	// printf("tls listen on port %d, addr %s\n", listener->port, listener->bindaddr);
 	return get_conntype_by_name(CONN_TYPE_SOCKET)->listen(listener);
@@ -121,8 +280,9 @@ static int conn_tls_listen(connection* listener) {
 static int conn_tls_accept(connection * listener, connection* conn) {
 	int ret = get_conntype_by_name(CONN_TYPE_SOCKET)->accept(listener, conn);
 	if (ret < 0) {
-		perror("tls conn accept failed at tcp accept.");
-		return -errno;
+		if (ret != -EAGAIN)
+			perror("tls conn accept failed at tcp accept.");
+		return ret;
 	}
 
 	tls_connection* tls_conn = (tls_connection*)conn;
@@ -144,15 +304,33 @@ static int conn_tls_accept(connection * listener, connection* conn) {
 		return -EINVAL;
 	}
 
+	/* the handshake is driven by the event loop, see conn_tls_handshake() */
 	SSL_set_fd(tls_conn->ssl, tls_conn->c.fd);
-	if (SSL_accept(tls_conn->ssl) <= 0) {
-		printf("SSL_TLS handshake failed: %s\n", ERR_error_string(ERR_get_error(), NULL));
-		return -errno;
-	}
+	SSL_set_accept_state(tls_conn->ssl);
 
 	return 0;
 }
 
+static int conn_tls_handshake(connection* conn) {
+	tls_connection* tls_conn = (tls_connection*)conn;
+	int ret = SSL_do_handshake(tls_conn->ssl);
+
+	if (ret == 1)
+		return 0;
+
+	switch (SSL_get_error(tls_conn->ssl, ret)) {
+	case SSL_ERROR_WANT_READ:
+		return CONN_HANDSHAKE_WANT_READ;
+
+	case SSL_ERROR_WANT_WRITE:
+		return CONN_HANDSHAKE_WANT_WRITE;
+
+	default:
+		printf("SSL_TLS handshake failed: %s\n", ERR_error_string(ERR_get_error(), NULL));
+		return errno ? -errno : -EIO;
+	}
+}
+
 static void conn_shutdown_tls(connection* conn) {
 	tls_connection* tls_conn = (tls_connection*)conn;
 
@@ -177,6 +355,9 @@ static void conn_close_tls(connection* conn) {
 		tls_conn->ssl = NULL;
 	}
 
+	pool_free(&tls_record_pool, tls_conn->record_buf);
+	tls_conn->record_buf = NULL;
+
 	get_conntype_by_name(CONN_TYPE_SOCKET)->close(conn);
 	return;
 }
@@ -196,38 +377,175 @@ static int conn_write_tls(connection* conn, const void* data, size_t data_len) {
 	return 0;
 }
 
+/* return bytes written, or -EAGAIN to retry the same bytes later */
+static int tls_write(tls_connection* tls_conn, const void* data, size_t data_len) {
+	int ret = SSL_write(tls_conn->ssl, data, data_len);
+	if (ret <= 0) {
+		switch (SSL_get_error(tls_conn->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			ret = -EAGAIN;
+			break;
+
+		default:
+			perror("SSL writev error");
+			ret = errno ? -errno : -EIO;
+		}
+	}
+
+	return ret;
+}
+
+static char* tls_record_buf(tls_connection* tls_conn) {
+	if (!tls_conn->record_buf)
+		tls_conn->record_buf = pool_alloc(&tls_record_pool);
+
+	return tls_conn->record_buf;
+}
+
+/*
+ * Write a record at a time, up to TLS_WRITEV_MAX. A large iovec is encrypted
+ * in place, small ones are gathered into the record buffer. A write which
+ * wants to retry is retried with the same bytes by the next call, because
+ * the choice only depends on the unsent bytes.
+ */
 static int conn_writev_tls(connection* conn, const struct iovec* iov, int iovcnt) {
 	tls_connection* tls_conn = (tls_connection*)conn;
+	size_t written = 0, skip = 0, len;
+	const char* data;
+	int i = 0, ret;
 
 	if (tls_conn->ssl == NULL) {
 		return -EINVAL;
 	}
 
-	size_t iov_bytes_len = 0;
-	for (int i = 0; i < 3; i++) {
-		iov_bytes_len += iov[i].iov_len;
+	while (written < TLS_WRITEV_MAX) {
+		while ((i < iovcnt) && (skip == iov[i].iov_len)) {
+			i++;
+			skip = 0;
+		}
+
+		if (i == iovcnt)
+			break;
+
+		len = iov[i].iov_len - skip;
+		if (len >= TLS_RECORD_MAX) {
+			data = (const char*)iov[i].iov_base + skip;
+			if (len > TLS_WRITEV_MAX - written)
+				len = TLS_WRITEV_MAX - written;
+		} else {
+			char* buf = tls_record_buf(tls_conn);
+			size_t off = skip;
+
+			if (!buf) {
+				perror("SSL have no mem");
+				return written ? written : -ENOMEM;
+			}
+
+			len = 0;
+			for (int j = i; (j < iovcnt) && (len < TLS_RECORD_MAX); j++, off = 0) {
+				size_t n = iov[j].iov_len - off;
+
+				if (n > TLS_RECORD_MAX - len)
+					n = TLS_RECORD_MAX - len;
+
+				memcpy(buf + len, (const char*)iov[j].iov_base + off, n);
+				len += n;
+			}
+			data = buf;
+		}
+
+		ret = tls_write(tls_conn, data, len);
+		if (ret < 0)
+			return written ? written : ret;
+
+		written += ret;
+		for (len = ret; len; ) {
+			size_t n = iov[i].iov_len - skip;
+
+			if (n > len)
+				n = len;
+
+			skip += n;
+			len -= n;
+			if (skip == iov[i].iov_len) {
+				i++;
+				skip = 0;
+			}
+		}
 	}
 
-	char *ssl_buf;
-	ssl_buf = malloc(iov_bytes_len);
-	if (!ssl_buf) {
+	return written;
+}
+
+static int conn_sendfile_copies_tls(connection* conn) {
+	tls_connection* tls_conn = (tls_connection*)conn;
+
+#ifdef SSL_OP_ENABLE_KTLS
+	if (tls_conn->ssl && BIO_get_ktls_send(SSL_get_wbio(tls_conn->ssl)))
+		return 0;
+#endif
+	return 1;
+}
+
+/* kTLS sends the file from kernel, otherwise read and encrypt it in user space */
+static int conn_sendfile_tls(connection* conn, int fd, off_t offset, size_t len) {
+	tls_connection* tls_conn = (tls_connection*)conn;
+	size_t written = 0;
+	char* buf;
+	int ret;
+
+	if (tls_conn->ssl == NULL) {
+		return -EINVAL;
+	}
+
+#ifdef SSL_OP_ENABLE_KTLS
+	if (BIO_get_ktls_send(SSL_get_wbio(tls_conn->ssl))) {
+		ossl_ssize_t sent = SSL_sendfile(tls_conn->ssl, fd, offset, len, 0);
+
+		if (sent >= 0)
+			return sent;
+
+		switch (SSL_get_error(tls_conn->ssl, sent)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			return -EAGAIN;
+
+		default:
+			perror("SSL sendfile error");
+			return errno ? -errno : -EIO;
+		}
+	}
+#endif
+
+	buf = tls_record_buf(tls_conn);
+	if (!buf) {
 		perror("SSL have no mem");
 		return -ENOMEM;
 	}
-	size_t offset = 0;
-	for (int i = 0; i < iovcnt; i++) {
-		memcpy(ssl_buf + offset, iov[i].iov_base, iov[i].iov_len);
-		offset += iov[i].iov_len;
-	}
 
-	int ret = SSL_write(tls_conn->ssl, ssl_buf, iov_bytes_len);
-	if (ret < 0) {
-		perror("SSL writev error");
-		ret = -errno;
+	if (len > TLS_WRITEV_MAX)
+		len = TLS_WRITEV_MAX;
+
+	while (written < len) {
+		size_t n = len - written;
+
+		if (n > TLS_RECORD_MAX)
+			n = TLS_RECORD_MAX;
+
+		ret = pread(fd, buf, n, offset + written);
+		if (ret > 0)
+			ret = tls_write(tls_conn, buf, ret);
+		else
+			ret = ret ? -errno : -EIO;
+
+		if (ret < 0)
+			return written ? written : ret;
+
+		written += ret;
 	}
 
-	free(ssl_buf);
-	return ret;
+	return written;
 }
 
 static int conn_read_tls(connection* conn, void* buf, size_t buf_len) {
@@ -239,15 +557,33 @@ static int conn_read_tls(connection* conn, void* buf, size_t buf_len) {
 
 	int ret = SSL_read(tls_conn->ssl, buf, buf_len);
 	if (ret <= 0) {
-		if (errno != EAGAIN) {
-			return -errno;
-		}
+		switch (SSL_get_error(tls_conn->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			return -EAGAIN;
 
-		return -EAGAIN;
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+
+		default:
+			return errno ? -errno : -EIO;
+		}
 	}
 	return ret;
 }
 
+static const char* conn_tls_get_protocol(connection* conn) {
+	tls_connection* tls_conn = (tls_connection*)conn;
+	const unsigned char* proto;
+	unsigned int len;
+
+	SSL_get0_alpn_selected(tls_conn->ssl, &proto, &len);
+	if ((len == strlen(HTTP2_ALPN)) && !memcmp(proto, HTTP2_ALPN, len))
+		return HTTP2_ALPN;
+
+	return NULL;
+}
+
 static connection_type CT_TLS = {
 	.get_type = conn_tls_get_type,
 
@@ -256,16 +592,21 @@ static connection_type CT_TLS = {
 	.cleanup = tls_cleanup,
 
 	.conn_create = conn_tls_create,
+	.conn_free = conn_tls_free,
 
 	.listen = conn_tls_listen,
 
 	.accept = conn_tls_accept,
+	.handshake = conn_tls_handshake,
 	.shutdown = conn_shutdown_tls,
 	.close = conn_close_tls,
 
 	.write = conn_write_tls,
 	.writev = conn_writev_tls,
-	.read = conn_read_tls};
+	.sendfile = conn_sendfile_tls,
+	.read = conn_read_tls,
+	.get_protocol = conn_tls_get_protocol,
+	.sendfile_copies = conn_sendfile_copies_tls};
 
 int register_conntype_tls() {
 	return conntype_register(&CT_TLS);
@@ -279,3 +620,115 @@ int register_conntype_tls() {
 }
 
 #endif
+
+#ifdef TLS_BENCH
+/*
+ * Compare full and resumed handshakes against a running atophttpd, build and
+ * run by:
+ * gcc -O2 -DTLS_BENCH tls.c -lssl -lcrypto -o tls_bench
+ * ./tls_bench ADDR TLS_PORT CA_CERT CERT KEY [CONNECTIONS]
+ */
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/time.h>
+
+static long tls_bench_now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000L + tv.tv_usec;
+}
+
+/* connect, handshake and ping, return the session to resume next time */
+static SSL_SESSION *tls_bench_conn(SSL_CTX *ctx, struct sockaddr_in *addr, SSL_SESSION *session, int *reused)
+{
+	char *req = "GET /ping HTTP/1.1\r\nConnection: close\r\n\r\n";
+	char buf[1024];
+	SSL_SESSION *next = NULL;
+	SSL *ssl = NULL;
+	int fd, onoff = 1;
+
+	/* no Nagle, the request follows the handshake immediately */
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if ((fd < 0) || setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &onoff, sizeof(onoff))
+	    || connect(fd, (struct sockaddr *)addr, sizeof(*addr))) {
+		printf("connect failed: %m\n");
+		exit(1);
+	}
+
+	ssl = SSL_new(ctx);
+	SSL_set_fd(ssl, fd);
+	if (session)
+		SSL_set_session(ssl, session);
+
+	if ((SSL_connect(ssl) != 1) || (SSL_write(ssl, req, strlen(req)) <= 0)) {
+		printf("handshake failed: %s\n", ERR_error_string(ERR_get_error(), NULL));
+		exit(1);
+	}
+
+	/* TLS 1.3 tickets arrive after the handshake, read them by the response */
+	while (SSL_read(ssl, buf, sizeof(buf)) > 0)
+		;
+
+	*reused += SSL_session_reused(ssl);
+	next = SSL_get1_session(ssl);
+	SSL_shutdown(ssl);
+	SSL_free(ssl);
+	close(fd);
+
+	return next;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in addr = { .sin_family = AF_INET };
+	int connections = 1000;
+	SSL_SESSION *session;
+	SSL_CTX *ctx;
+
+	if (argc < 6) {
+		printf("Usage: %s ADDR TLS_PORT CA_CERT CERT KEY [CONNECTIONS]\n", argv[0]);
+		return 1;
+	}
+
+	inet_pton(AF_INET, argv[1], &addr.sin_addr);
+	addr.sin_port = htons(atoi(argv[2]));
+	if (argc > 6)
+		connections = atoi(argv[6]);
+
+	ctx = SSL_CTX_new(TLS_client_method());
+	if (!ctx || (SSL_CTX_load_verify_locations(ctx, argv[3], NULL) != 1)
+	    || (SSL_CTX_use_certificate_file(ctx, argv[4], SSL_FILETYPE_PEM) != 1)
+	    || (SSL_CTX_use_PrivateKey_file(ctx, argv[5], SSL_FILETYPE_PEM) != 1)) {
+		printf("failed to load certs: %s\n", ERR_error_string(ERR_get_error(), NULL));
+		return 1;
+	}
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+
+	for (int resume = 0; resume < 2; resume++) {
+		int reused = 0;
+		long start;
+
+		session = resume ? tls_bench_conn(ctx, &addr, NULL, &reused) : NULL;
+		start = tls_bench_now_us();
+		for (int i = 0; i < connections; i++) {
+			SSL_SESSION *next = tls_bench_conn(ctx, &addr, session, &reused);
+
+			if (resume) {
+				SSL_SESSION_free(session);
+				session = next;
+			} else {
+				SSL_SESSION_free(next);
+			}
+		}
+
+		printf("%s handshakes: %8.1f conn/s, %d of %d resumed\n", resume ? "resumed" : "full   ",
+		       connections * 1000000.0 / (tls_bench_now_us() - start), reused, connections);
+		SSL_SESSION_free(session);
+	}
+
+	SSL_CTX_free(ctx);
+	return 0;
+}
+#endif
@@ -0,0 +1,238 @@
+/*
+ * Copyright 2023 zhenwei pi
+ *
+ * Authors:
+ *   zhenwei pi <pizhenwei@bytedance.com>
+ *
+ * Design and some codes are taken from redis.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#define _GNU_SOURCE
+#include "httpd.h"
+#include "pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/*
+ * A local collector connects by a unix socket, no TCP stack and ephemeral
+ * port is involved. Reading and writing are the same as TCP, delegate them.
+ */
+static connection_type CT_Unix;
+static connection_type *CT_TCP;
+static __thread struct pool conn_unix_pool = POOL_INITIALIZER("unix", sizeof(connection), 1024);
+
+struct unix_config unix_config;
+
+/* unix socket can't be bound by SO_REUSEPORT, workers share a single one */
+static pthread_mutex_t unix_listen_lock = PTHREAD_MUTEX_INITIALIZER;
+static int unix_listen_fd = -1;
+
+static const char* conn_unix_get_type(connection* conn) {
+	return CONN_TYPE_UNIX;
+}
+
+static void conn_unix_init(void) {
+	CT_TCP = get_conntype_by_name(CONN_TYPE_SOCKET);
+}
+
+static connection* conn_unix_create(int port, char *addr) {
+	connection* conn = pool_alloc(&conn_unix_pool);
+	if (!conn)
+		return NULL;
+
+	conn->type = &CT_Unix;
+	conn->fd = -1;
+	conn->port = port;
+	conn->is_local = 1;
+	conn->bindaddr = addr;
+
+	return conn;
+}
+
+static void conn_unix_free(connection* conn) {
+	pool_free(&conn_unix_pool, conn);
+}
+
+/* a leading '@' means the abstract namespace, Ex, "@atophttpd" */
+static int unix_sockaddr(const char *path, struct sockaddr_un *sun, socklen_t *len) {
+	size_t pathlen = strlen(path);
+
+	if (!pathlen || pathlen >= sizeof(sun->sun_path))
+		return -EINVAL;
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	memcpy(sun->sun_path, path, pathlen);
+	*len = offsetof(struct sockaddr_un, sun_path) + pathlen;
+	if (path[0] == '@') {
+		sun->sun_path[0] = '\0';
+	} else {
+		*len += 1;
+	}
+
+	return 0;
+}
+
+static int unix_listen(const char *path) {
+	struct sockaddr_un sun;
+	struct stat st;
+	socklen_t len;
+	int sockfd;
+
+	if (unix_sockaddr(path, &sun, &len)) {
+		printf("unix socket path %s is invalid\n", path);
+		return -1;
+	}
+
+	sockfd = listen_fd_take((struct sockaddr *)&sun, len);
+	if (sockfd != -1)
+		return sockfd;
+
+	sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (sockfd == -1) {
+		perror("failed get socket fd: ");
+		return -1;
+	}
+
+	/* a stale socket left by the previous run */
+	if ((path[0] != '@') && !stat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	if (bind(sockfd, (struct sockaddr *)&sun, len) == -1) {
+		perror("socket bind failed: ");
+		goto error;
+	}
+
+	/* anyone connects, and the peer credential decides */
+	if ((path[0] != '@') && unix_config.nr_allow_uids && chmod(path, 0666)) {
+		perror("socket chmod failed: ");
+		goto error;
+	}
+
+	if (listen(sockfd, listen_config.backlog) == -1) {
+		perror("socket listen failed: ");
+		goto error;
+	}
+
+	listen_fd_register(sockfd);
+	return sockfd;
+
+error:
+	close(sockfd);
+	return -1;
+}
+
+static int conn_unix_listen(connection* listener) {
+	int listenfd;
+
+	if (!listener->bindaddr)
+		return -EINVAL;
+
+	pthread_mutex_lock(&unix_listen_lock);
+	if (unix_listen_fd == -1)
+		unix_listen_fd = unix_listen(listener->bindaddr);
+
+	listenfd = unix_listen_fd == -1 ? -1 : fcntl(unix_listen_fd, F_DUPFD_CLOEXEC, 0);
+	pthread_mutex_unlock(&unix_listen_lock);
+
+	if (listenfd == -1)
+		return -EINVAL;
+
+	listener->fd = listenfd;
+	return 0;
+}
+
+/* root and the user of atophttpd are always allowed */
+static int unix_peer_allowed(int fd) {
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (!unix_config.nr_allow_uids)
+		return 1;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+		return 0;
+
+	if (!cred.uid || (cred.uid == geteuid()))
+		return 1;
+
+	for (int i = 0; i < unix_config.nr_allow_uids; i++) {
+		if (cred.uid == unix_config.allow_uids[i])
+			return 1;
+	}
+
+	log_debug("unix socket peer pid %d uid %d is not allowed\n", cred.pid, cred.uid);
+	return 0;
+}
+
+static int conn_unix_accept(connection* listener, connection* conn) {
+	int clifd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (clifd < 0)
+		return -errno;
+
+	if (!unix_peer_allowed(clifd)) {
+		close(clifd);
+		return -ECONNABORTED;
+	}
+
+	conn->fd = clifd;
+	return 0;
+}
+
+static void conn_unix_shutdown(connection* conn) {
+	CT_TCP->shutdown(conn);
+}
+
+static void conn_unix_close(connection* conn) {
+	CT_TCP->close(conn);
+}
+
+static int conn_unix_write(struct connection* conn, const void* data, size_t data_len) {
+	return CT_TCP->write(conn, data, data_len);
+}
+
+static int conn_unix_writev(struct connection* conn, const struct iovec* iov, int iovcnt) {
+	return CT_TCP->writev(conn, iov, iovcnt);
+}
+
+static int conn_unix_sendfile(struct connection* conn, int fd, off_t offset, size_t len) {
+	return CT_TCP->sendfile(conn, fd, offset, len);
+}
+
+static int conn_unix_read(struct connection* conn, void* buf, size_t buf_len) {
+	return CT_TCP->read(conn, buf, buf_len);
+}
+
+static connection_type CT_Unix = {
+	.get_type = conn_unix_get_type,
+
+	.init = conn_unix_init,
+	.configure = NULL,
+	.cleanup = NULL,
+
+	.conn_create = conn_unix_create,
+	.conn_free = conn_unix_free,
+
+	.listen = conn_unix_listen,
+	.accept = conn_unix_accept,
+	.shutdown = conn_unix_shutdown,
+	.close = conn_unix_close,
+
+	.write = conn_unix_write,
+	.writev = conn_unix_writev,
+	.sendfile = conn_unix_sendfile,
+	.read = conn_unix_read};
+
+int register_conntype_unix() {
+	return conntype_register(&CT_Unix);
+}
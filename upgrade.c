@@ -0,0 +1,264 @@
+/*
+ * Copyright 2023 zhenwei pi
+ *
+ * Authors:
+ *   zhenwei pi <pizhenwei@bytedance.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "connection.h"
+#include "upgrade.h"
+
+#define UPGRADE_MAGIC		0x55485441	/* "ATHU" */
+#define UPGRADE_MAX_FDS		513
+#define UPGRADE_FDS_PER_MSG	64
+
+/* each message carries it, and up to UPGRADE_FDS_PER_MSG fds */
+struct upgrade_msg {
+	uint32_t magic;
+	int nr_fds;		/* of all the messages */
+	int has_cache;		/* the last fd is a snapshot of the index */
+};
+
+/* the new process acks the old one by it */
+static int upgrade_fd = -1;
+
+static int upgrade_send(int sock, struct upgrade_msg *um, int *fds, int nr)
+{
+	union {
+		char buf[CMSG_SPACE(UPGRADE_FDS_PER_MSG * sizeof(int))];
+		struct cmsghdr align;
+	} u;
+	struct iovec iov = { .iov_base = um, .iov_len = sizeof(*um) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *cmsg;
+
+	if (nr) {
+		msg.msg_control = u.buf;
+		msg.msg_controllen = CMSG_SPACE(nr * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nr * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nr * sizeof(int));
+	}
+
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) < 0 ? -errno : 0;
+}
+
+/* return the number of fds received, or -errno */
+static int upgrade_recv(int sock, struct upgrade_msg *um, int *fds, int max)
+{
+	union {
+		char buf[CMSG_SPACE(UPGRADE_FDS_PER_MSG * sizeof(int))];
+		struct cmsghdr align;
+	} u;
+	struct iovec iov = { .iov_base = um, .iov_len = sizeof(*um) };
+	struct msghdr msg = {
+		.msg_iov = &iov, .msg_iovlen = 1,
+		.msg_control = u.buf, .msg_controllen = sizeof(u.buf)
+	};
+	struct cmsghdr *cmsg;
+	int nr = 0;
+
+	if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(*um))
+		return -EPROTO;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if ((cmsg->cmsg_level != SOL_SOCKET) || (cmsg->cmsg_type != SCM_RIGHTS))
+			continue;
+
+		nr = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		if (nr > max) {
+			for (int i = 0; i < nr; i++)
+				close(((int *)CMSG_DATA(cmsg))[i]);
+			return -E2BIG;
+		}
+		memcpy(fds, CMSG_DATA(cmsg), nr * sizeof(int));
+	}
+
+	if ((um->magic != UPGRADE_MAGIC) || (msg.msg_flags & MSG_CTRUNC)) {
+		for (int i = 0; i < nr; i++)
+			close(fds[i]);
+		return -EPROTO;
+	}
+
+	return nr;
+}
+
+int upgrade_inherit(void)
+{
+	char *env = getenv(UPGRADE_ENV);
+	struct upgrade_msg um = { 0 };
+	int fds[UPGRADE_MAX_FDS];
+	int nr = 0, ret;
+
+	if (!env)
+		return 0;
+
+	upgrade_fd = atoi(env);
+	unsetenv(UPGRADE_ENV);
+	if (fcntl(upgrade_fd, F_SETFD, FD_CLOEXEC)) {
+		upgrade_fd = -1;
+		return -EBADF;
+	}
+
+	do {
+		ret = upgrade_recv(upgrade_fd, &um, fds + nr, UPGRADE_MAX_FDS - nr);
+		if (ret < 0)
+			goto error;
+
+		nr += ret;
+	} while (nr < um.nr_fds);
+
+	if (um.has_cache && nr) {
+		if (cache_load(fds[--nr]))
+			printf("%s: failed to load the index, parse rawlogs\n", __func__);
+		close(fds[nr]);
+	}
+
+	for (int i = 0; i < nr; i++)
+		listen_fd_inherit(fds[i]);
+
+	printf("Upgraded with %d listening sockets of the previous process\n", nr);
+	return 1;
+
+error:
+	while (nr)
+		close(fds[--nr]);
+	return ret;
+}
+
+void upgrade_ready(void)
+{
+	if (upgrade_fd == -1)
+		return;
+
+	if (write(upgrade_fd, "R", 1) != 1)
+		printf("%s: failed to notify the previous process: %m\n", __func__);
+
+	close(upgrade_fd);
+	upgrade_fd = -1;
+}
+
+int upgrade_exec(char **argv)
+{
+	struct upgrade_msg um = { .magic = UPGRADE_MAGIC };
+	struct pollfd pfd;
+	int fds[UPGRADE_MAX_FDS];
+	int sv[2], cache_fd;
+	char env[16], ack;
+	int nr, ret;
+	pid_t pid;
+
+	nr = listen_fd_get_all(fds, UPGRADE_MAX_FDS - 1);
+
+	/* optional, the new process parses rawlogs without it */
+	cache_fd = memfd_create("atophttpd-index", MFD_CLOEXEC);
+	if ((cache_fd >= 0) && !cache_save(cache_fd)) {
+		fds[nr++] = cache_fd;
+		um.has_cache = 1;
+	}
+	um.nr_fds = nr;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv)) {
+		ret = -errno;
+		goto close_cache;
+	}
+
+	snprintf(env, sizeof(env), "%d", sv[1]);
+	setenv(UPGRADE_ENV, env, 1);
+	pid = fork();
+	if (!pid) {
+		sigset_t mask;
+
+		/* the signal mask survives exec, and SIGUSR2 is blocked */
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		fcntl(sv[1], F_SETFD, 0);
+		execvp(argv[0], argv);
+		_exit(127);
+	}
+	ret = -errno;
+	unsetenv(UPGRADE_ENV);
+	close(sv[1]);
+	if (pid < 0)
+		goto close_sock;
+
+	for (int i = 0; !i || (i < nr); i += UPGRADE_FDS_PER_MSG) {
+		int n = nr - i < UPGRADE_FDS_PER_MSG ? nr - i : UPGRADE_FDS_PER_MSG;
+
+		ret = upgrade_send(sv[0], &um, fds + i, n);
+		if (ret)
+			goto kill_child;
+	}
+
+	/* the new process exits or times out, keep serving */
+	pfd.fd = sv[0];
+	pfd.events = POLLIN;
+	ret = poll(&pfd, 1, UPGRADE_TIMEOUT * 1000);
+	if ((ret == 1) && (read(sv[0], &ack, 1) == 1)) {
+		printf("%s: new process %d is ready\n", __func__, pid);
+		ret = 0;
+		goto close_sock;
+	}
+	ret = ret ? -ECHILD : -ETIMEDOUT;
+
+kill_child:
+	printf("%s: new process %d failed: %s\n", __func__, pid, strerror(-ret));
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+
+close_sock:
+	close(sv[0]);
+
+close_cache:
+	if (cache_fd >= 0)
+		close(cache_fd);
+
+	return ret;
+}
+
+void upgrade_notify_systemd(void)
+{
+	const char *path = getenv("NOTIFY_SOCKET");
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	char msg[64];
+	int fd, len;
+
+	if (!path || ((path[0] != '/') && (path[0] != '@')) || (strlen(path) >= sizeof(sun.sun_path)))
+		return;
+
+	memcpy(sun.sun_path, path, strlen(path));
+	if (path[0] == '@')
+		sun.sun_path[0] = '\0';
+
+	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+
+	len = snprintf(msg, sizeof(msg), "MAINPID=%d\nREADY=1\n", getpid());
+	if (sendto(fd, msg, len, 0, (struct sockaddr *)&sun, offsetof(struct sockaddr_un, sun_path) + strlen(path)) < 0)
+		printf("%s: failed to notify systemd: %m\n", __func__);
+
+	close(fd);
+}
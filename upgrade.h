@@ -0,0 +1,49 @@
+/*
+ * Copyright 2023 zhenwei pi
+ *
+ * Authors:
+ *   zhenwei pi <pizhenwei@bytedance.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef _UPGRADE_H_
+#define _UPGRADE_H_
+
+/*
+ * Binary upgrade without a gap of service:
+ * 1, the running process gets SIGUSR2, and executes the binary again with the
+ *    same arguments, a socket to the new process is passed by UPGRADE_ENV.
+ * 2, the listening sockets and a snapshot of the rawlog index are handed over
+ *    by SCM_RIGHTS.
+ * 3, the new process takes the sockets instead of binding new ones, loads the
+ *    index, and tells the old one that it's ready.
+ * 4, the old process stops accepting, serves the accepted connections to the
+ *    end, and exits.
+ * The old process keeps serving if the new one fails to start.
+ */
+#define UPGRADE_ENV	"ATOPHTTPD_UPGRADE_FD"
+
+/* wait the new process to be ready, in seconds */
+#define UPGRADE_TIMEOUT	60
+
+/*
+ * In the new process, receive the sockets and the index from the old one.
+ * Return 1 if it's upgraded, 0 if it's started as usual, or -errno.
+ */
+int upgrade_inherit(void);
+
+/* in the new process, all the workers are listening, let the old one go */
+void upgrade_ready(void);
+
+/*
+ * In the old process, start @argv as the new process and hand over. Return 0
+ * once the new process is ready, then stop accepting, or -errno.
+ */
+int upgrade_exec(char **argv);
+
+/* tell systemd of Type=notify the main pid, it changes by upgrade */
+void upgrade_notify_systemd(void);
+
+#endif
@@ -0,0 +1,697 @@
+/*
+ * Copyright 2023 zhenwei pi
+ *
+ * Authors:
+ *   zhenwei pi <pizhenwei@bytedance.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "httpd.h"
+#include "pool.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#ifdef USE_URING
+#include <liburing.h>
+
+#define URING_ENTRIES		256
+#define URING_BUFS		256	/* provided buffers of a ring, a power of 2 */
+#define URING_BUF_SIZE		2048
+#define URING_BGID		0
+#define URING_MAX_IOVS		64
+#define URING_MAX_ACCEPTS	64
+
+/* user data of a SQE: a connection or a listening fd << 3 | op */
+#define URING_OP_ACCEPT		1
+#define URING_OP_CLOSE		2
+#define URING_OP_RECV		3
+#define URING_OP_WRITEV		4
+#define URING_OP_CANCEL		5
+#define URING_OP_MASK		0x7
+
+/*
+ * The event loop of httpd is readiness based, so the ring fd stands for the
+ * listener in the epoll set: it gets readable once any completion arrives.
+ * The accepted connections are not in the epoll set, they are driven by the
+ * ring. A multishot recv picks the provided buffers for the received bytes,
+ * and a writev is submitted for the responses, linked to the close if it's
+ * the last one. A connection with completions is popped by conn_uring_pending()
+ * as an event of epoll. The submissions of an event loop round go in a single
+ * io_uring_enter.
+ */
+typedef struct uring_connection {
+	connection c;
+	int sockfd;		/* the listening socket, or -1 */
+
+	/* received bytes in a chain of provided buffers */
+	int rx_head;
+	int rx_tail;
+	int rx_off;		/* consumed bytes of rx_head */
+	int rx_end;		/* the recv ended by EOF or error */
+	int rx_err;
+	int recv_armed;
+	int rearm;		/* the recv ended by lack of buffers, in uring_rearm */
+
+	/* the writev in flight, its result is returned by the next writev */
+	int tx_inflight;
+	int tx_done;
+	int tx_res;
+	size_t tx_len;
+	int tx_close;		/* the close is linked to the writev */
+	int closefd;		/* closed by the connection, but the linked close may fail */
+	struct iovec tx_iov[URING_MAX_IOVS];
+
+	int events;		/* EPOLLIN/EPOLLOUT to report */
+	int listed;		/* in the ready list */
+	int freed;		/* by the connection, free it once nothing is in flight */
+	struct uring_connection *prev, *next, *rearm_next;
+} uring_connection;
+
+/* each worker thread owns a ring, a connection never leaves its worker */
+static __thread struct io_uring *uring;
+static __thread struct io_uring_buf_ring *uring_br;
+static __thread char *uring_bufs;
+static __thread int uring_buf_len[URING_BUFS];
+static __thread int uring_buf_next[URING_BUFS];
+static __thread int uring_nr_bufs;	/* free ones in the buffer ring */
+
+/* the accepted fds, reaped ahead of conn_uring_accept() */
+static __thread int uring_accepted[URING_MAX_ACCEPTS];
+static __thread int uring_nr_accepted;
+
+/* connections with events, the ones of this round are popped until round_tail */
+static __thread uring_connection *uring_ready, *uring_ready_tail, *uring_round_tail;
+static __thread int uring_round_started;
+static __thread uring_connection *uring_popped;
+static __thread uring_connection *uring_rearm;
+
+static connection_type CT_Uring;
+static connection_type *CT_Socket;
+
+static const char* conn_uring_get_type(connection* conn) {
+	return CONN_TYPE_URING;
+}
+
+static void uring_init(void) {
+	/* listen/shutdown go to the plain socket, "tcp" is registered ahead of us */
+	CT_Socket = get_conntype_by_name(CONN_TYPE_SOCKET);
+}
+
+static void uring_buf_put(int bid) {
+	io_uring_buf_ring_add(uring_br, uring_bufs + bid * URING_BUF_SIZE, URING_BUF_SIZE, bid,
+			      io_uring_buf_ring_mask(URING_BUFS), 0);
+	io_uring_buf_ring_advance(uring_br, 1);
+	uring_nr_bufs++;
+}
+
+static struct io_uring *uring_get(void) {
+	int ret;
+
+	if (uring)
+		return uring;
+
+	uring = calloc(1, sizeof(struct io_uring));
+	if (!uring)
+		return NULL;
+
+	/*
+	 * No SQPOLL: the polling kernel thread spins on a CPU for each worker,
+	 * that costs more than a submission of each event loop round.
+	 */
+	ret = io_uring_queue_init(URING_ENTRIES, uring, 0);
+	if (ret < 0) {
+		printf("Failed to setup io_uring: %s\n", strerror(-ret));
+		goto free_uring;
+	}
+
+	uring_bufs = malloc(URING_BUFS * URING_BUF_SIZE);
+	if (!uring_bufs)
+		goto exit_queue;
+
+	uring_br = io_uring_setup_buf_ring(uring, URING_BUFS, URING_BGID, 0, &ret);
+	if (!uring_br) {
+		printf("Failed to setup io_uring buffers: %s\n", strerror(-ret));
+		goto free_bufs;
+	}
+
+	for (int bid = 0; bid < URING_BUFS; bid++)
+		uring_buf_put(bid);
+
+	return uring;
+
+free_bufs:
+	free(uring_bufs);
+	uring_bufs = NULL;
+exit_queue:
+	io_uring_queue_exit(uring);
+free_uring:
+	free(uring);
+	uring = NULL;
+	return NULL;
+}
+
+static struct io_uring_sqe *uring_get_sqe(void) {
+	struct io_uring_sqe *sqe;
+
+	sqe = io_uring_get_sqe(uring);
+	if (!sqe) {
+		/* SQ is full, flush it and try again */
+		io_uring_submit(uring);
+		sqe = io_uring_get_sqe(uring);
+	}
+
+	return sqe;
+}
+
+static int uring_arm_accept(int sockfd) {
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	if (!sqe)
+		return -EBUSY;
+
+	io_uring_prep_multishot_accept(sqe, sockfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	io_uring_sqe_set_data64(sqe, (__u64)sockfd << 3 | URING_OP_ACCEPT);
+
+	return io_uring_submit(uring) < 0 ? -EIO : 0;
+}
+
+/* submitted by uring_flush() */
+static int uring_arm_recv(uring_connection *uconn) {
+	struct io_uring_sqe *sqe = uring_get_sqe();
+
+	if (!sqe)
+		return -EBUSY;
+
+	io_uring_prep_recv_multishot(sqe, uconn->c.fd, NULL, 0, 0);
+	io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT);
+	sqe->buf_group = URING_BGID;
+	io_uring_sqe_set_data64(sqe, (__u64)uconn | URING_OP_RECV);
+	uconn->recv_armed = 1;
+
+	return 0;
+}
+
+/* the recv is cancelled ahead of the close, or the socket stays open by it */
+static void uring_close_fd(uring_connection *uconn, int fd) {
+	struct io_uring_sqe *sqe;
+
+	if (uconn->recv_armed) {
+		sqe = uring_get_sqe();
+		if (sqe) {
+			io_uring_prep_cancel64(sqe, (__u64)uconn | URING_OP_RECV, 0);
+			io_uring_sqe_set_data64(sqe, URING_OP_CANCEL);
+		}
+	}
+
+	sqe = uring_get_sqe();
+	if (!sqe) {
+		close(fd);
+		return;
+	}
+
+	io_uring_prep_close(sqe, fd);
+	io_uring_sqe_set_data64(sqe, URING_OP_CLOSE);
+}
+
+static __thread struct pool conn_uring_pool = POOL_INITIALIZER("uring", sizeof(uring_connection), 1024);
+
+/* free it if nothing refers to it any more */
+static void uring_conn_put(uring_connection *uconn) {
+	if (uconn->freed && !uconn->recv_armed && !uconn->tx_inflight && !uconn->listed && !uconn->rearm)
+		pool_free(&conn_uring_pool, uconn);
+}
+
+static void uring_ready_add(uring_connection *uconn, int events) {
+	uconn->events |= events;
+	if (uconn->listed)
+		return;
+
+	uconn->listed = 1;
+	uconn->next = NULL;
+	uconn->prev = uring_ready_tail;
+	if (uring_ready_tail)
+		uring_ready_tail->next = uconn;
+	else
+		uring_ready = uconn;
+	uring_ready_tail = uconn;
+}
+
+static void uring_ready_del(uring_connection *uconn) {
+	if (!uconn->listed)
+		return;
+
+	if (uconn == uring_round_tail)
+		uring_round_tail = (uconn == uring_ready) ? NULL : uconn->prev;
+
+	if (uconn->prev)
+		uconn->prev->next = uconn->next;
+	else
+		uring_ready = uconn->next;
+	if (uconn->next)
+		uconn->next->prev = uconn->prev;
+	else
+		uring_ready_tail = uconn->prev;
+
+	uconn->listed = 0;
+	uconn->events = 0;
+}
+
+/* received bytes or the end of them are not taken yet */
+static int uring_rx_pending(uring_connection *uconn) {
+	return (uconn->rx_head != -1) || uconn->rx_end;
+}
+
+static void uring_recv_done(uring_connection *uconn, int res, unsigned flags) {
+	int bid;
+
+	if (!(flags & IORING_CQE_F_MORE))
+		uconn->recv_armed = 0;
+
+	if (flags & IORING_CQE_F_BUFFER) {
+		bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		uring_nr_bufs--;
+		if ((res <= 0) || (uconn->c.fd == -1)) {
+			uring_buf_put(bid);
+		} else {
+			uring_buf_len[bid] = res;
+			uring_buf_next[bid] = -1;
+			if (uconn->rx_tail != -1)
+				uring_buf_next[uconn->rx_tail] = bid;
+			else
+				uconn->rx_head = bid;
+			uconn->rx_tail = bid;
+		}
+	}
+
+	if (uconn->c.fd == -1)
+		goto put;
+
+	/* out of buffers, or the CQ overflows, arm it again once buffers are back */
+	if (!uconn->recv_armed && ((res > 0) || (res == -ENOBUFS))) {
+		if (!uconn->rearm) {
+			uconn->rearm = 1;
+			uconn->rearm_next = uring_rearm;
+			uring_rearm = uconn;
+		}
+	} else if (!uconn->recv_armed) {
+		uconn->rx_end = 1;
+		uconn->rx_err = res;
+	}
+
+	if ((res > 0) || uconn->rx_end)
+		uring_ready_add(uconn, EPOLLIN);
+
+put:
+	uring_conn_put(uconn);
+}
+
+static void uring_writev_done(uring_connection *uconn, int res) {
+	uconn->tx_inflight = 0;
+	uconn->tx_done = 1;
+	uconn->tx_res = res;
+
+	/* the write is short or failed, so is the linked close */
+	if (uconn->tx_close && (res != uconn->tx_len)) {
+		uconn->tx_close = 0;
+		if (uconn->closefd != -1) {
+			uring_close_fd(uconn, uconn->closefd);
+			uconn->closefd = -1;
+		}
+	}
+
+	if (uconn->c.fd != -1)
+		uring_ready_add(uconn, EPOLLOUT);
+
+	uring_conn_put(uconn);
+}
+
+/* CQ lives in shared memory, reaping completions costs no syscall */
+static void uring_reap(void) {
+	struct io_uring_cqe *cqe;
+	__u64 data;
+	unsigned flags;
+	int res;
+
+	while ((uring_nr_accepted < URING_MAX_ACCEPTS) && !io_uring_peek_cqe(uring, &cqe)) {
+		data = io_uring_cqe_get_data64(cqe);
+		res = cqe->res;
+		flags = cqe->flags;
+		io_uring_cqe_seen(uring, cqe);
+
+		switch (data & URING_OP_MASK) {
+		case URING_OP_ACCEPT:
+			/* the multishot accept terminates on error or overflow, rearm it */
+			if (!(flags & IORING_CQE_F_MORE) && uring_arm_accept(data >> 3))
+				printf("Failed to rearm io_uring accept\n");
+
+			if (res >= 0)
+				uring_accepted[uring_nr_accepted++] = res;
+			else if ((res != -ECONNABORTED) && (res != -ECANCELED))
+				log_debug("io_uring accept failed: %s\n", strerror(-res));
+			break;
+
+		case URING_OP_RECV:
+			uring_recv_done((uring_connection *)(data & ~(__u64)URING_OP_MASK), res, flags);
+			break;
+
+		case URING_OP_WRITEV:
+			uring_writev_done((uring_connection *)(data & ~(__u64)URING_OP_MASK), res);
+			break;
+
+		default:
+			if ((res < 0) && (res != -ECANCELED) && (res != -ENOENT))
+				log_debug("io_uring op %llu failed: %s\n", data & URING_OP_MASK, strerror(-res));
+		}
+	}
+}
+
+static connection* conn_uring_create(int port, char *addr) {
+	uring_connection* uconn = pool_alloc(&conn_uring_pool);
+	if (!uconn)
+		return NULL;
+
+	uconn->c.type = &CT_Uring;
+	uconn->c.fd = -1;
+	uconn->c.port = port;
+	uconn->c.bindaddr = addr;
+	uconn->sockfd = -1;
+	uconn->rx_head = uconn->rx_tail = -1;
+	uconn->closefd = -1;
+
+	return (connection*)uconn;
+}
+
+static void conn_uring_free(connection* conn) {
+	uring_connection* uconn = (uring_connection*)conn;
+
+	if (uconn == uring_popped)
+		uring_popped = NULL;
+
+	uconn->freed = 1;
+	uring_conn_put(uconn);
+}
+
+static int conn_uring_listen(connection* listener) {
+	uring_connection* uconn = (uring_connection*)listener;
+	int ret;
+
+	/* listen is called by the worker thread which polls this listener */
+	if (!uring_get())
+		return -ENOMEM;
+
+	ret = CT_Socket->listen(listener);
+	if (ret)
+		return ret;
+
+	/* io_uring fails accept on a non-blocking socket by -EAGAIN, instead of waiting */
+	uconn->sockfd = listener->fd;
+	fcntl(uconn->sockfd, F_SETFL, fcntl(uconn->sockfd, F_GETFL) & ~O_NONBLOCK);
+	ret = uring_arm_accept(uconn->sockfd);
+	if (ret) {
+		close(uconn->sockfd);
+		uconn->sockfd = listener->fd = -1;
+		return ret;
+	}
+
+	listener->fd = uring->ring_fd;
+	return 0;
+}
+
+static int conn_uring_accept(connection* listener, connection* conn) {
+	uring_reap();
+	if (!uring_nr_accepted)
+		return -EAGAIN;
+
+	conn->fd = uring_accepted[--uring_nr_accepted];
+
+	return uring_arm_recv((uring_connection*)conn);
+}
+
+static void conn_uring_close(connection* conn) {
+	uring_connection* uconn = (uring_connection*)conn;
+	struct io_uring_sync_cancel_reg reg = { .timeout = { -1, -1 } };
+	struct io_uring_sqe *sqe;
+	int fd = conn->fd;
+
+	if (fd == -1)
+		return;
+
+	/* a listener stops accepting, the ring still closes the accepted ones */
+	if (uconn->sockfd != -1) {
+		sqe = uring_get_sqe();
+		if (sqe) {
+			io_uring_prep_cancel64(sqe, (__u64)uconn->sockfd << 3 | URING_OP_ACCEPT, 0);
+			io_uring_sqe_set_data64(sqe, URING_OP_CANCEL);
+			io_uring_submit(uring);
+		}
+		close(uconn->sockfd);
+		uconn->sockfd = conn->fd = -1;
+		return;
+	}
+
+	conn->fd = -1;
+	uring_ready_del(uconn);
+	while (uconn->rx_head != -1) {
+		int bid = uconn->rx_head;
+
+		uconn->rx_head = uring_buf_next[bid];
+		uring_buf_put(bid);
+	}
+	uconn->rx_tail = -1;
+
+	if (!uring) {
+		close(fd);
+		return;
+	}
+
+	/*
+	 * The caller frees the responses once it's closed, cancel the writev in
+	 * flight right now. If it's done already, its completion tells whether
+	 * the linked close is done too.
+	 */
+	if (uconn->tx_inflight) {
+		reg.addr = (__u64)uconn | URING_OP_WRITEV;
+		if (io_uring_register_sync_cancel(uring, &reg) && uconn->tx_close) {
+			uconn->closefd = fd;
+			return;
+		}
+	} else if (uconn->tx_close) {
+		/* the writev is done in full, so is the linked close */
+		return;
+	}
+
+	uconn->tx_close = 0;
+	uring_close_fd(uconn, fd);
+}
+
+/* the submissions of an event loop round go in a single io_uring_enter */
+static void uring_flush(void) {
+	uring_connection *uconn, *next;
+
+	if (!uring)
+		return;
+
+	/* the last one popped has bytes left, Ex, its inbuf is full, report it again */
+	if (uring_popped && uring_rx_pending(uring_popped))
+		uring_ready_add(uring_popped, EPOLLIN);
+	uring_popped = NULL;
+	uring_round_started = 0;
+
+	if (uring_nr_bufs) {
+		for (uconn = uring_rearm, uring_rearm = NULL; uconn; uconn = next) {
+			next = uconn->rearm_next;
+			uconn->rearm = 0;
+			if ((uconn->c.fd != -1) && uring_arm_recv(uconn)) {
+				uconn->rx_end = 1;
+				uconn->rx_err = -EBUSY;
+				uring_ready_add(uconn, EPOLLIN);
+			}
+			uring_conn_put(uconn);
+		}
+	}
+
+	if (io_uring_sq_ready(uring))
+		io_uring_submit(uring);
+}
+
+static int uring_has_pending(void) {
+	return uring && uring_ready;
+}
+
+/* pop the connections with events reaped before this round starts */
+static connection* conn_uring_pending(int *events) {
+	uring_connection *uconn;
+
+	if (!uring)
+		return NULL;
+
+	if (uring_popped && uring_rx_pending(uring_popped))
+		uring_ready_add(uring_popped, EPOLLIN);
+	uring_popped = NULL;
+
+	if (!uring_round_started) {
+		uring_reap();
+		uring_round_tail = uring_ready_tail;
+		uring_round_started = 1;
+	}
+
+	uconn = uring_round_tail ? uring_ready : NULL;
+	if (!uconn)
+		return NULL;
+
+	*events = uconn->events;
+	uring_ready_del(uconn);
+	uring_popped = uconn;
+
+	return (connection*)uconn;
+}
+
+static void conn_uring_shutdown(connection* conn) {
+	CT_Socket->shutdown(conn);
+}
+
+static int conn_uring_read(struct connection* conn, void* buf, size_t buf_len) {
+	uring_connection* uconn = (uring_connection*)conn;
+	size_t copied = 0, len;
+	int bid;
+
+	while ((uconn->rx_head != -1) && (copied < buf_len)) {
+		bid = uconn->rx_head;
+		len = uring_buf_len[bid] - uconn->rx_off;
+		if (len > buf_len - copied)
+			len = buf_len - copied;
+
+		memcpy((char *)buf + copied, uring_bufs + bid * URING_BUF_SIZE + uconn->rx_off, len);
+		copied += len;
+		uconn->rx_off += len;
+		if (uconn->rx_off < uring_buf_len[bid])
+			break;
+
+		uconn->rx_head = uring_buf_next[bid];
+		uconn->rx_off = 0;
+		uring_buf_put(bid);
+	}
+
+	if (uconn->rx_head == -1)
+		uconn->rx_tail = -1;
+
+	if (copied)
+		return copied;
+
+	return uconn->rx_end ? uconn->rx_err : -EAGAIN;
+}
+
+/* the bytes written of the last writev, or -EAGAIN once this one is submitted */
+static int uring_writev(uring_connection* uconn, const struct iovec* iov, int iovcnt, int close) {
+	struct io_uring_sqe *sqe;
+
+	if (uconn->tx_inflight)
+		return -EAGAIN;
+
+	if (uconn->tx_done) {
+		uconn->tx_done = 0;
+		return uconn->tx_res;
+	}
+
+	/* a linked chain is submitted at once */
+	if (io_uring_sq_space_left(uring) < 3)
+		io_uring_submit(uring);
+	if (io_uring_sq_space_left(uring) < 3)
+		return -EBUSY;
+
+	sqe = io_uring_get_sqe(uring);
+
+	if (iovcnt > URING_MAX_IOVS)
+		iovcnt = URING_MAX_IOVS;
+	memcpy(uconn->tx_iov, iov, iovcnt * sizeof(struct iovec));
+	uconn->tx_len = 0;
+	for (int i = 0; i < iovcnt; i++)
+		uconn->tx_len += iov[i].iov_len;
+
+	io_uring_prep_writev(sqe, uconn->c.fd, uconn->tx_iov, iovcnt, 0);
+	io_uring_sqe_set_data64(sqe, (__u64)uconn | URING_OP_WRITEV);
+	uconn->tx_inflight = 1;
+	if (!close)
+		return -EAGAIN;
+
+	/* a short write fails the link, the cancel goes on to the close anyway */
+	io_uring_sqe_set_flags(sqe, IOSQE_IO_LINK);
+	sqe = io_uring_get_sqe(uring);
+	io_uring_prep_cancel64(sqe, (__u64)uconn | URING_OP_RECV, 0);
+	io_uring_sqe_set_data64(sqe, URING_OP_CANCEL);
+	io_uring_sqe_set_flags(sqe, IOSQE_IO_HARDLINK);
+	sqe = io_uring_get_sqe(uring);
+	io_uring_prep_close(sqe, uconn->c.fd);
+	io_uring_sqe_set_data64(sqe, URING_OP_CLOSE);
+	uconn->tx_close = 1;
+
+	return -EAGAIN;
+}
+
+static int conn_uring_writev(struct connection* conn, const struct iovec* iov, int iovcnt) {
+	return uring_writev((uring_connection*)conn, iov, iovcnt, 0);
+}
+
+static int conn_uring_writev_close(struct connection* conn, const struct iovec* iov, int iovcnt) {
+	return uring_writev((uring_connection*)conn, iov, iovcnt, 1);
+}
+
+static int conn_uring_write(struct connection* conn, const void* data, size_t data_len) {
+	struct iovec iov = { .iov_base = (void *)data, .iov_len = data_len };
+
+	return conn_uring_writev(conn, &iov, 1);
+}
+
+/* no sendfile on the ring, the mapping of the file is written instead */
+static int conn_uring_sendfile_copies(struct connection* conn) {
+	return 1;
+}
+
+static int conn_uring_sendfile(struct connection* conn, int fd, off_t offset, size_t len) {
+	return -EOPNOTSUPP;
+}
+
+static connection_type CT_Uring = {
+	.get_type = conn_uring_get_type,
+
+	.init = uring_init,
+	.flush = uring_flush,
+	.has_pending = uring_has_pending,
+	.pending = conn_uring_pending,
+	.configure = NULL,
+	.cleanup = NULL,
+
+	.conn_create = conn_uring_create,
+	.conn_free = conn_uring_free,
+
+	.listen = conn_uring_listen,
+	.accept = conn_uring_accept,
+	.shutdown = conn_uring_shutdown,
+	.close = conn_uring_close,
+
+	.write = conn_uring_write,
+	.writev = conn_uring_writev,
+	.writev_close = conn_uring_writev_close,
+	.sendfile = conn_uring_sendfile,
+	.sendfile_copies = conn_uring_sendfile_copies,
+	.read = conn_uring_read};
+
+int register_conntype_uring() {
+	return conntype_register(&CT_Uring);
+}
+
+#else
+
+int register_conntype_uring() {
+	printf("ConnectionType %s not builtin\n", CONN_TYPE_URING);
+	return -EINVAL;
+}
+
+#endif